@@ -104,6 +104,9 @@ extern int sdkVersion;
 
 %javamethodmodifiers copy ""
 
+//The pixels of a frame are binary, Java apps receive them with onChatVideoData
+%ignore megachat::MegaChatVideoFrame::getBuffer;
+
 #endif
 
 //Generate inheritable wrappers for listener objects
@@ -115,6 +118,7 @@ extern int sdkVersion;
 %feature("director") megachat::MegaChatRoomListener;
 %feature("director") megachat::MegaChatNotificationListener;
 %feature("director") megachat::MegaChatNodeHistoryListener;
+%feature("director") megachat::MegaChatSearchListener;
 
 typedef long long time_t;
 typedef long long uint64_t;
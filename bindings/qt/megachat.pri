@@ -119,6 +119,8 @@ HEADERS  += asyncTest-framework.h \
             base/gcmpp.h \
             base/logger.h \
             base/loggerFile.h \
+            base/loggerAsync.h \
+            base/loggerBinary.h \
             base/loggerConsole.h \
             base/retryHandler.h \
             base/promise.h \
@@ -1,5 +1,6 @@
 #include "cservices.h"
 #include "gcm.h"
+#include "msgPool.h"
 #include <memory>
 #include <thread>
 #include <unordered_map>
@@ -58,7 +59,9 @@ struct HandleItem
     }
 };
 
-std::unordered_map<megaHandle, HandleItem> gHandleStore;
+// a timer adds and removes a handle, so its nodes are pooled as the timers are
+std::unordered_map<megaHandle, HandleItem, std::hash<megaHandle>, std::equal_to<megaHandle>,
+    karere::MsgPoolAllocator<std::pair<const megaHandle, HandleItem>>> gHandleStore;
 megaHandle gHandleCtr = 0;
 
 MEGAIO_EXPORT void* services_hstore_get_handle(unsigned short type, megaHandle handle)
@@ -6,6 +6,7 @@
 #include "karereCommon.h"
 #include "gcm.h"
 #include "logger.h"
+#include "msgPool.h"
 #include <memory>
 #include <assert.h>
 
@@ -16,7 +17,9 @@ namespace karere
  * be used with a std::function or any other object with operator()). It provides
  * type safety since it generates both the message type and the code that processes
  * it. Further, it allows for code optimization as all types are known at compile time
- * and all code is in the same compilation unit, so it can be inlined
+ * and all code is in the same compilation unit, so it can be inlined.
+ * The lambda is stored inline in the message, which is allocated from \c MsgPool,
+ * so posting a call normally doesn't touch the heap.
  */
 template <class F>
 static inline void marshallCall(F&& func, void *appCtx)
@@ -26,6 +29,8 @@ static inline void marshallCall(F&& func, void *appCtx)
         F mFunc;
         Msg(F&& aFunc, megaMessageFunc cHandler)
         : megaMessage(cHandler), mFunc(std::forward<F>(aFunc)){}
+        static void* operator new(size_t size) { return MsgPool::alloc(size); }
+        static void operator delete(void* ptr) { MsgPool::free(ptr); }
 #ifndef NDEBUG
         unsigned magic = 0x3e9a3591;
 #endif
@@ -0,0 +1,105 @@
+// Standalone benchmark of karere::HashIndex against std::map, with the access
+// patterns of the msgid and backrefid indexes of a chat history:
+// g++ -std=c++11 -O2 -I.. hashIndex-bench.cpp -o hashIndex-bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+#include "hashIndex.h"
+
+typedef int32_t Idx;
+static const size_t kHistorySize = 100000;
+static const int kLookupRounds = 10;
+
+template <class F>
+static double timeIt(F&& func)
+{
+    auto start = std::chrono::steady_clock::now();
+    func();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class M>
+static void bench(const char* name, const std::vector<uint64_t>& ids, const std::vector<uint64_t>& misses)
+{
+    M index;
+    size_t found = 0;
+    double tInsert = timeIt([&]()
+    {
+        Idx idx = 0;
+        for (auto id: ids)
+            index.emplace(id, idx++);
+    });
+    double tHit = timeIt([&]()
+    {
+        for (int r = 0; r < kLookupRounds; r++)
+        {
+            for (auto id: ids)
+                found += (index.find(id) != index.end());
+        }
+    });
+    double tMiss = timeIt([&]()
+    {
+        for (int r = 0; r < kLookupRounds; r++)
+        {
+            for (auto id: misses)
+                found += (index.find(id) != index.end());
+        }
+    });
+    if (found != ids.size() * kLookupRounds)
+    {
+        printf("%s: lookup error, found %zu entries\n", name, found);
+        exit(1);
+    }
+    printf("%-10s insert: %8.2f ms, lookup(hit): %8.2f ms, lookup(miss): %8.2f ms\n",
+           name, tInsert, tHit, tMiss);
+}
+
+static void checkErase(const std::vector<uint64_t>& ids)
+{
+    karere::HashIndex<uint64_t, Idx> index;
+    for (size_t i = 0; i < ids.size(); i++)
+        index.emplace(ids[i], (Idx)i);
+    index.emplace(0, -1);
+
+    for (size_t i = 0; i < ids.size(); i += 2)
+        index.erase(ids[i]);
+    index.erase(0);
+
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        auto it = index.find(ids[i]);
+        bool ok = (i % 2) ? (it != index.end() && it->second == (Idx)i) : (it == index.end());
+        if (!ok)
+        {
+            printf("erase: consistency error at entry %zu\n", i);
+            exit(1);
+        }
+    }
+    if (index.size() != ids.size() / 2 || index.find(0) != index.end())
+    {
+        printf("erase: wrong size %zu\n", index.size());
+        exit(1);
+    }
+    printf("erase: ok\n");
+}
+
+int main()
+{
+    std::mt19937_64 rng(12345);
+    std::vector<uint64_t> ids(kHistorySize);
+    std::vector<uint64_t> misses(kHistorySize);
+    for (auto& id: ids)
+        id = rng() | 1;     // odd ids are in the index...
+    for (auto& id: misses)
+        id = rng() & ~1ULL; // ...and even ones are not
+
+    printf("%zu messages, %d lookup rounds\n", kHistorySize, kLookupRounds);
+    bench<std::map<uint64_t, Idx>>("std::map", ids, misses);
+    bench<karere::HashIndex<uint64_t, Idx>>("HashIndex", ids, misses);
+    checkErase(ids);
+    return 0;
+}
@@ -0,0 +1,190 @@
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <utility>
+
+namespace karere
+{
+/** @brief An open-addressing hash table (linear probing) for 64-bit keys, such as
+ * message ids and backreference ids. All entries are stored in a single array, so
+ * a lookup typically touches one cache line, instead of walking the nodes of a tree.
+ * It implements the subset of the \c std::map interface used by the indexes of the
+ * chat history. As with \c std::unordered_map, inserting may invalidate iterators.
+ *
+ * Keys are mixed with a multiplicative hash, so they don't need to be random. The
+ * key zero is valid, and it's stored apart, since it marks the empty slots.
+ */
+template <class K, class V>
+class HashIndex
+{
+public:
+    struct Entry
+    {
+        K first;
+        V second;
+    };
+    typedef Entry* iterator;
+    enum { kMinCapacity = 16 };
+
+protected:
+    std::vector<Entry> mSlots;
+    size_t mCount = 0;      // number of entries in mSlots
+    size_t mMask = 0;
+    int mShift = 64;
+    Entry mZero;            // entry of the key zero, if mHasZero
+    bool mHasZero = false;
+
+    static uint64_t keyVal(const K& key) { return (uint64_t)key; }
+    size_t slotOf(uint64_t key) const
+    {
+        // Fibonacci hashing: the high bits of the product depend on all bits of the key
+        return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> mShift);
+    }
+    Entry* lookup(uint64_t key)
+    {
+        if (mSlots.empty())
+            return nullptr;
+
+        for (size_t i = slotOf(key);; i = (i + 1) & mMask)
+        {
+            Entry& slot = mSlots[i];
+            uint64_t slotKey = keyVal(slot.first);
+            if (slotKey == key)
+                return &slot;
+            if (!slotKey)
+                return nullptr;
+        }
+    }
+    /** Returns the slot where \c key is, or where it should be inserted */
+    Entry& probe(uint64_t key)
+    {
+        for (size_t i = slotOf(key);; i = (i + 1) & mMask)
+        {
+            Entry& slot = mSlots[i];
+            uint64_t slotKey = keyVal(slot.first);
+            if (!slotKey || slotKey == key)
+                return slot;
+        }
+    }
+    void rehash(size_t capacity)
+    {
+        std::vector<Entry> old;
+        old.swap(mSlots);
+        mSlots.resize(capacity, Entry{K((uint64_t)0), V()});
+        mMask = capacity - 1;
+        mShift = 64;
+        for (size_t c = capacity; c > 1; c >>= 1)
+            mShift--;
+        for (auto& entry: old)
+        {
+            if (keyVal(entry.first))
+                probe(keyVal(entry.first)) = std::move(entry);
+        }
+    }
+    /** Keeps the load factor under 1/2, where linear probing is still fast */
+    void reserveOneMore()
+    {
+        if ((mCount + 1) * 2 > mSlots.size())
+            rehash(mSlots.empty() ? (size_t)kMinCapacity : mSlots.size() * 2);
+    }
+
+public:
+    HashIndex(): mZero{K((uint64_t)0), V()} {}
+    size_t size() const { return mCount + (mHasZero ? 1 : 0); }
+    bool empty() const { return !size(); }
+    iterator end() const { return nullptr; }
+    iterator find(const K& key)
+    {
+        uint64_t val = keyVal(key);
+        if (!val)
+            return mHasZero ? &mZero : nullptr;
+        return lookup(val);
+    }
+    size_t count(const K& key) { return find(key) ? 1 : 0; }
+    std::pair<iterator, bool> emplace(const K& key, const V& value)
+    {
+        uint64_t val = keyVal(key);
+        if (!val)
+        {
+            if (mHasZero)
+                return std::make_pair(&mZero, false);
+            mHasZero = true;
+            mZero.second = value;
+            return std::make_pair(&mZero, true);
+        }
+
+        reserveOneMore();
+        Entry& slot = probe(val);
+        if (keyVal(slot.first))
+            return std::make_pair(&slot, false);
+
+        slot.first = key;
+        slot.second = value;
+        mCount++;
+        return std::make_pair(&slot, true);
+    }
+    V& operator[](const K& key)
+    {
+        return emplace(key, V()).first->second;
+    }
+    /** Removes \c key, shifting back the entries of its probe sequence,
+     * so no tombstones are needed */
+    size_t erase(const K& key)
+    {
+        uint64_t val = keyVal(key);
+        if (!val)
+        {
+            bool had = mHasZero;
+            mHasZero = false;
+            return had ? 1 : 0;
+        }
+
+        Entry* entry = lookup(val);
+        if (!entry)
+            return 0;
+
+        size_t hole = entry - &mSlots[0];
+        for (size_t i = (hole + 1) & mMask;; i = (i + 1) & mMask)
+        {
+            uint64_t slotKey = keyVal(mSlots[i].first);
+            if (!slotKey)
+                break;
+
+            // move the entry to the hole, unless its home slot is cyclically in (hole, i]
+            size_t home = slotOf(slotKey);
+            if (((i - home) & mMask) >= ((i - hole) & mMask))
+            {
+                mSlots[hole] = std::move(mSlots[i]);
+                hole = i;
+            }
+        }
+        mSlots[hole] = Entry{K((uint64_t)0), V()};
+        mCount--;
+        return 1;
+    }
+    void clear()
+    {
+        mSlots.clear();
+        mSlots.shrink_to_fit();
+        mCount = 0;
+        mMask = 0;
+        mShift = 64;
+        mHasZero = false;
+    }
+    /** Calls \c func(key, value) for each entry, in no particular order */
+    template <class F>
+    void forEach(F&& func)
+    {
+        if (mHasZero)
+            func(mZero.first, mZero.second);
+        for (auto& slot: mSlots)
+        {
+            if (keyVal(slot.first))
+                func(slot.first, slot.second);
+        }
+    }
+};
+}
+#endif
@@ -4,10 +4,12 @@
 
 #include <stdarg.h>
 #include <string.h>
+#include <algorithm>
 #define KRLOGGER_BUILDING //sets DLLIMPEXPs in logger.h to 'export' mode
 #include "logger.h"
 #include "loggerFile.h"
 #include "loggerConsole.h"
+#include "loggerAsync.h"
 #include "../stringUtils.h" //needed for parsing the KRLOG env variable
 
 #ifdef _WIN32
@@ -91,6 +93,37 @@ void Logger::setAutoFlush(bool enable)
         mFlags |= krLogNoAutoFlush;
 }
 
+void Logger::setAsync(bool enable, bool blockWhenFull, size_t ringSize, bool flushOnCrash)
+{
+    std::lock_guard<std::mutex> asyncLock(mAsyncMutex);
+    AsyncLogWriter* writer = mAsyncWriter;
+    if (!enable)
+    {
+        if (writer)
+            writer->stop();
+        return;
+    }
+    if (!writer)
+    {
+        writer = new AsyncLogWriter(*this);
+        mAsyncWriter = writer;
+    }
+    writer->start(ringSize ? ringSize : (size_t)AsyncLogWriter::kDefaultRingSize,
+        blockWhenFull ? AsyncLogWriter::kBlockWhenFull : AsyncLogWriter::kDropWhenFull, flushOnCrash);
+}
+
+bool Logger::isAsync() const
+{
+    AsyncLogWriter* writer = mAsyncWriter;
+    return writer && writer->isEnabled();
+}
+
+void Logger::flush()
+{
+    if (AsyncLogWriter* writer = mAsyncWriter)
+        writer->flush();
+}
+
 Logger::Logger(unsigned aFlags, const char* timeFmt)
     :mTimeFmt(timeFmt), mFlags(aFlags)
 {
@@ -101,13 +134,12 @@ Logger::Logger(unsigned aFlags, const char* timeFmt)
 }
 
 inline size_t Logger::prependInfo(char* buf, size_t bufSize, const char* prefix, const char* severity,
-                                  unsigned flags)
+                                  unsigned flags, time_t now)
 {
     size_t bytesLogged = 0;
     if ((mFlags & krLogNoTimestamps) == 0)
     {
         buf[bytesLogged++] = '[';
-        time_t now = time(NULL);
         struct tm tmbuf;
         struct tm* tmval = gmtime_r(&now, &tmbuf);
         bytesLogged += strftime(buf+bytesLogged, bufSize-bytesLogged, mTimeFmt.c_str(), tmval);
@@ -139,7 +171,7 @@ void Logger::logv(const char* prefix, krLogLevel level, unsigned flags, const ch
     size_t bytesLogged = prependInfo(buf, LOGGER_SPRINTF_BUF_SIZE, prefix,
         ((flags & krLogNoLevel) && (level > krLogLevelWarn))
             ? NULL
-            :krLogLevelNames[level][0], flags);
+            :krLogLevelNames[level][0], flags, time(NULL));
 
     va_list vaList;
     va_copy(vaList, aVaList);
@@ -191,10 +223,22 @@ void Logger::logString(krLogLevel level, const char* msg, unsigned flags, size_t
         return;
     }
 
-    LockGuard lock(mMutex);
     if (len == (size_t)-1)
         len = strlen(msg);
+    AsyncLogWriter* writer = mAsyncWriter.load(std::memory_order_acquire);
+    if (writer && writer->isEnabled() && writer->push(level, msg, flags, len))
+        return;
 
+    LockGuard lock(mMutex);
+    writeString(level, msg, flags, len);
+}
+
+void Logger::writeString(krLogLevel level, const char* msg, unsigned flags, size_t len)
+{
+    // the lines logged by the backends must not wait for the async writer
+    bool& locked = AsyncLogWriter::holdsLoggerLock();
+    bool wasLocked = locked;
+    locked = true;
     if (mConsoleLogger && ((flags & krLogNoConsole) == 0))
         mConsoleLogger->logString(level, msg, flags);
     if ((mFileLogger) && ((flags & krLogNoFile) == 0))
@@ -208,6 +252,262 @@ void Logger::logString(krLogLevel level, const char* msg, unsigned flags, size_t
                 backend->log(level, msg, len, flags);
         }
     }
+    locked = wasLocked;
+}
+
+void Logger::logArgs(krLogLevel level, unsigned flags, const LogArgs& args)
+{
+    flags |= (mFlags & krGlobalFlagMask);
+    AsyncLogWriter* writer = mAsyncWriter.load(std::memory_order_acquire);
+    if (writer && writer->isEnabled() && writer->push(level, args.data(), flags, args.size(), true))
+        return;
+
+    char buf[LOGGER_SPRINTF_BUF_SIZE];
+    size_t len = formatArgs(level, flags, args.data(), args.size(), buf, sizeof(buf));
+    logString(level, buf, flags, len);
+}
+
+void Logger::writeArgs(krLogLevel level, unsigned flags, const char* data, size_t len)
+{
+    char buf[LOGGER_SPRINTF_BUF_SIZE];
+    size_t lineLen = formatArgs(level, flags, data, len, buf, sizeof(buf));
+    writeString(level, buf, flags, lineLen);
+}
+
+/** Reads the values serialized by LogArgs */
+struct LogArgsReader
+{
+    const char* mPos;
+    const char* mEnd;
+    LogArgsReader(const char* data, size_t len): mPos(data), mEnd(data + len) {}
+    template <class V>
+    V read()
+    {
+        V val;
+        memcpy(&val, mPos, sizeof(V));
+        mPos += sizeof(V);
+        return val;
+    }
+    /** Returns the kind of the next argument, or LogArgs::kNone if there are no more */
+    uint8_t next()
+    {
+        return (mPos < mEnd) ? *mPos++ : (uint8_t)LogArgs::kNone;
+    }
+    int64_t readInt(uint8_t kind)
+    {
+        switch (kind)
+        {
+            case LogArgs::kInt: return read<int64_t>();
+            case LogArgs::kUint: case LogArgs::kPtr: return read<uint64_t>();
+            case LogArgs::kDouble: return (int64_t)read<double>();
+            default: skip(kind); return 0;
+        }
+    }
+    void skip(uint8_t kind)
+    {
+        switch (kind)
+        {
+            case LogArgs::kInt: case LogArgs::kUint: case LogArgs::kPtr: case LogArgs::kDouble:
+                mPos += 8;
+                break;
+            case LogArgs::kDeferred:
+                mPos += sizeof(LogDeferred);
+                break;
+            case LogArgs::kString:
+                mPos += read<uint32_t>() + 1;
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+size_t Logger::formatArgs(krLogLevel level, unsigned flags, const char* data, size_t len, char* buf, size_t bufSize)
+{
+    LogArgs::Header hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    size_t pos = prependInfo(buf, bufSize, hdr.prefix,
+        ((flags & krLogNoLevel) && (level > krLogLevelWarn))
+            ? NULL
+            :krLogLevelNames[level][0], flags, hdr.ts);
+
+    LogArgsReader args(data + sizeof(hdr), len - sizeof(hdr));
+    const size_t end = bufSize - 1;
+    const char* fmt = hdr.fmt;
+    auto append = [&](const char* str, size_t strLen)
+    {
+        if (strLen > end - pos)
+            strLen = end - pos;
+        memcpy(buf + pos, str, strLen);
+        pos += strLen;
+    };
+    while (*fmt && pos < end)
+    {
+        if (*fmt != '%')
+        {
+            const char* next = strchr(fmt, '%');
+            size_t chunk = next ? (size_t)(next - fmt) : strlen(fmt);
+            append(fmt, chunk);
+            fmt += chunk;
+            continue;
+        }
+        if (fmt[1] == '%')
+        {
+            append("%", 1);
+            fmt += 2;
+            continue;
+        }
+
+        // rebuild the conversion spec, with the '*' replaced and without the length modifier.
+        // Width and precision stop at 24 chars, which leaves room for "ll", the conversion and the NUL
+        char spec[32];
+        size_t specLen = 0;
+        spec[specLen++] = *fmt++;
+        while (*fmt && strchr("-+ #0", *fmt) && specLen < 8)
+            spec[specLen++] = *fmt++;
+        for (int part = 0; part < 2; part++)
+        {
+            if (part == 1)
+            {
+                if (*fmt != '.')
+                    break;
+                spec[specLen++] = *fmt++;
+            }
+            if (*fmt == '*')
+            {
+                fmt++;
+                int val = (int)args.readInt(args.next());
+                if (part == 1 && val < 0)
+                {
+                    specLen--; // a negative precision is taken as if it was omitted
+                    continue;
+                }
+                char num[12];
+                snprintf(num, sizeof(num), "%d", val);
+                for (const char* digit = num; *digit && specLen < 24; digit++)
+                    spec[specLen++] = *digit;
+            }
+            else
+            {
+                while (*fmt >= '0' && *fmt <= '9' && specLen < 24)
+                    spec[specLen++] = *fmt++;
+            }
+        }
+        while (*fmt && strchr("hlLqjzt", *fmt))
+            fmt++;
+        char conv = *fmt;
+        if (!conv)
+            break;
+        fmt++;
+
+        char out[64];
+        int outLen = -1;
+        uint8_t kind = args.next();
+        if (kind == LogArgs::kNone)
+        {
+            append("<?>", 3);
+            continue;
+        }
+        switch (conv)
+        {
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            {
+                if (kind == LogArgs::kString || kind == LogArgs::kDeferred)
+                    break;
+                spec[specLen++] = 'l';
+                spec[specLen++] = 'l';
+                spec[specLen++] = conv;
+                spec[specLen] = 0;
+                int64_t val = args.readInt(kind);
+                outLen = (conv == 'd' || conv == 'i')
+                    ? snprintf(out, sizeof(out), spec, (long long)val)
+                    : snprintf(out, sizeof(out), spec, (unsigned long long)val);
+                break;
+            }
+            case 'c':
+            {
+                if (kind == LogArgs::kString || kind == LogArgs::kDeferred)
+                    break;
+                spec[specLen++] = conv;
+                spec[specLen] = 0;
+                outLen = snprintf(out, sizeof(out), spec, (int)args.readInt(kind));
+                break;
+            }
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            {
+                if (kind == LogArgs::kString || kind == LogArgs::kDeferred)
+                    break;
+                spec[specLen++] = conv;
+                spec[specLen] = 0;
+                double val = (kind == LogArgs::kDouble) ? args.read<double>()
+                    : (kind == LogArgs::kUint) ? (double)args.read<uint64_t>()
+                    : (double)args.readInt(kind);
+                outLen = snprintf(out, sizeof(out), spec, val);
+                break;
+            }
+            case 'p':
+            {
+                if (kind != LogArgs::kPtr)
+                    break;
+                spec[specLen++] = conv;
+                spec[specLen] = 0;
+                outLen = snprintf(out, sizeof(out), spec, (void*)(uintptr_t)args.read<uint64_t>());
+                break;
+            }
+            case 's':
+            {
+                spec[specLen++] = conv;
+                spec[specLen] = 0;
+                std::string deferred;
+                const char* str;
+                if (kind == LogArgs::kString)
+                {
+                    uint32_t strLen = args.read<uint32_t>();
+                    str = args.mPos;
+                    args.mPos += strLen + 1;
+                }
+                else if (kind == LogArgs::kDeferred)
+                {
+                    LogDeferred arg = args.read<LogDeferred>();
+                    deferred = arg.format(arg.val);
+                    str = deferred.c_str();
+                }
+                else
+                {
+                    break;
+                }
+                if (specLen == 2) //plain %s, which may not fit in out
+                {
+                    append(str, strlen(str));
+                    continue;
+                }
+                int strOutLen = snprintf(buf + pos, end - pos + 1, spec, str);
+                if (strOutLen > 0)
+                    pos += std::min((size_t)strOutLen, end - pos);
+                continue;
+            }
+            default:
+                break;
+        }
+        if (outLen < 0)
+        {
+            // the argument doesn't match the conversion
+            args.skip(kind);
+            append("<?>", 3);
+            continue;
+        }
+        append(out, std::min((size_t)outLen, sizeof(out) - 1));
+    }
+    buf[pos] = 0;
+    return pos;
+}
+
+void Logger::flushBackends()
+{
+    if (mConsoleLogger)
+        mConsoleLogger->flush();
+    if (mFileLogger)
+        mFileLogger->flush();
 }
 
  void Logger::log(const char* prefix, krLogLevel level, unsigned flags,
@@ -223,12 +523,14 @@ std::shared_ptr<Logger::LogBuffer> Logger::loadLog()
 {
     if (!mFileLogger)
         return NULL;
+    flush();
     LockGuard lock(mMutex);
     return mFileLogger->loadLog();
 }
 
 Logger::~Logger()
 {
+    setAsync(false);
     LockGuard lock(mMutex);
     if (!mUserLoggers.empty())
     {
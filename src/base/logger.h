@@ -70,12 +70,15 @@ enum { krLogChannelCount = 32 };
 #include <string>
 #include <memory>
 #include <mutex>
+#include <atomic>
 #include <map>
 
 namespace karere
 {
 class FileLogger;
 class ConsoleLogger;
+class AsyncLogWriter;
+class LogArgs;
 
 class KRLOGGER_DLLIMPEXP Logger
 {
@@ -89,12 +92,27 @@ protected:
     std::unique_ptr<FileLogger> mFileLogger;
     std::unique_ptr<ConsoleLogger> mConsoleLogger;
     volatile unsigned mFlags;
-    size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags);
+    size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags, time_t now);
 
     /** This is the low-level log function that does the actual logging
-     *  of an assembled single string */
+     *  of an assembled single string, or queues it in async mode */
     void logString(krLogLevel level, const char* msg, unsigned flags, size_t len=(size_t)-1);
+    /** Passes an assembled string to the backends. Must be called with the logger locked */
+    void writeString(krLogLevel level, const char* msg, unsigned flags, size_t len);
+    /** Flushes the console and the log file. Must be called with the logger locked */
+    void flushBackends();
+    /** Logs a line captured by KARERE_LOGB(), or queues it in binary form in async mode */
+    void logArgs(krLogLevel level, unsigned flags, const LogArgs& args);
+    /** Formats a line captured by KARERE_LOGB() and passes it to the backends. Must be
+     * called with the logger locked */
+    void writeArgs(krLogLevel level, unsigned flags, const char* data, size_t len);
+    /** Formats a line captured by KARERE_LOGB(), including the prefix, into \c buf.
+     * @return The length of the line, truncated to \c bufSize-1 */
+    size_t formatArgs(krLogLevel level, unsigned flags, const char* data, size_t len, char* buf, size_t bufSize);
     std::map<std::string, ILoggerBackend*> mUserLoggers;
+    std::atomic<AsyncLogWriter*> mAsyncWriter{nullptr}; //created when the async mode is first enabled, never destroyed
+    std::mutex mAsyncMutex; //serializes setAsync(), which can't hold mMutex while the writer thread is stopping
+    friend class AsyncLogWriter;
 public:
     std::recursive_mutex mMutex;
     typedef std::lock_guard<std::recursive_mutex> LockGuard;
@@ -110,10 +128,28 @@ public:
     void logToConsoleUseColors(bool useColors);
     void logToFile(const char* fileName, size_t rotateSize);
     void setAutoFlush(bool enable=true);
+    /** @brief Enables or disables the async mode, in which the lines are queued by the
+     * threads that log them, and written by a background thread.
+     * @param blockWhenFull Whether a thread whose queue is full waits for the background
+     * thread, or drops the line
+     * @param ringSize The size of the queue of each thread, in bytes. Must be a power of 2.
+     * Zero for the default size
+     * @param flushOnCrash On POSIX systems, write the queued lines when the process receives
+     * a fatal signal, which is then passed to the handlers installed before. The handlers
+     * are installed the first time it's enabled, and kept
+     * \note Disabling it writes the queued lines before returning
+     */
+    void setAsync(bool enable, bool blockWhenFull=false, size_t ringSize=0, bool flushOnCrash=false);
+    bool isAsync() const;
+    /** @brief Writes the lines queued in async mode before returning */
+    void flush();
     Logger(unsigned flags = 0, const char* timeFmt="%m-%d %H:%M:%S");
     void logv(const char* prefix, krLogLevel level, unsigned flags, const char* fmtString, va_list aVaList);
     void log(const char* prefix, krLogLevel level, unsigned flags,
                 const char* fmtString, ...);
+    /** Called by KARERE_LOGB(), which checks the level of the channel */
+    template <class... Args>
+    void logBinary(krLogChannelNo channel, krLogLevel level, const char* fmtString, const Args&... args);
     std::shared_ptr<LogBuffer> loadLog();
 
     /** @brief Registers a user logger with the specified tag.
@@ -156,6 +192,7 @@ public:
 
 extern KRLOGGER_DLLIMPEXP Logger gLogger;
 }
+#include "loggerBinary.h"
 
 #endif //C++
 
@@ -216,6 +253,15 @@ static inline int krLoggerWouldLog(krLogChannelNo channel, krLogLevel level)
 #define KARERE_LOG_ERROR(channel, fmtString,...) KARERE_LOG(channel, krLogLevelError, fmtString, ##__VA_ARGS__)
 #define KARERE_LOG_ALWAYS(channel, fmtString,...) KARERE_LOG(channel, krLogLevelAlways, fmtString, ##__VA_ARGS__)
 
+//Deferred-format logging: the arguments are evaluated only if the channel logs the level,
+//and are captured in binary form. The line is formatted by the writer thread in async mode.
+//The format string must be a literal, see karere::LogArgs
+#define KARERE_LOGB(channel, level, fmtString,...)   \
+    ((level <= krLoggerChannels[channel].logLevel) ?  \
+       karere::gLogger.logBinary(channel, level, fmtString "\n", ##__VA_ARGS__): void(0))
+#define KARERE_LOGB_DEBUG(channel, fmtString,...) KARERE_LOGB(channel, krLogLevelDebug, fmtString, ##__VA_ARGS__)
+#define KARERE_LOGB_INFO(channel, fmtString,...) KARERE_LOGB(channel, krLogLevelInfo, fmtString, ##__VA_ARGS__)
+
 #define KARERE_LOGPP(channel, level, ...) \
     if (level <= krLoggerChannels[channel].logLevel) \
     do { \
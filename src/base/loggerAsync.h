@@ -0,0 +1,514 @@
+#ifndef LOGGERASYNC_H
+#define LOGGERASYNC_H
+
+#include "logger.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+    #include <signal.h>
+#endif
+
+namespace karere
+{
+/** @brief Backend of the asynchronous mode of the Logger.
+ *
+ * Each thread that logs gets a ring buffer, where it copies the formatted lines, or the
+ * arguments captured by KARERE_LOGB() to be formatted by the writer thread, without
+ * taking any lock: the ring has a single producer, the thread, and a single consumer, the
+ * writer thread. The writer thread wakes up every \c kFlushIntervalMs, or earlier when a
+ * ring is half full or a warning or error is logged, and passes the queued lines to the
+ * backends of the Logger in batches, under a single lock and with a single flush.
+ * Lines are numbered when they are queued, so that the lines of all the threads are
+ * written in order.
+ *
+ * When a ring is full, the line is dropped or the thread waits for the writer, depending
+ * on the policy. The number of dropped lines is logged in place of them.
+ * Lines that don't fit in a quarter of the ring are written synchronously, after
+ * flushing the queued ones.
+ * A thread that holds the lock of the logger, i.e. a backend that logs, never waits for
+ * the writer, which needs that lock: its lines are dropped when the ring is full, and
+ * truncated when they don't fit.
+ *
+ * The queued lines are written when the async mode is disabled, by \c flush(), and, on
+ * POSIX systems, when the process receives a fatal signal, if enabled.
+ *
+ * The writer and the rings are never destroyed, as threads may exit, and orphan their
+ * rings, after the Logger is destroyed.
+ */
+class AsyncLogWriter
+{
+public:
+    enum OverflowPolicy
+    {
+        kDropWhenFull,
+        kBlockWhenFull
+    };
+    enum
+    {
+        kDefaultRingSize = 128 * 1024,
+        kFlushIntervalMs = 50
+    };
+    struct Stats
+    {
+        uint64_t queued = 0;
+        uint64_t dropped = 0;
+        uint64_t blocked = 0;       // times a thread waited for the writer
+        uint64_t batches = 0;
+    };
+
+protected:
+    /** Precedes each line in a ring. The line follows, zero-terminated */
+    struct Record
+    {
+        uint32_t size;      // of the record, including the line and the padding
+        uint32_t len;
+        uint64_t seq;
+        unsigned flags;
+        krLogLevel level;   // kPadding for the filler of the end of the ring
+        bool binary;        // captured by KARERE_LOGB(), to be formatted by the writer
+    };
+    enum: krLogLevel { kPadding = (krLogLevel)-1 };
+    // records are aligned to the header size, so that the filler always fits at the end of the ring
+    enum { kHeaderSize = 32 };
+    static_assert(sizeof(Record) <= kHeaderSize, "Record doesn't fit in kHeaderSize");
+
+    struct Ring
+    {
+        char* mBuf;
+        size_t mMask;
+        // written by the producer
+        std::atomic<uint64_t> mHead{0};
+        uint64_t mTailCache = 0;
+        std::atomic<bool> mWriting{false};   // the producer is between checking mEnabled and publishing
+        std::atomic<uint64_t> mDropped{0};
+        char mPadding[64];  // avoids false sharing between the producer and the consumer
+        // written by the consumer
+        std::atomic<uint64_t> mTail{0};
+        uint64_t mDroppedReported = 0;       // by the consumer
+        std::atomic<bool> mOrphaned{false};  // the thread exited
+
+        Ring(size_t size): mBuf(new char[size]), mMask(size - 1) {}
+        ~Ring() { delete[] mBuf; }
+        size_t capacity() const { return mMask + 1; }
+        static char* text(Record* rec) { return reinterpret_cast<char*>(rec) + kHeaderSize; }
+
+        /** Called by the producer. Returns false if there is no space for the line.
+         * @param truncated The last char of the line is replaced by a line break */
+        bool push(uint64_t seq, krLogLevel level, const char* msg, unsigned flags, size_t len, bool binary, bool truncated = false)
+        {
+            uint32_t size = (kHeaderSize + len + 1 + kHeaderSize - 1) & ~(uint32_t)(kHeaderSize - 1);
+            uint64_t head = mHead.load(std::memory_order_relaxed);
+            size_t offset = head & mMask;
+            size_t padding = (capacity() - offset < size) ? capacity() - offset : 0;
+            if (head + padding + size - mTailCache > capacity())
+            {
+                mTailCache = mTail.load(std::memory_order_acquire);
+                if (head + padding + size - mTailCache > capacity())
+                    return false;
+            }
+            if (padding)
+            {
+                Record* filler = reinterpret_cast<Record*>(mBuf + offset);
+                filler->size = padding;
+                filler->level = kPadding;
+                offset = 0;
+            }
+            Record* rec = reinterpret_cast<Record*>(mBuf + offset);
+            rec->size = size;
+            rec->len = len;
+            rec->seq = seq;
+            rec->flags = flags;
+            rec->level = level;
+            rec->binary = binary;
+            memcpy(text(rec), msg, len);
+            if (truncated && len)
+                text(rec)[len - 1] = '\n';
+            text(rec)[len] = 0;
+            mHead.store(head + padding + size, std::memory_order_release);
+            return true;
+        }
+        bool isHalfFull() const
+        {
+            return (mHead.load(std::memory_order_relaxed) - mTail.load(std::memory_order_relaxed)) * 2 > capacity();
+        }
+        /** Called by the consumer. Returns the oldest line before \c head, skipping the
+         * filler at the end of the ring, or nullptr if there is none */
+        Record* front(uint64_t head)
+        {
+            uint64_t tail = mTail.load(std::memory_order_relaxed);
+            if (tail == head)
+                return nullptr;
+            Record* rec = reinterpret_cast<Record*>(mBuf + (tail & mMask));
+            if (rec->level != kPadding)
+                return rec;
+            mTail.store(tail + rec->size, std::memory_order_release);
+            return front(head);
+        }
+        void pop(Record* rec)
+        {
+            mTail.store(mTail.load(std::memory_order_relaxed) + rec->size, std::memory_order_release);
+        }
+    };
+    /** Registers the ring of the thread on its first line, and orphans it when the
+     * thread exits, so that the writer frees it after writing its lines */
+    struct ThreadRing
+    {
+        AsyncLogWriter* mWriter = nullptr;
+        Ring* mRing = nullptr;
+        ~ThreadRing()
+        {
+            if (mRing)
+                mRing->mOrphaned.store(true, std::memory_order_release);
+        }
+    };
+
+    Logger& mLogger;
+    std::atomic<bool> mEnabled{false};
+    OverflowPolicy mPolicy = kDropWhenFull;
+    size_t mRingSize = kDefaultRingSize;
+    std::atomic<uint64_t> mSeq{0};
+    std::mutex mRingsMutex;             // protects mRings
+    std::vector<Ring*> mRings;
+    std::mutex mDrainMutex;             // serializes the consumers: the writer, flush() and the crash handler
+    std::mutex mWakeMutex;              // protects the fields below
+    std::condition_variable mWakeCond;
+    std::condition_variable mFlushedCond;
+    bool mWakeup = false;
+    bool mStop = false;
+    uint64_t mFlushRequested = 0;
+    uint64_t mFlushDone = 0;
+    std::thread mThread;
+    std::atomic<uint64_t> mQueued{0};
+    std::atomic<uint64_t> mBlocked{0};
+    uint64_t mBatches = 0;
+
+    static bool& isWriterThread()
+    {
+        static thread_local bool writer = false;
+        return writer;
+    }
+    Ring* threadRing()
+    {
+        static thread_local ThreadRing tRing;
+        if (tRing.mWriter != this)
+        {
+            Ring* ring = new Ring(mRingSize);
+            {
+                std::lock_guard<std::mutex> lock(mRingsMutex);
+                mRings.push_back(ring);
+            }
+            if (tRing.mRing)
+                tRing.mRing->mOrphaned.store(true, std::memory_order_release);
+            tRing.mWriter = this;
+            tRing.mRing = ring;
+        }
+        return tRing.mRing;
+    }
+    void wakeup()
+    {
+        std::lock_guard<std::mutex> lock(mWakeMutex);
+        mWakeup = true;
+        mWakeCond.notify_one();
+    }
+
+    /** Writes the queued lines, merging the rings in order. Lines logged meanwhile by
+     * this thread, e.g. by a backend, are written synchronously.
+     * @param wait When false, it returns without writing anything if another thread is
+     * writing, or has the logger locked */
+    bool drain(bool wait = true)
+    {
+        std::unique_lock<std::mutex> drainLock(mDrainMutex, std::defer_lock);
+        std::unique_lock<std::recursive_mutex> lock(mLogger.mMutex, std::defer_lock);
+        if (wait)
+        {
+            drainLock.lock();
+            lock.lock();
+        }
+        else if (!drainLock.try_lock() || !lock.try_lock())
+        {
+            return false;
+        }
+        bool& writer = isWriterThread();
+        bool wasWriter = writer;
+        writer = true;
+
+        std::vector<std::pair<Ring*, uint64_t>> rings;  // with the head to drain to
+        std::vector<Ring*> orphans;
+        {
+            std::lock_guard<std::mutex> ringsLock(mRingsMutex);
+            for (auto it = mRings.begin(); it != mRings.end();)
+            {
+                Ring* ring = *it;
+                if (ring->mOrphaned.load(std::memory_order_acquire)
+                 && ring->mTail.load(std::memory_order_relaxed) == ring->mHead.load(std::memory_order_acquire))
+                {
+                    orphans.push_back(ring);
+                    it = mRings.erase(it);
+                    continue;
+                }
+                rings.emplace_back(ring, ring->mHead.load(std::memory_order_acquire));
+                ++it;
+            }
+        }
+        for (Ring* ring: orphans)
+        {
+            reportDropped(ring);
+            delete ring;
+        }
+        for (auto& item: rings)
+        {
+            reportDropped(item.first);
+        }
+        bool written = false;
+        for (;;)
+        {
+            Ring* oldestRing = nullptr;
+            Record* oldest = nullptr;
+            for (auto& item: rings)
+            {
+                Record* rec = item.first->front(item.second);
+                if (rec && (!oldest || rec->seq < oldest->seq))
+                {
+                    oldest = rec;
+                    oldestRing = item.first;
+                }
+            }
+            if (!oldest)
+                break;
+            if (oldest->binary)
+                mLogger.writeArgs(oldest->level, oldest->flags | krLogNoAutoFlush, Ring::text(oldest), oldest->len);
+            else
+                mLogger.writeString(oldest->level, Ring::text(oldest), oldest->flags | krLogNoAutoFlush, oldest->len);
+            oldestRing->pop(oldest);
+            written = true;
+        }
+        if (written)
+        {
+            mBatches++;
+            if ((mLogger.flags() & krLogNoAutoFlush) == 0)
+                mLogger.flushBackends();
+        }
+        writer = wasWriter;
+        return written;
+    }
+    /** Must be called with the logger locked */
+    void reportDropped(Ring* ring)
+    {
+        uint64_t dropped = ring->mDropped.load(std::memory_order_relaxed);
+        if (dropped == ring->mDroppedReported)
+            return;
+        mLogger.log("LOGGER", krLogLevelWarn, 0, "%" PRIu64 " log lines dropped, the ring of the thread was full\n",
+            dropped - ring->mDroppedReported);
+        ring->mDroppedReported = dropped;
+    }
+
+    void run()
+    {
+        isWriterThread() = true;
+        std::unique_lock<std::mutex> lock(mWakeMutex);
+        for (;;)
+        {
+            mWakeCond.wait_for(lock, std::chrono::milliseconds(kFlushIntervalMs), [this]() { return mWakeup || mStop; });
+            mWakeup = false;
+            bool stop = mStop;
+            uint64_t flushRequested = mFlushRequested;
+            lock.unlock();
+            drain();
+            lock.lock();
+            mFlushDone = flushRequested;
+            mFlushedCond.notify_all();
+            if (stop)
+                return;
+        }
+    }
+
+public:
+    AsyncLogWriter(Logger& logger): mLogger(logger) {}
+
+    bool isEnabled() const { return mEnabled.load(std::memory_order_relaxed); }
+
+    /** Set while the thread calls the backends of the logger, with its lock held */
+    static bool& holdsLoggerLock()
+    {
+        static thread_local bool locked = false;
+        return locked;
+    }
+
+    /** Starts the writer thread. The ring size must be a power of 2, and applies to the
+     * rings of the threads that log for the first time afterwards.
+     * @param flushOnCrash Install handlers of the fatal signals that write the queued lines,
+     * and then pass the signal to the handlers installed before */
+    void start(size_t ringSize, OverflowPolicy policy, bool flushOnCrash)
+    {
+        if (mEnabled)
+            return;
+        mRingSize = ringSize;
+        mPolicy = policy;
+        mStop = false;
+        mThread = std::thread([this]() { run(); });
+        mEnabled.store(true, std::memory_order_seq_cst);
+        if (flushOnCrash)
+            installCrashHandlers();
+    }
+
+    /** Stops queuing lines, and writes the queued ones before returning */
+    void stop()
+    {
+        if (!mEnabled)
+            return;
+        mEnabled.store(false, std::memory_order_seq_cst);
+        {
+            // wait for the threads that were queuing a line when they saw the mode enabled
+            std::lock_guard<std::mutex> lock(mRingsMutex);
+            for (Ring* ring: mRings)
+            {
+                while (ring->mWriting.load(std::memory_order_seq_cst))
+                    std::this_thread::yield();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mWakeMutex);
+            mStop = true;
+            mWakeCond.notify_one();
+        }
+        mThread.join();
+    }
+
+    /** Queues a line from any thread, formatted or, if \c binary, captured by KARERE_LOGB().
+     * @return \c false if the line must be written synchronously */
+    bool push(krLogLevel level, const char* msg, unsigned flags, size_t len, bool binary = false)
+    {
+        if (isWriterThread())
+            return false;
+        Ring* ring = threadRing();
+        ring->mWriting.store(true, std::memory_order_seq_cst);
+        if (!mEnabled.load(std::memory_order_seq_cst))
+        {
+            ring->mWriting.store(false, std::memory_order_release);
+            return false;
+        }
+        // the writer can't write anything until this thread releases the lock of the logger
+        bool canWait = !holdsLoggerLock();
+        bool truncated = false;
+        if (kHeaderSize + len >= ring->capacity() / 4)
+        {
+            if (canWait || binary)  // binary lines are formatted by the caller, and pushed again
+            {
+                ring->mWriting.store(false, std::memory_order_release);
+                if (canWait)
+                    flush();
+                return false;
+            }
+            len = ring->capacity() / 4 - kHeaderSize - 1;
+            truncated = true;
+        }
+        uint64_t seq = mSeq.fetch_add(1, std::memory_order_relaxed);
+        bool queued = ring->push(seq, level, msg, flags, len, binary, truncated);
+        if (!queued && mPolicy == kBlockWhenFull && canWait)
+        {
+            mBlocked.fetch_add(1, std::memory_order_relaxed);
+            do
+            {
+                wakeup();
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            } while (!ring->push(seq, level, msg, flags, len, binary, truncated));
+            queued = true;
+        }
+        ring->mWriting.store(false, std::memory_order_release);
+        if (!queued)
+        {
+            ring->mDropped.store(ring->mDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return true;
+        }
+        mQueued.fetch_add(1, std::memory_order_relaxed);
+        if (level <= krLogLevelWarn || ring->isHalfFull())
+            wakeup();
+        return true;
+    }
+
+    /** Returns when the lines queued before the call have been written */
+    void flush()
+    {
+        if (!mEnabled || isWriterThread())
+        {
+            drain();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mWakeMutex);
+        uint64_t target = ++mFlushRequested;
+        mWakeup = true;
+        mWakeCond.notify_one();
+        mFlushedCond.wait(lock, [this, target]() { return mFlushDone >= target || mStop; });
+        if (mFlushDone < target)
+        {
+            lock.unlock();
+            drain();
+        }
+    }
+
+    Stats stats()
+    {
+        Stats stats;
+        stats.queued = mQueued.load(std::memory_order_relaxed);
+        stats.blocked = mBlocked.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> drainLock(mDrainMutex);
+        stats.batches = mBatches;
+        std::lock_guard<std::mutex> lock(mRingsMutex);
+        for (Ring* ring: mRings)
+        {
+            stats.dropped += ring->mDropped.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+protected:
+#ifndef _WIN32
+    static AsyncLogWriter*& crashWriter()
+    {
+        static AsyncLogWriter* writer = nullptr;
+        return writer;
+    }
+    static struct sigaction* prevActions()
+    {
+        static struct sigaction actions[NSIG];
+        return actions;
+    }
+    /** Writes the queued lines on a fatal signal, if no other thread is writing them,
+     * and passes the signal to the previous handler. Not async-signal-safe, but the
+     * process is about to die anyway */
+    static void onCrash(int sig)
+    {
+        if (AsyncLogWriter* writer = crashWriter())
+        {
+            writer->drain(false);
+        }
+        sigaction(sig, &prevActions()[sig], nullptr);
+        raise(sig);
+    }
+    void installCrashHandlers()
+    {
+        if (crashWriter())
+            return;
+        crashWriter() = this;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = onCrash;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESETHAND;
+        for (int sig: {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT})
+        {
+            sigaction(sig, &action, &prevActions()[sig]);
+        }
+    }
+#else
+    void installCrashHandlers() {}
+#endif
+};
+}
+#endif // LOGGERASYNC_H
@@ -0,0 +1,130 @@
+#ifndef LOGGERBINARY_H
+#define LOGGERBINARY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <type_traits>
+
+namespace karere
+{
+/** An argument of KARERE_LOGB() that is captured as a 64-bit value, and converted to a
+ * string by \c format only when the line is formatted, i.e. by the writer thread in
+ * async mode. To be printed with %s */
+struct LogDeferred
+{
+    uint64_t val;
+    std::string (*format)(uint64_t val);
+};
+
+/** @brief The format string and the arguments of a line logged with KARERE_LOGB(),
+ * serialized in binary form.
+ *
+ * The format string must be a literal, as only its address is kept. Integers, enums,
+ * floating point numbers, pointers, LogDeferred values and objects that convert to
+ * uint64_t are copied as they are, and strings are copied up to \c kMaxSize. The line is
+ * formatted by \c Logger::formatArgs(), which accepts the printf conversions, with any
+ * length modifiers, as the values are stored with 64 bits.
+ */
+class LogArgs
+{
+public:
+    enum: uint8_t { kNone = 0, kInt, kUint, kDouble, kString, kPtr, kDeferred };
+    enum { kMaxSize = 1024 };
+    struct Header
+    {
+        time_t ts;
+        const char* fmt;
+        const char* prefix;
+    };
+
+    LogArgs(const char* fmt, const char* prefix): mSize(sizeof(Header))
+    {
+        Header hdr = { time(NULL), fmt, prefix };
+        memcpy(mBuf, &hdr, sizeof(hdr));
+    }
+    const char* data() const { return mBuf; }
+    size_t size() const { return mSize; }
+
+    template <class T>
+    struct Kind
+    {
+        typedef typename std::decay<T>::type D;
+        typedef typename std::remove_cv<typename std::remove_pointer<D>::type>::type Pointee;
+        static constexpr uint8_t value = std::is_same<D, LogDeferred>::value ? kDeferred
+            : std::is_same<D, std::string>::value ? kString
+            : (std::is_pointer<D>::value && std::is_same<Pointee, char>::value) ? kString
+            : std::is_pointer<D>::value ? kPtr
+            : std::is_floating_point<D>::value ? kDouble
+            : (std::is_enum<D>::value || (std::is_integral<D>::value && std::is_signed<D>::value)) ? kInt
+            : (std::is_integral<D>::value || std::is_convertible<D, uint64_t>::value) ? kUint
+            : kNone;
+    };
+
+    void add() {}
+    template <class T, class... Args>
+    void add(const T& arg, const Args&... args)
+    {
+        static_assert(Kind<T>::value != kNone, "KARERE_LOGB: unsupported argument type");
+        put(arg, std::integral_constant<uint8_t, Kind<T>::value>());
+        add(args...);
+    }
+
+protected:
+    char mBuf[kMaxSize];
+    size_t mSize;
+
+    template <class V>
+    void putValue(uint8_t kind, const V& val)
+    {
+        if (mSize + 1 + sizeof(V) > kMaxSize)
+            return;
+        mBuf[mSize++] = kind;
+        memcpy(mBuf + mSize, &val, sizeof(V));
+        mSize += sizeof(V);
+    }
+    template <class T>
+    void put(const T& arg, std::integral_constant<uint8_t, kInt>) { putValue(kInt, static_cast<int64_t>(arg)); }
+    template <class T>
+    void put(const T& arg, std::integral_constant<uint8_t, kUint>) { putValue(kUint, static_cast<uint64_t>(arg)); }
+    template <class T>
+    void put(const T& arg, std::integral_constant<uint8_t, kDouble>) { putValue(kDouble, static_cast<double>(arg)); }
+    template <class T>
+    void put(const T& arg, std::integral_constant<uint8_t, kPtr>) { putValue(kPtr, reinterpret_cast<uint64_t>((const void*)arg)); }
+    void put(const LogDeferred& arg, std::integral_constant<uint8_t, kDeferred>) { putValue(kDeferred, arg); }
+    void put(const std::string& arg, std::integral_constant<uint8_t, kString>) { putString(arg.c_str(), arg.size()); }
+    void put(const char* arg, std::integral_constant<uint8_t, kString>)
+    {
+        if (!arg)
+            arg = "(null)";
+        putString(arg, strlen(arg));
+    }
+    /** Stores the length, and the string including the terminating zero */
+    void putString(const char* str, size_t len)
+    {
+        const size_t overhead = 1 + sizeof(uint32_t) + 1;
+        if (mSize + overhead > kMaxSize)
+            return;
+        if (mSize + overhead + len > kMaxSize)
+            len = kMaxSize - mSize - overhead;
+        uint32_t len32 = len;
+        mBuf[mSize++] = kString;
+        memcpy(mBuf + mSize, &len32, sizeof(len32));
+        mSize += sizeof(len32);
+        memcpy(mBuf + mSize, str, len);
+        mSize += len;
+        mBuf[mSize++] = 0;
+    }
+};
+
+template <class... Args>
+void Logger::logBinary(krLogChannelNo channel, krLogLevel level, const char* fmtString, const Args&... args)
+{
+    auto& chan = logChannels[channel];
+    LogArgs captured(fmtString, chan.display);
+    captured.add(args...);
+    logArgs(level, chan.flags, captured);
+}
+}
+#endif // LOGGERBINARY_H
@@ -51,6 +51,11 @@ public:
         if ((flags & krLogNoAutoFlush) == 0)
             fflush(stdout);
     }
+    void flush()
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
     void setUseColors(bool useColors)
     {
         this->mStdoutIsAtty = isatty(1) && useColors;
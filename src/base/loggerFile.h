@@ -52,10 +52,14 @@ void logString(const char* buf, size_t len, unsigned flags)
     size_t ret = fwrite(buf, 1, len, mFile);
     if (ret != len)
         perror("FileLogger: WARNING: Error writing to log file: ");
-    if ((mFlags & krLogNoAutoFlush) == 0)
+    if (((flags | mFlags) & krLogNoAutoFlush) == 0)
         fflush(mFile);
 }
 
+void flush()
+{
+    fflush(mFile);
+}
 
 std::shared_ptr<Logger::LogBuffer> loadLog() //Logger must be locked!!!
 {
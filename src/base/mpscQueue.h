@@ -0,0 +1,148 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include "msgPool.h"
+
+namespace karere
+{
+/** @brief A lock-free multi-producer, single-consumer queue of pointers.
+ *
+ * Producers push onto a lock-free stack with a single CAS, so threads posting work
+ * never wait for each other nor for the consumer. The consumer takes the whole
+ * stack at once with an atomic exchange, and moves it, reversed, to a FIFO buffer
+ * that only the consumer accesses. Thus, items are popped in the order they were
+ * pushed, and the cost of synchronization is paid once per batch, not per item.
+ *
+ * \c pop(), \c forEach() and \c stats() must be called only by the consumer, or
+ * with whatever lock serializes the consumers.
+ */
+template <class T>
+class MpscQueue
+{
+public:
+    struct Stats
+    {
+        uint64_t popped = 0;
+        size_t maxDepth = 0;
+        uint64_t totalWaitUs = 0;    // time spent in the queue by the popped items
+        uint64_t maxWaitUs = 0;
+        uint64_t avgWaitUs() const { return popped ? totalWaitUs / popped : 0; }
+    };
+
+protected:
+    typedef std::chrono::steady_clock Clock;
+    struct Node
+    {
+        T item;
+        Node* next;
+        Clock::time_point ts;
+        static void* operator new(size_t size) { return MsgPool::alloc(size); }
+        static void operator delete(void* ptr) { MsgPool::free(ptr); }
+    };
+    struct Ready
+    {
+        T item;
+        Clock::time_point ts;
+    };
+
+    std::atomic<Node*> mPushed;     // most recent first
+    std::atomic<size_t> mSize;
+    std::atomic<size_t> mMaxDepth;
+    std::deque<Ready> mReady;       // consumer side, oldest first
+    Stats mStats;
+
+    /** Moves the pushed items to \c mReady. Returns false if there were none */
+    bool collect()
+    {
+        Node* node = mPushed.exchange(nullptr, std::memory_order_acquire);
+        if (!node)
+            return false;
+
+        Node* oldest = nullptr;
+        while (node)
+        {
+            Node* next = node->next;
+            node->next = oldest;
+            oldest = node;
+            node = next;
+        }
+        while (oldest)
+        {
+            Node* next = oldest->next;
+            mReady.push_back(Ready{oldest->item, oldest->ts});
+            delete oldest;
+            oldest = next;
+        }
+        return true;
+    }
+    void onPopped(const Ready& ready)
+    {
+        mSize.fetch_sub(1, std::memory_order_relaxed);
+        uint64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - ready.ts).count();
+        mStats.popped++;
+        mStats.totalWaitUs += waitUs;
+        if (waitUs > mStats.maxWaitUs)
+            mStats.maxWaitUs = waitUs;
+    }
+
+public:
+    MpscQueue(): mPushed(nullptr), mSize(0), mMaxDepth(0) {}
+    ~MpscQueue()
+    {
+        collect();
+    }
+
+    /** Can be called from any thread */
+    void push(T item)
+    {
+        // count the item before publishing it, so the consumer can't pop it and
+        // decrement the size first, which would wrap it around
+        size_t depth = mSize.fetch_add(1, std::memory_order_relaxed) + 1;
+        size_t maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+        while (depth > maxDepth && !mMaxDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed));
+
+        Node* node = new Node{item, mPushed.load(std::memory_order_relaxed), Clock::now()};
+        while (!mPushed.compare_exchange_weak(node->next, node,
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /** Returns the oldest item, or a null one if the queue is empty */
+    T pop()
+    {
+        if (mReady.empty() && !collect())
+            return T();
+
+        Ready ready = mReady.front();
+        mReady.pop_front();
+        onPopped(ready);
+        return ready.item;
+    }
+
+    /** Calls \c func(item) for each queued item, from the oldest, without popping them */
+    template <class F>
+    void forEach(F&& func)
+    {
+        collect();
+        for (auto& ready: mReady)
+        {
+            func(ready.item);
+        }
+    }
+
+    /** Can be called from any thread, but it may be outdated as soon as it returns */
+    size_t size() const { return mSize.load(std::memory_order_relaxed); }
+    bool isEmpty() const { return !size(); }
+
+    Stats stats() const
+    {
+        Stats stats = mStats;
+        stats.maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+}
+#endif
@@ -0,0 +1,352 @@
+#ifndef MSGPOOL_H
+#define MSGPOOL_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+namespace karere
+{
+/** @brief Pool of the small, short-lived objects that are passed between threads, like
+ * marshalled calls and timers.
+ *
+ * Blocks are grouped in size classes of 32 to 512 bytes. Each thread has a freelist per
+ * class, so allocating and freeing a block doesn't need any synchronization. As messages
+ * are usually allocated by one thread and freed by another (the GUI thread), a freelist
+ * that grows beyond \c kMaxCached blocks gives half of them to a shared depot, from which
+ * threads that run out of blocks take them in batches. The depot is bounded as well, so
+ * the memory held by the pool is bounded by the peak of live objects.
+ * Bigger objects are allocated with operator new.
+ *
+ * Objects are pooled by defining their class-specific operator new and delete as:
+ * \code
+ * static void* operator new(size_t size) { return MsgPool::alloc(size); }
+ * static void operator delete(void* ptr) { MsgPool::free(ptr); }
+ * \endcode
+ * The size class is stored with the block, so a derived object can be deleted via a
+ * pointer to its base.
+ */
+class MsgPool
+{
+public:
+    enum
+    {
+        kClassCount = 5,
+        kMinBlockSize = 32,
+        kMaxBlockSize = kMinBlockSize << (kClassCount - 1),
+        kMaxCached = 256,   // blocks per class in the freelist of a thread
+        kMaxDepot = 4096,   // blocks per class in the depot
+        kBatch = kMaxCached / 2
+    };
+    /** Counters for verification and tuning. They are updated with relaxed atomics,
+     * so a snapshot may be slightly inconsistent while other threads are running */
+    struct Stats
+    {
+        uint64_t allocs = 0;        // including the oversized ones
+        uint64_t frees = 0;
+        uint64_t heapAllocs = 0;    // blocks allocated with operator new, when the pool was empty
+        uint64_t heapFrees = 0;     // blocks released to the heap, when the depot was full
+        uint64_t oversized = 0;     // allocations bigger than kMaxBlockSize
+        uint64_t depotGets = 0;     // batches taken from the depot
+        uint64_t depotPuts = 0;     // batches given to the depot
+        uint64_t inUse() const { return allocs - frees; }
+        /** The fraction of the allocations served without calling operator new */
+        double hitRatio() const { return allocs ? 1.0 - double(heapAllocs + oversized) / allocs : 1.0; }
+    };
+
+    static void* alloc(size_t size)
+    {
+        ThreadCache& cache = threadCache();
+        if (!cache.dead)
+            ThreadCache::count(cache.allocs);
+        else
+            globals().counters.allocs.fetch_add(1, std::memory_order_relaxed);
+        int cls = sizeClass(size);
+        if (cls < 0)
+        {
+            globals().counters.oversized.fetch_add(1, std::memory_order_relaxed);
+            Header* hdr = static_cast<Header*>(::operator new(sizeof(Header) + size));
+            hdr->cls = kClassCount;
+            return hdr + 1;
+        }
+
+        FreeList& list = cache.lists[cls];
+        if (!list.head && !cache.dead)
+        {
+            takeFromDepot(list, cls);
+        }
+        Header* hdr = list.pop();
+        if (!hdr)
+        {
+            globals().counters.heapAllocs.fetch_add(1, std::memory_order_relaxed);
+            hdr = static_cast<Header*>(::operator new(sizeof(Header) + blockSize(cls)));
+        }
+        hdr->cls = cls;
+        return hdr + 1;
+    }
+
+    static void free(void* ptr)
+    {
+        if (!ptr)
+            return;
+
+        ThreadCache& cache = threadCache();
+        if (!cache.dead)
+            ThreadCache::count(cache.frees);
+        else
+            globals().counters.frees.fetch_add(1, std::memory_order_relaxed);
+        Header* hdr = static_cast<Header*>(ptr) - 1;
+        int cls = hdr->cls;
+        if (cls == kClassCount)
+        {
+            ::operator delete(hdr);
+            return;
+        }
+
+        Globals& g = globals();
+        if (cache.dead)
+        {
+            // the thread is exiting and its freelists have been released
+            FreeList single;
+            single.push(hdr);
+            std::lock_guard<std::mutex> lock(g.mutex);
+            giveToDepot(single, cls, 1);
+            return;
+        }
+        FreeList& list = cache.lists[cls];
+        list.push(hdr);
+        if (list.count > kMaxCached)
+        {
+            std::lock_guard<std::mutex> lock(g.mutex);
+            giveToDepot(list, cls, kBatch);
+        }
+    }
+
+    static Stats stats()
+    {
+        Globals& g = globals();
+        Counters& counters = g.counters;
+        Stats stats;
+        {
+            std::lock_guard<std::mutex> lock(g.mutex);
+            stats.allocs = counters.allocs.load(std::memory_order_relaxed);
+            stats.frees = counters.frees.load(std::memory_order_relaxed);
+            for (ThreadCache* cache = g.threads; cache; cache = cache->next)
+            {
+                stats.allocs += cache->allocs.load(std::memory_order_relaxed);
+                stats.frees += cache->frees.load(std::memory_order_relaxed);
+            }
+        }
+        stats.heapAllocs = counters.heapAllocs.load(std::memory_order_relaxed);
+        stats.heapFrees = counters.heapFrees.load(std::memory_order_relaxed);
+        stats.oversized = counters.oversized.load(std::memory_order_relaxed);
+        stats.depotGets = counters.depotGets.load(std::memory_order_relaxed);
+        stats.depotPuts = counters.depotPuts.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    static size_t blockSize(int cls) { return (size_t)kMinBlockSize << cls; }
+
+    /** Returns the size class of \c size, or -1 if it's too big to be pooled */
+    static int sizeClass(size_t size)
+    {
+        int cls = 0;
+        for (size_t classSize = kMinBlockSize; size > classSize; classSize <<= 1)
+        {
+            if (++cls == kClassCount)
+                return -1;
+        }
+        return cls;
+    }
+
+protected:
+    /** Precedes each block. The size keeps the alignment of operator new */
+    struct alignas(16) Header
+    {
+        union
+        {
+            int cls;        // while allocated
+            Header* next;   // while in a freelist
+        };
+    };
+    struct FreeList
+    {
+        Header* head = nullptr;
+        size_t count = 0;
+        void push(Header* hdr)
+        {
+            hdr->next = head;
+            head = hdr;
+            count++;
+        }
+        Header* pop()
+        {
+            Header* hdr = head;
+            if (hdr)
+            {
+                head = hdr->next;
+                count--;
+            }
+            return hdr;
+        }
+    };
+    /** Trivially destructible, so that it can be used until the thread exits */
+    struct ThreadCache
+    {
+        FreeList lists[kClassCount];
+        // written only by the owner thread, read by stats()
+        std::atomic<uint64_t> allocs{0};
+        std::atomic<uint64_t> frees{0};
+        ThreadCache* next = nullptr;    // list of live threads, protected by Globals::mutex
+        ThreadCache* prev = nullptr;
+        bool registered = false;
+        bool dead = false;
+        static void count(std::atomic<uint64_t>& counter)
+        {
+            // no read-modify-write needed, as there is a single writer
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    };
+    /** Registers the thread for stats(), and gives its freelists and counters to the
+     * globals when the thread exits */
+    struct ThreadCacheReleaser
+    {
+        ThreadCache& mCache;
+        ThreadCacheReleaser(ThreadCache& cache): mCache(cache)
+        {
+            Globals& g = globals();
+            std::lock_guard<std::mutex> lock(g.mutex);
+            mCache.next = g.threads;
+            if (g.threads)
+                g.threads->prev = &mCache;
+            g.threads = &mCache;
+        }
+        ~ThreadCacheReleaser()
+        {
+            Globals& g = globals();
+            std::lock_guard<std::mutex> lock(g.mutex);
+            for (int cls = 0; cls < kClassCount; cls++)
+            {
+                giveToDepot(mCache.lists[cls], cls, mCache.lists[cls].count);
+            }
+            if (mCache.prev)
+                mCache.prev->next = mCache.next;
+            else
+                g.threads = mCache.next;
+            if (mCache.next)
+                mCache.next->prev = mCache.prev;
+
+            // blocks freed from now on are counted directly in the globals
+            g.counters.allocs.fetch_add(mCache.allocs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            g.counters.frees.fetch_add(mCache.frees.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            mCache.allocs.store(0, std::memory_order_relaxed);
+            mCache.frees.store(0, std::memory_order_relaxed);
+            mCache.dead = true;
+        }
+    };
+    struct Counters
+    {
+        std::atomic<uint64_t> allocs{0};
+        std::atomic<uint64_t> frees{0};
+        std::atomic<uint64_t> heapAllocs{0};
+        std::atomic<uint64_t> heapFrees{0};
+        std::atomic<uint64_t> oversized{0};
+        std::atomic<uint64_t> depotGets{0};
+        std::atomic<uint64_t> depotPuts{0};
+    };
+    struct Globals
+    {
+        std::mutex mutex;                   // protects the depot and the list of threads
+        FreeList depot[kClassCount];
+        ThreadCache* threads = nullptr;
+        Counters counters;
+    };
+
+    static Globals& globals()
+    {
+        // never destroyed, messages may be freed after the static objects
+        static Globals* g = new Globals;
+        return *g;
+    }
+
+    static ThreadCache& threadCache()
+    {
+        static thread_local ThreadCache cache;
+        if (!cache.registered)
+        {
+            cache.registered = true;
+            static thread_local ThreadCacheReleaser releaser(cache);
+            (void)releaser;
+        }
+        return cache;
+    }
+
+    /** Moves up to \c kBatch blocks from the depot to \c list */
+    static void takeFromDepot(FreeList& list, int cls)
+    {
+        Globals& g = globals();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        FreeList& depot = g.depot[cls];
+        if (!depot.head)
+            return;
+
+        g.counters.depotGets.fetch_add(1, std::memory_order_relaxed);
+        for (int i = 0; i < kBatch && depot.head; i++)
+        {
+            list.push(depot.pop());
+        }
+    }
+
+    /** Moves \c count blocks from \c list to the depot, and releases the ones that
+     * don't fit. Must be called with the depot locked */
+    static void giveToDepot(FreeList& list, int cls, size_t count)
+    {
+        Globals& g = globals();
+        FreeList& depot = g.depot[cls];
+        if (count >= kBatch)
+        {
+            g.counters.depotPuts.fetch_add(1, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            Header* hdr = list.pop();
+            if (depot.count < kMaxDepot)
+            {
+                depot.push(hdr);
+            }
+            else
+            {
+                g.counters.heapFrees.fetch_add(1, std::memory_order_relaxed);
+                ::operator delete(hdr);
+            }
+        }
+    }
+};
+
+/** Allocator for node-based containers, whose nodes are allocated one at a time */
+template <class T>
+struct MsgPoolAllocator
+{
+    typedef T value_type;
+    MsgPoolAllocator() {}
+    template <class U>
+    MsgPoolAllocator(const MsgPoolAllocator<U>&) {}
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>((n == 1) ? MsgPool::alloc(sizeof(T)) : ::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t n)
+    {
+        if (n == 1)
+            MsgPool::free(ptr);
+        else
+            ::operator delete(ptr);
+    }
+    template <class U>
+    bool operator==(const MsgPoolAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const MsgPoolAllocator<U>&) const { return false; }
+};
+}
+#endif
@@ -6,9 +6,61 @@
 #define PROMISE_ON_UNHANDLED_ERROR testUnhandledError
 #include <promise.h>
 
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+
 TESTS_INIT();
 using namespace promise;
 
+// Counts the heap allocations, for the benchmarks. All the replaceable forms
+// are defined, so that every new is matched by a delete that uses free()
+static size_t gHeapAllocs = 0;
+void* operator new(size_t size)
+{
+    gHeapAllocs++;
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+/** Runs \c func \c count times, and reports the heap allocations and the time per call */
+template <class F>
+static double bench(const char* name, int count, F&& func)
+{
+    func(); // warm up the pools
+    size_t allocs = gHeapAllocs;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        func();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+    double allocsPerCall = double(gHeapAllocs - allocs) / count;
+    printf("    %-52s %6.2f heap allocs, %8.1f ns\n", name, allocsPerCall, ns);
+    return allocsPerCall;
+}
+
 std::function<void(const std::string&, int, int)> gUnhandledHandler =
 [](const std::string& msg, int type, int code)
 {
@@ -629,6 +681,91 @@ TestGroup("Unhandled promise fail")
         loop.schedCall([pms]() mutable { pms.reject("test"); });
     });
 });
+TestGroup("Benchmarks")
+{
+    syncTest("Allocations and throughput")
+    {
+        const int kCount = 200000;
+        int sum = 0;
+        double allocs;
+        allocs = bench("resolved value", kCount, [&]()
+        {
+            Promise<int> pms(1);
+            sum += pms.value();
+        });
+        check(allocs == 0);
+        allocs = bench("then() on a resolved promise", kCount, [&]()
+        {
+            Promise<int> pms(1);
+            pms.then([&sum](int x) { sum += x; });
+        });
+        check(allocs == 0);
+        allocs = bench("then()->then() on a resolved promise", kCount, [&]()
+        {
+            Promise<int> pms(1);
+            pms.then([](int x) { return x + 1; })
+               .then([&sum](int x) { sum += x; });
+        });
+        check(allocs == 0);
+        allocs = bench("then()->fail(), then resolve", kCount, [&]()
+        {
+            Promise<int> pms;
+            pms.then([&sum](int x) { sum += x; })
+               .fail([](const Error& err) {});
+            pms.resolve(1);
+        });
+        check(allocs == 0);
+        allocs = bench("then()->fail(), then reject", kCount, [&]()
+        {
+            Promise<int> pms;
+            pms.then([&sum](int x) { sum += x; })
+               .fail([&sum](const Error& err) { sum++; });
+            pms.reject("test");
+        });
+        check(allocs <= 2); // the Error
+        allocs = bench("then() returning a pending promise, then resolve", kCount, [&]()
+        {
+            Promise<int> pms;
+            Promise<int> inner;
+            pms.then([inner](int x) { return inner; })
+               .then([&sum](int x) { sum += x; });
+            pms.resolve(1);
+            inner.resolve(2);
+        });
+        check(allocs == 0);
+        allocs = bench("chain of 10 then()-s, then resolve", kCount / 10, [&]()
+        {
+            Promise<int> pms;
+            auto next = pms.then([](int x) { return x + 1; });
+            for (int i = 0; i < 8; i++)
+            {
+                next = next.then([](int x) { return x + 1; });
+            }
+            next.then([&sum](int x) { sum += x; });
+            pms.resolve(0);
+        });
+        check(allocs == 0);
+        allocs = bench("big capture, then resolve", kCount, [&]()
+        {
+            std::pair<std::string, std::string> strings("test123", "test456");
+            int64_t a = 1, b = 2, c = 3, d = 4, e = 5;
+            Promise<int> pms;
+            pms.then([&sum, strings, a, b, c, d, e](int x) { sum += x + a + b + c + d + e; });
+            pms.resolve(1);
+        });
+        check(allocs == 0);
+        allocs = bench("when() of 4 promises", kCount / 4, [&]()
+        {
+            std::vector<Promise<void>> pmsList(4);
+            when(pmsList).then([&sum]() { sum++; });
+            for (auto& pms: pmsList)
+            {
+                pms.resolve();
+            }
+        });
+        check(sum);
+    });
+});
 
 return test::gNumFailed;
 }
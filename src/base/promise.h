@@ -7,7 +7,9 @@
 #include <string>
 #include <utility>
 #include <memory>
+#include <type_traits>
 #include <assert.h>
+#include "msgPool.h"
 
 /** @brief The name of the unhandled promise error handler. This handler is
  * called when a promise fails, but the user has not provided a fail() callback
@@ -142,61 +144,107 @@ public:
     virtual ~PromiseBase(){}
 };
 
-template <class C>
+/** @brief The callbacks attached to a promise with then() or fail().
+ * Most promises have a single then() and/or fail() callback, so the first one is
+ * constructed in an inline buffer if it fits, and further callbacks are allocated
+ * from karere::MsgPool. Callbacks are created with emplace(), and C must provide
+ * relocate(), to move an inline callback when the list is moved to another promise.
+ */
+template <class C, size_t InlineSize>
 class CallbackList
 {
 protected:
-    std::vector<C*> items;
-public:
-    CallbackList(){}
-/**
- * Takes ownership of callback, copies the promise.
- * Accepts the callback as a smart pointer of type SP.
- * This is because the method can throw if the list is full,
- * and in this case the smartpointer will prevent the pointer leak.
-*/
-    template<class SP>
-    inline void push(SP& cb)
-    {
-        items.push_back(cb.release());
+    C* mFirst = nullptr;
+    std::vector<C*> mMore;
+    typename std::aligned_storage<InlineSize>::type mInline;
+    bool mInlineUsed = false;
+    bool isInline(const C* item) const { return (const void*)item == (const void*)&mInline; }
+    void push(C* item)
+    {
+        if (!mFirst)
+            mFirst = item;
+        else
+            mMore.push_back(item);
     }
-
-    inline C*& operator[](int idx)
+    void destroy(C* item)
     {
-        assert((idx >= 0) && (idx < (int)items.size()));
-        return items[idx];
+        if (isInline(item))
+            item->~C();
+        else
+            delete item;
     }
-    inline const C*& operator[](int idx) const
+public:
+    CallbackList(){}
+    CallbackList(const CallbackList&) = delete;
+    CallbackList& operator=(const CallbackList&) = delete;
+/** Constructs a callback of type CB, and takes its ownership. The storage for it
+ * is reserved first, so the callback can't be leaked if push() throws */
+    template <class CB, class... Args>
+    inline C* emplace(Args&&... args)
+    {
+        if (mFirst && (mMore.size() == mMore.capacity()))
+            mMore.reserve(mMore.empty() ? 4 : mMore.size() * 2);
+
+        C* item;
+        if (!mInlineUsed && (sizeof(CB) <= InlineSize))
+        {
+            item = new (&mInline) CB(std::forward<Args>(args)...);
+            mInlineUsed = true;
+        }
+        else
+        {
+            item = new CB(std::forward<Args>(args)...);
+        }
+        push(item);
+        return item;
+    }
+    inline C* operator[](int idx) const
     {
-        assert((idx >= 0) && (idx < items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < count()));
+        return idx ? mMore[idx - 1] : mFirst;
     }
-    inline C*& first()
+    inline C* first() const
     {
-        assert(!items.empty());
-        return items[0];
+        assert(mFirst);
+        return mFirst;
     }
     inline int count() const
     {
-        return items.size();
+        return mFirst ? (int)mMore.size() + 1 : 0;
     }
-    inline void addListMoveItems(CallbackList& other)
+    void addListMoveItems(CallbackList& other)
     {
-        items.insert(items.end(), other.items.begin(), other.items.end());
-        other.items.clear();
+        int cnt = other.count();
+        for (int i = 0; i < cnt; i++)
+        {
+            C* item = other[i];
+            if (other.isInline(item))
+            {
+                // it can't stay in the other list's buffer
+                item = static_cast<C*>(item->relocate(mInlineUsed ? nullptr : &mInline, InlineSize));
+                if (isInline(item))
+                    mInlineUsed = true;
+            }
+            push(item);
+        }
+        other.mFirst = nullptr;
+        other.mMore.clear();
+        other.mInlineUsed = false;
     }
     void clear()
     {
-        static_assert(std::is_base_of<IVirtDtor, C>::value, "Callback type must be inherited from IVirtDtor");
-        for (auto it = items.begin(); it != items.end(); it++)
+        int cnt = count();
+        for (int i = 0; i < cnt; i++)
         {
-            delete ((IVirtDtor*)*it); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+            destroy((*this)[i]);
         }
-        items.clear();
+        mFirst = nullptr;
+        mMore.clear();
+        mInlineUsed = false;
     }
     ~CallbackList()
     {
-        assert(items.empty());
+        assert(!mFirst);
     }
 };
 
@@ -213,6 +261,14 @@ protected:
     {
         virtual void operator()(const P&) = 0;
         virtual void rejectNextPromise(const Error&) = 0;
+        /** Moves the callback to \c buf if it's not null and the callback fits in
+         * \c bufSize bytes, or to the pool otherwise. Must be called only for callbacks
+         * constructed in an inline buffer, as it destroys this one but doesn't free it */
+        virtual ICallback* relocate(void* buf, size_t bufSize) = 0;
+        static void* operator new(size_t size) { return karere::MsgPool::alloc(size); }
+        static void* operator new(size_t, void* where) { return where; }
+        static void operator delete(void* ptr) { karere::MsgPool::free(ptr); }
+        static void operator delete(void*, void*) {}
     };
 
     template <class P, class TP>
@@ -224,60 +280,51 @@ protected:
         ICallbackWithPromise(const Promise<TP>& next): nextPromise(next){}
     };
 
-    template <class P, class CB, class TP=int>
-    struct Callback: public ICallbackWithPromise<P, TP>
+/** A then() or fail() callback. \c In is the type of its parameter, \c RealOut is its
+ * return type, and \c Out is the type of the promise returned by then() or fail(),
+ * which is resolved or rejected with the result of the callback */
+    template <class In, class Out, class RealOut, class CB>
+    struct Callback: public ICallbackWithPromise<In, Out>
     {
     protected:
         CB mCb;
     public:
-        virtual void operator()(const P& arg) { mCb(arg, *this); }
-        Callback(CB&& cb, const Promise<TP>& next)
-            :ICallbackWithPromise<P, TP>(next), mCb(std::forward<CB>(cb)){}
-        CB& callback() { return mCb; }
+        template <class F>
+        Callback(F&& cb, const Promise<Out>& next)
+            :ICallbackWithPromise<In, Out>(next), mCb(std::forward<F>(cb)){}
+        Callback(Callback&& other)
+            :ICallbackWithPromise<In, Out>(other.nextPromise), mCb(std::move(other.mCb)){}
+        virtual void operator()(const In& arg)
+        {
+            invokeCb<In, Out, RealOut>(mCb, arg, this->nextPromise);
+        }
+        virtual ICallback<In>* relocate(void* buf, size_t bufSize)
+        {
+            Callback* moved = (buf && (sizeof(Callback) <= bufSize))
+                ? new (buf) Callback(std::move(*this))
+                : new Callback(std::move(*this));
+            this->~Callback();
+            return moved;
+        }
     };
     typedef ICallback<typename MaskVoid<T>::type> ISuccessCb;
     typedef ICallback<Error> IFailCb;
     typedef ICallbackWithPromise<Error, T> IFailCbWithPromise;
 
-    template <class CB, class TP>
-    struct SuccessCb: public Callback<typename MaskVoid<T>::type, CB, TP>
-    {
-        SuccessCb(CB&& cb, const Promise<TP>& next) //can't use ctotr inharitance because MSVC 2013 does not support it
-            :Callback<typename MaskVoid<T>::type, CB, TP>(std::forward<CB>(cb), next){}
-    };
-
-    template <class CB>
-    struct FailCb: public Callback<Error, CB, T>
-    {
-        FailCb(CB&& cb, const Promise<T>& next)
-        :Callback<Error, CB, T>(std::forward<CB>(cb), next){}
-    };
-/** Helper funtion to be able to deduce the callback type of the passed lambda and create and
-  * Callback object with that type. We cannot do that by directly calling the Callback constructor
-  */
-    template <class P, class CB, class TP>
-    ICallback<typename MaskVoid<P>::type>* createCb(CB&& cb, Promise<TP>& next)
-    {
-        return new Callback<typename MaskVoid<P>::type, CB, TP>(std::forward<CB>(cb), next);
-    }
+    /** Callbacks up to this size are stored inside the SharedObj */
+    enum { kInlineCbSize = 64 };
 //===
     struct SharedObj
     {
-        struct CbLists
-        {
-            CallbackList<ISuccessCb> mSuccessCbs;
-            CallbackList<IFailCb> mFailCbs;
-        };
         int mRefCount;
-        CbLists* mCbs;
         ResolvedState mResolved;
-        bool mPending;
         Promise<T> mMaster;
         typename MaskVoid<typename std::remove_const<T>::type>::type mResult;
         Error mError;
+        CallbackList<ISuccessCb, kInlineCbSize> mSuccessCbs;
+        CallbackList<IFailCb, kInlineCbSize> mFailCbs;
         SharedObj()
-        :mRefCount(1), mCbs(NULL), mResolved(kNotResolved),
-         mPending(false), mMaster(_Empty())
+        :mRefCount(1), mResolved(kNotResolved), mMaster(_Empty())
         {
             PROMISE_LOG_REF("%p: addRef -> 1 (SharedObj ctor)", this);
         }
@@ -299,19 +346,12 @@ protected:
         }
         ~SharedObj()
         {
-            if (mCbs)
-            {
-                mCbs->mSuccessCbs.clear();
-                mCbs->mFailCbs.clear();
-                delete mCbs;
-            }
-        }
-        inline CbLists& cbs()
-        {
-            if (!mCbs)
-                mCbs = new CbLists;
-            return *mCbs;
+            mSuccessCbs.clear();
+            mFailCbs.clear();
         }
+        // promises are created and destroyed all the time, keep them off the heap
+        static void* operator new(size_t size) { return karere::MsgPool::alloc(size); }
+        static void operator delete(void* ptr) { karere::MsgPool::free(ptr); }
     };
 
     template <typename Ret>
@@ -321,21 +361,76 @@ protected:
     struct RemovePromise<Promise<Ret> >
     {  typedef typename std::remove_const<Ret>::type Type;  };
 
+    template <typename Ret>
+    struct IsPromise: public std::false_type {};
+    template <typename Ret>
+    struct IsPromise<Promise<Ret> >: public std::true_type {};
+
 //===
     struct CallCbHandleVoids
     {
-        template<class Out, class CbOut, class In, class CB, class=typename std::enable_if<!std::is_same<In,_Void>::value && !std::is_same<CbOut, void>::value, int>::type>
-        static Promise<Out> call(CB& cb, const In& val) {  return cb(val);  }
+        template<class CbOut, class In, class CB, class=typename std::enable_if<!std::is_same<In,_Void>::value, int>::type>
+        static CbOut call(CB& cb, const In& val) {  return cb(val);  }
 
-        template<class Out, class CbOut, class In, class CB, class=typename std::enable_if<std::is_same<In,_Void>::value && !std::is_same<CbOut, void>::value, int>::type>
-        static Promise<Out> call(CB& cb, const _Void& /*val*/) {  return cb();   }
-
-        template<class Out, class CbOut, class In, class CB, class=typename std::enable_if<!std::is_same<In,_Void>::value && std::is_same<CbOut,void>::value, int>::type>
-        static Promise<void> call(CB& cb, const In& val){ cb(val); return _Void(); }
-
-        template<class Out, class CbOut, class In, class CB, class=typename std::enable_if<std::is_same<In,_Void>::value && std::is_same<CbOut,void>::value, int>::type>
-        static Promise<void> call(CB& cb, const _Void& /*val*/) { cb(); return _Void(); }
+        template<class CbOut, class In, class CB, class=typename std::enable_if<std::is_same<In,_Void>::value, int>::type>
+        static CbOut call(CB& cb, const _Void& /*val*/) {  return cb();   }
     };
+/** Calls a then() or fail() callback, and settles the chaining promise \c next with its
+ * result, which can be void, a value, an Error or a promise. Values are passed on
+ * directly, without wrapping them in a promise */
+    template <class Out, class CbOut, class In, class CB>
+    static typename std::enable_if<std::is_same<CbOut, void>::value>::type
+    settle(CB& cb, const In& val, Promise<Out>& next)
+    {
+        CallCbHandleVoids::template call<CbOut, In>(cb, val);
+        next.resolve(_Void());
+    }
+    template <class Out, class CbOut, class In, class CB>
+    static typename std::enable_if<IsPromise<typename std::decay<CbOut>::type>::value>::type
+    settle(CB& cb, const In& val, Promise<Out>& next)
+    {
+        next.follow(CallCbHandleVoids::template call<CbOut, In>(cb, val));
+    }
+    template <class Out, class CbOut, class In, class CB>
+    static typename std::enable_if<std::is_base_of<Error, typename std::decay<CbOut>::type>::value>::type
+    settle(CB& cb, const In& val, Promise<Out>& next)
+    {
+        next.reject(CallCbHandleVoids::template call<CbOut, In>(cb, val));
+    }
+    template <class Out, class CbOut, class In, class CB>
+    static typename std::enable_if<!std::is_same<CbOut, void>::value
+        && !IsPromise<typename std::decay<CbOut>::type>::value
+        && !std::is_base_of<Error, typename std::decay<CbOut>::type>::value>::type
+    settle(CB& cb, const In& val, Promise<Out>& next)
+    {
+        next.resolve(CallCbHandleVoids::template call<CbOut, In>(cb, val));
+    }
+/** Calls a then() or fail() callback, converting exceptions to a rejection of
+ * the chaining promise \c next */
+    template <class In, class Out, class RealOut, class CB>
+    static void invokeCb(CB& cb, const In& val, Promise<Out>& next)
+    {
+        try
+        {
+            settle<Out, RealOut, In>(cb, val, next);
+        }
+        catch(std::exception& e)
+        {
+            next.reject(Error(e.what(), kErrException));
+        }
+        catch(Error& e)
+        {
+            next.reject(e);
+        }
+        catch(const char* e)
+        {
+            next.reject(Error(e, kErrException));
+        }
+        catch(...)
+        {
+            next.reject(Error("(unknown exception type)", kErrException));
+        }
+    }
 //===
     void reset(SharedObj* other=NULL)
     {
@@ -349,8 +444,8 @@ protected:
             mSharedObj->ref();
         }
     }
-    inline CallbackList<ISuccessCb>& thenCbs() {return mSharedObj->cbs().mSuccessCbs;}
-    inline CallbackList<IFailCb>& failCbs() {return mSharedObj->cbs().mFailCbs;}
+    inline CallbackList<ISuccessCb, kInlineCbSize>& thenCbs() {return mSharedObj->mSuccessCbs;}
+    inline CallbackList<IFailCb, kInlineCbSize>& failCbs() {return mSharedObj->mFailCbs;}
     SharedObj* mSharedObj;
     template <class FT> friend class Promise;
 public:
@@ -455,71 +550,46 @@ protected:
         return ret;
     }
 
-/** Creates a wrapper function around a then() or fail() handler that handles exceptions and propagates
- * the result to resolve/reject chained promises. \c In is the type of the callback's parameter,
- * \c Out is its return type, \c CB is the type of the callback itself.
+/** Settles this promise like \c other, which was returned by a then() or fail()
+ * callback. If \c other is not resolved yet, this promise attaches to its master,
+ * and moves its callbacks to it
  */
-    template <typename In, typename Out, typename RealOut, class CB>
-    ICallback<In>* createChainedCb(CB&& cb, Promise<Out>& next)
+    void follow(Promise<T> other)
     {
-        //cb must have the singature Promise<Out>(const In&)
-        return createCb<In>(
-            [cb](const In& result, ICallbackWithPromise<typename MaskVoid<In>::type, Out >& handler)
-            mutable->void
+        Promise<T>& master = other.getMaster(); //master is the promise that actually gets resolved, equivalent to the 'deferred' object
+        auto state = master.mSharedObj->mResolved;
+        if (state == kSucceeded)
         {
-            Promise<Out>& next = handler.nextPromise; //the 'chaining' promise
-            Promise<Out> promise((_Empty())); //the promise returned by the user callback
-            try
-            {
-                promise = CallCbHandleVoids::template call<Out, RealOut, In>(cb, result);
-            }
-            catch(std::exception& e)
-            {
-                next.reject(Error(e.what(), kErrException));
-                return;
-            }
-            catch(Error& e)
-            {
-                next.reject(e);
-                return;
-            }
-            catch(const char* e)
-            {
-                next.reject(Error(e, kErrException));
-                return;
-            }
-            catch(...)
-            {
-                next.reject(Error("(unknown exception type)", kErrException));
-                return;
-            }
-
-// connect the promise returned by the user's callback (actually its master)
-// to the chaining promise, returned earlier by then() or fail()
-            Promise<Out>& master = promise.getMaster(); //master is the promise that actually gets resolved, equivalent to the 'deferred' object
-            assert(!next.hasMaster());
-            next.mSharedObj->mMaster = master; //makes 'next' attach subsequently added callbacks to 'master'
-            assert(next.hasMaster());
-            // Move the callbacks and errbacks of 'next' to 'master'
-            if (!master.hasCallbacks())
-            {
-                master.mSharedObj->mCbs = next.mSharedObj->mCbs;
-                next.mSharedObj->mCbs = nullptr;
-            }
+            // nobody else can access the value if we hold the only reference
+            if (!other.hasMaster() && (other.mSharedObj->mRefCount == 1))
+                resolve(std::move(other.mSharedObj->mResult));
             else
-            {
-                auto& nextCbs = next.thenCbs();
-                if (nextCbs.count())
-                    master.thenCbs().addListMoveItems(nextCbs);
+                resolve(master.mSharedObj->mResult);
+            return;
+        }
+        if (state == kFailed)
+        {
+            reject(master.mSharedObj->mError);
+            return;
+        }
 
-                auto& nextEbs = next.failCbs();
-                if (nextEbs.count())
-                    master.failCbs().addListMoveItems(nextEbs);
-            }
-            //====
-            if (master.mSharedObj->mPending)
-                master.doPendingResolveOrFail();
-        }, next);
+        assert(!hasMaster());
+        mSharedObj->mMaster = master; //makes 'this' attach subsequently added callbacks to 'master'
+        assert(hasMaster());
+        // Move our callbacks and errbacks to 'master'
+        master.thenCbs().addListMoveItems(thenCbs());
+        master.failCbs().addListMoveItems(failCbs());
+    }
+/** The promise returned by then() when this promise is already rejected */
+    template <class Out>
+    Promise<Out> rejected(typename std::enable_if<std::is_same<Out, T>::value, int>::type=0)
+    {
+        return *this;
+    }
+    template <class Out>
+    Promise<Out> rejected(typename std::enable_if<!std::is_same<Out, T>::value, int>::type=0)
+    {
+        return mSharedObj->mError;
     }
 
 public:
@@ -535,23 +605,23 @@ public:
         if (mSharedObj->mMaster.mSharedObj) //if we are a slave promise (returned by then() or fail()), forward callbacks to our master promise
             return mSharedObj->mMaster.then(std::forward<F>(cb));
 
+        typedef typename FuncTraits<F>::RetType RealOut;
+        typedef typename RemovePromise<RealOut>::Type Out;
+        typedef typename MaskVoid<T>::type In;
         if (mSharedObj->mResolved == kFailed)
-            return mSharedObj->mError;
+            return rejected<Out>();
 
-        typedef typename RemovePromise<typename FuncTraits<F>::RetType>::Type Out;
         Promise<Out> next;
-
-        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
-            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
-
         if (mSharedObj->mResolved == kSucceeded)
         {
-            (*resolveCb)(mSharedObj->mResult);
+            // call it right away, no need to store it
+            invokeCb<In, Out, RealOut>(cb, mSharedObj->mResult, next);
         }
         else
         {
             assert((mSharedObj->mResolved == kNotResolved));
-            thenCbs().push(resolveCb);
+            thenCbs().template emplace<Callback<In, Out, RealOut, typename std::decay<F>::type>>(
+                std::forward<F>(cb), next);
         }
 
         return next;
@@ -574,21 +644,20 @@ public:
             return master.fail(std::forward<F>(eb));
 
         if (mSharedObj->mResolved == kSucceeded)
-            return mSharedObj->mResult; //don't call the errorback, just return the successful resolve value
+            return *this; //don't call the errorback, the next promise has our value
 
+        typedef typename FuncTraits<F>::RetType RealOut;
         Promise<T> next;
-        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
-            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
-
         if (mSharedObj->mResolved == kFailed)
         {
-            (*failCb)(mSharedObj->mError);
+            invokeCb<Error, T, RealOut>(eb, mSharedObj->mError, next);
             mSharedObj->mError.setHandled();
         }
         else
         {
             assert((mSharedObj->mResolved == kNotResolved));
-            failCbs().push(failCb);
+            failCbs().template emplace<Callback<Error, T, RealOut, typename std::decay<F>::type>>(
+                std::forward<F>(eb), next);
         }
 
         return next;
@@ -605,8 +674,6 @@ public:
 
         if (hasCallbacks())
             doResolve(mSharedObj->mResult);
-        else
-            mSharedObj->mPending = true;
     }
     template <typename V=T, class=typename std::enable_if<std::is_same<V,void>::value, int>::type>
     void resolve()
@@ -615,7 +682,7 @@ public:
     }
 
 protected:
-    inline bool hasCallbacks() const { return (mSharedObj->mCbs!=NULL); }
+    inline bool hasCallbacks() const { return mSharedObj->mSuccessCbs.count() || mSharedObj->mFailCbs.count(); }
     void doResolve(const typename MaskVoid<T>::type& val)
     {
         auto& cbs = thenCbs();
@@ -650,7 +717,7 @@ protected:
             {
                 for (int i=0; i<cnt; i++)
                 {
-                    auto& item = ebs[i];
+                    auto item = ebs[i];
                     static_cast<IFailCbWithPromise*>(item)->nextPromise.resolve(val);
                 }
             }
@@ -668,8 +735,6 @@ public:
 
         if (hasCallbacks())
             doReject(err);
-        else
-            mSharedObj->mPending = true;
     }
     inline void reject(const std::string& msg)
     {
@@ -719,21 +784,6 @@ protected:
             }
         }
     }
-    void doPendingResolveOrFail()
-    {
-        if (!hasCallbacks())
-            return;
-        assert(mSharedObj->mPending);
-        auto state = mSharedObj->mResolved;
-        assert(state != kNotResolved);
-        if (state == kSucceeded)
-            doResolve(mSharedObj->mResult);
-        else
-        {
-            assert(state == kFailed);
-            doReject(mSharedObj->mError);
-        }
-    }
 };
 
 template<typename T>
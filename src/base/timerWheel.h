@@ -0,0 +1,430 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include "cservices.h"
+#include "msgPool.h"
+
+namespace karere
+{
+extern std::recursive_mutex timerMutex;
+
+/** @brief Hierarchical timer wheel with a resolution of 1 ms, that backs setTimeout()
+ * and setInterval() of an application context.
+ *
+ * Timers are kept in kLevels levels of 64 slots, each level 64 times coarser than the
+ * previous one. A timer is linked to the slot of the coarsest level that still
+ * distinguishes its expiry from the current time, so arming and canceling a timer are
+ * O(1), and when the current time reaches a slot of an upper level, its timers are
+ * cascaded down to the finer levels. The occupied slots of each level are tracked in a
+ * bitmap, so the wheel skips the empty ones, and the next wakeup is found with a
+ * handful of bit scans.
+ *
+ * The wheel is owned by the thread that runs the libuv loop, and uses a single uv timer
+ * to wake it up. That thread must call \c prepare() before waiting on the loop, which
+ * schedules the uv timer, and \c expire() after it, which runs the expired timers.
+ * Timers can be set and canceled from any thread: if a timer expires before the
+ * scheduled wakeup while the loop is waiting, the wheel calls the wakeup function
+ * provided by the owner, which must interrupt the wait.
+ *
+ * All the state is protected by \c timerMutex. \c expire() takes the expired timers
+ * out of the wheel with it held, and releases it to run their callbacks, so other
+ * threads don't wait for them. The callbacks can set and cancel timers, including
+ * their own. A timer canceled by another thread while it's being expired may still
+ * fire once.
+ *
+ * The callbacks are called by \c expire() itself, not posted to the event queue of
+ * the application context as the uv timers did, so their order relative to
+ * \c marshallCall() changed: the loop thread handles all the events queued when it
+ * wakes up, including those posted after a timer expired, and then the expired
+ * timers. The events posted by the callbacks are handled after all of them.
+ */
+class TimerWheel
+{
+public:
+    enum
+    {
+        kLevelBits = 6,
+        kSlots = 1 << kLevelBits,
+        kSlotMask = kSlots - 1,
+        kLevels = 5,    // 64^5 ms, about 12 days. Timers beyond that are re-cascaded
+        kDue = kLevels
+    };
+    class Timer
+    {
+    public:
+        virtual ~Timer() {}
+        virtual void fire() = 0;
+        static void* operator new(size_t size) { return MsgPool::alloc(size); }
+        static void operator delete(void* ptr) { MsgPool::free(ptr); }
+    protected:
+        friend class TimerWheel;
+        Timer* mNext = nullptr;
+        Timer** mPprev = nullptr;   // the pointer to this timer in the slot list
+        uint64_t mExpiry = 0;
+        unsigned mPeriod = 0;       // 0 for one-shot timers
+        megaHandle mHandle = 0;
+        uint8_t mLevel = 0;
+        uint8_t mSlot = 0;
+        bool mCanceled = false;
+        bool mFiring = false;       // taken out of the wheel by expire(), to be run
+    };
+
+    TimerWheel(uv_loop_t* loop, std::function<void()>&& wakeup)
+        : mEpoch(std::chrono::steady_clock::now()), mWakeup(std::move(wakeup))
+    {
+        memset(mSlots, 0, sizeof(mSlots));
+        memset(mOccupied, 0, sizeof(mOccupied));
+        mUvTimer = new uv_timer_t;
+        uv_timer_init(loop, mUvTimer);
+        mUvTimer->data = this;
+    }
+
+    /** Must be called by the loop thread, not from a timer callback. It frees the timers
+     * that are still armed, without running them, and closes the uv timer, which is
+     * freed once the loop processes the close */
+    ~TimerWheel()
+    {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        for (int level = 0; level <= kLevels; level++)
+        {
+            for (int slot = 0; slot < kSlots; slot++)
+            {
+                freeList(mSlots[level][slot]);
+            }
+        }
+        freeList(mCanceled);
+        uv_timer_stop(mUvTimer);
+        uv_close((uv_handle_t*)mUvTimer, [](uv_handle_t* handle)
+        {
+            delete (uv_timer_t*)handle;
+        });
+    }
+
+    /** Arms \c timer, taking its ownership. It will fire after \c delayMs, and then every
+     * \c periodMs if it's not zero, until it's canceled.
+     * @return The handle to cancel the timer */
+    megaHandle add(Timer* timer, unsigned delayMs, unsigned periodMs)
+    {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        uint64_t now = currentTick();
+        if (!mCount)
+        {
+            mNow = now;  // no need to walk through the ticks elapsed while the wheel was empty
+        }
+        timer->mExpiry = now + delayMs;
+        timer->mPeriod = periodMs;
+        if (!++mLastHandle)
+        {
+            ++mLastHandle;  // 0 is the invalid handle
+        }
+        timer->mHandle = mLastHandle;
+        mHandles.emplace(timer->mHandle, timer);
+        insert(timer);
+        mCount++;
+
+        if (mWaiting && timer->mExpiry < mWakeupAt)
+        {
+            mWakeupAt = timer->mExpiry;
+            mWakeup();
+        }
+        return timer->mHandle;
+    }
+
+    /** Cancels a timer. If it's being expired, it's freed when \c expire() is done with
+     * it, and it's not run if its callback wasn't called yet. Otherwise, it's freed by the next \c expire() call, so that the captures
+     * of the callback are destroyed by the loop thread, as when the timer fires.
+     * @return \c false if the handle is not valid, i.e. a one-shot timer already fired */
+    bool cancel(megaHandle handle)
+    {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        auto it = mHandles.find(handle);
+        if (it == mHandles.end())
+            return false;
+
+        Timer* timer = it->second;
+        mHandles.erase(it);
+        timer->mCanceled = true;
+        if (!timer->mFiring)
+        {
+            unlink(timer);
+            mCount--;
+            timer->mNext = mCanceled;
+            mCanceled = timer;
+        }
+        return true;
+    }
+
+    /** Called by the loop thread before waiting on the loop. It schedules the uv timer
+     * for the next expiry, or stops it if the wheel is empty */
+    void prepare()
+    {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        mWaiting = true;
+        if (!mCount)
+        {
+            mWakeupAt = UINT64_MAX;
+            uv_timer_stop(mUvTimer);
+            return;
+        }
+        uint64_t now = currentTick();
+        mWakeupAt = mSlots[kDue][0] ? now : nextEvent();
+        uv_timer_start(mUvTimer, [](uv_timer_t* handle)
+        {
+            uv_stop(handle->loop);
+        }, (mWakeupAt > now) ? mWakeupAt - now : 0, 0);
+    }
+
+    /** Called by the loop thread after waiting on the loop. It runs the expired timers,
+     * in order of expiry, without holding \c timerMutex */
+    void expire()
+    {
+        std::unique_lock<std::recursive_mutex> lock(timerMutex);
+        mWaiting = false;
+        freeList(mCanceled);
+        uint64_t now = currentTick();
+        Timer* fired = nullptr;
+        Timer** last = &fired;
+        take(kDue, 0, last);
+        advance(now, last);
+
+        while (Timer* timer = fired)
+        {
+            fired = timer->mNext;
+            if (!timer->mCanceled)   // not by the callback of an earlier one
+            {
+                lock.unlock();
+                timer->fire();
+                lock.lock();
+            }
+            finish(timer, now);
+        }
+    }
+
+    /** The number of armed timers */
+    size_t size() const { return mCount; }
+
+protected:
+    std::chrono::steady_clock::time_point mEpoch;
+    std::function<void()> mWakeup;
+    uv_timer_t* mUvTimer;               // heap allocated, since it outlives the wheel until closed
+    Timer* mSlots[kLevels + 1][kSlots]; // the extra level holds the overdue timers, in slot 0
+    uint64_t mOccupied[kLevels + 1];    // bitmaps of the non-empty slots
+    uint64_t mNow = 0;                  // the next tick to process
+    size_t mCount = 0;
+    megaHandle mLastHandle = 0;
+    std::unordered_map<megaHandle, Timer*, std::hash<megaHandle>, std::equal_to<megaHandle>,
+        MsgPoolAllocator<std::pair<const megaHandle, Timer*>>> mHandles;
+    Timer* mCanceled = nullptr;         // canceled timers, to be freed by expire()
+    bool mWaiting = false;              // whether the loop thread is waiting on the loop
+    uint64_t mWakeupAt = UINT64_MAX;    // the tick the uv timer is scheduled for
+
+    uint64_t currentTick() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - mEpoch).count();
+    }
+
+    void insert(Timer* timer)
+    {
+        uint64_t expiry = timer->mExpiry;
+        if (expiry < mNow)
+        {
+            // its tick was already processed, so it's run by the next expire()
+            link(timer, kDue, 0);
+            return;
+        }
+        uint64_t delta = expiry - mNow;
+        const uint64_t kRange = 1ull << (kLevelBits * kLevels);
+        if (delta >= kRange)
+        {
+            delta = kRange - 1;
+            expiry = mNow + delta;
+        }
+        int level = 0;
+        while (delta >> (kLevelBits * (level + 1)))
+        {
+            level++;
+        }
+        link(timer, level, (expiry >> (kLevelBits * level)) & kSlotMask);
+    }
+
+    void link(Timer* timer, int level, int slot)
+    {
+        Timer*& head = mSlots[level][slot];
+        timer->mNext = head;
+        if (head)
+        {
+            head->mPprev = &timer->mNext;
+        }
+        timer->mPprev = &head;
+        head = timer;
+        timer->mLevel = level;
+        timer->mSlot = slot;
+        mOccupied[level] |= 1ull << slot;
+    }
+
+    void unlink(Timer* timer)
+    {
+        *timer->mPprev = timer->mNext;
+        if (timer->mNext)
+        {
+            timer->mNext->mPprev = timer->mPprev;
+        }
+        if (!mSlots[timer->mLevel][timer->mSlot])
+        {
+            mOccupied[timer->mLevel] &= ~(1ull << timer->mSlot);
+        }
+        timer->mNext = nullptr;
+        timer->mPprev = nullptr;
+    }
+
+    /** Moves the timers of a slot to \c list, so that they can be unlinked one by one
+     * while the callbacks link other timers to the slot */
+    void detach(int level, int slot, Timer*& list)
+    {
+        list = mSlots[level][slot];
+        mSlots[level][slot] = nullptr;
+        mOccupied[level] &= ~(1ull << slot);
+        if (list)
+        {
+            list->mPprev = &list;
+        }
+    }
+
+    /** Re-links the timers of an upper-level slot, relatively to the current tick.
+     * @return The slot */
+    int cascade(int level)
+    {
+        int slot = (mNow >> (kLevelBits * level)) & kSlotMask;
+        Timer* list;
+        detach(level, slot, list);
+        while (Timer* timer = list)
+        {
+            unlink(timer);
+            insert(timer);
+        }
+        return slot;
+    }
+
+    /** Takes the timers of a slot out of the wheel, and appends them to the list whose
+     * next pointer to set is \c last */
+    void take(int level, int slot, Timer**& last)
+    {
+        Timer* list;
+        detach(level, slot, list);
+        while (Timer* timer = list)
+        {
+            unlink(timer);
+            timer->mFiring = true;
+            *last = timer;
+            last = &timer->mNext;
+        }
+    }
+
+    /** Takes the timers that expire up to \c now, included, in order of expiry */
+    void advance(uint64_t now, Timer**& last)
+    {
+        while (mNow <= now)
+        {
+            if (!mCount)
+            {
+                mNow = now + 1;
+                return;
+            }
+            int index = mNow & kSlotMask;
+            if (!index)
+            {
+                for (int level = 1; level < kLevels && !cascade(level); level++);
+            }
+
+            take(0, index, last);
+            mNow++;
+
+            // skip to the next non-empty slot, or the next cascade
+            if (mNow & kSlotMask)
+            {
+                uint64_t pending = mOccupied[0] & (~0ull << (mNow & kSlotMask));
+                uint64_t next = pending
+                    ? (mNow & ~(uint64_t)kSlotMask) + ctz(pending)
+                    : (mNow | kSlotMask) + 1;
+                mNow = (next <= now) ? next : now + 1;
+            }
+        }
+    }
+
+    /** Re-arms an interval timer that was expired, or frees it. Timers armed by the
+     * callbacks are due after \c mNow, which is past \c now, so they run in the next
+     * \c expire() */
+    void finish(Timer* timer, uint64_t now)
+    {
+        timer->mFiring = false;
+        timer->mNext = nullptr;
+        if (!timer->mCanceled && timer->mPeriod)
+        {
+            timer->mExpiry = now + timer->mPeriod;
+            insert(timer);
+            return;
+        }
+        if (!timer->mCanceled)
+        {
+            mHandles.erase(timer->mHandle);
+        }
+        mCount--;
+        delete timer;
+    }
+
+    static void freeList(Timer*& list)
+    {
+        while (Timer* timer = list)
+        {
+            list = timer->mNext;
+            delete timer;
+        }
+    }
+
+    /** The earliest tick at which there is work to do: a timer to run, or a slot of an
+     * upper level to cascade, which happens before the expiry of any of its timers */
+    uint64_t nextEvent() const
+    {
+        uint64_t next = UINT64_MAX;
+        for (int level = 0; level < kLevels; level++)
+        {
+            if (!mOccupied[level])
+                continue;
+
+            // the first unit of this level that starts at mNow or later, and its slot
+            int shift = kLevelBits * level;
+            uint64_t unit = (mNow + (1ull << shift) - 1) >> shift;
+            int first = unit & kSlotMask;
+            uint64_t rotated = (mOccupied[level] >> first) | (first ? mOccupied[level] << (kSlots - first) : 0);
+            uint64_t tick = (unit + ctz(rotated)) << shift;
+            if (tick < next)
+            {
+                next = tick;
+            }
+        }
+        return next;
+    }
+
+    static int ctz(uint64_t bits)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(bits);
+#else
+        int count = 0;
+        while (!(bits & 1))
+        {
+            bits >>= 1;
+            count++;
+        }
+        return count;
+#endif
+    }
+};
+}
+#endif
@@ -23,97 +23,26 @@
  */
 #include "cservices.h"
 #include "gcmpp.h"
+#include "timerWheel.h"
 #include <memory>
 #include <assert.h>
 
 namespace karere
 {
 
-struct TimerMsg: public megaMessage
-{
-    timerevent* timerEvent = nullptr;
-    bool canceled = false;
-    megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
-        :megaMessage(aFunc),
-          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
-    {}
-   ~TimerMsg()
-    {
-        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
-        if (timerEvent)
-        {            
-            uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
-            {
-                delete handle;
-            });
-        }
-    }
-};
-
-void init_uv_timer(void *ctx, uv_timer_t *timer);
-
-extern std::recursive_mutex timerMutex;
+/** Returns the timer wheel of the application context \c ctx */
+TimerWheel& get_timer_wheel(void *ctx);
 
 template <int persist, class CB>
 inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
 {
-    struct Msg: public TimerMsg
+    struct Timer: public TimerWheel::Timer
     {
         CB cb;
-        void *appCtx;
-        Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
-        {}
-        unsigned time;
-        int loop;
+        Timer(CB&& aCb): cb(std::forward<CB>(aCb)) {}
+        virtual void fire() { cb(); }
     };
-    megaMessageFunc cfunc = persist
-        ? (megaMessageFunc) [](void* arg)
-          {
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-                  return;
-              msg->cb();
-          }
-        : (megaMessageFunc) [](void* arg)
-          {
-              timerMutex.lock();
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              msg->cb();
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              delete msg;
-              timerMutex.unlock();
-          };
-
-    timerMutex.lock();
-    Msg* pMsg = new Msg(std::forward<CB>(callback), cfunc);
-    timerMutex.unlock();
-
-    pMsg->appCtx = ctx;
-    pMsg->time = time;
-    pMsg->loop = persist;  
-    marshallCall([pMsg, ctx]()
-    {
-        pMsg->timerEvent = new uv_timer_t();
-        pMsg->timerEvent->data = pMsg;
-        init_uv_timer(ctx, pMsg->timerEvent);
-        uv_timer_start(pMsg->timerEvent,
-                       [](uv_timer_t* handle)
-                       {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
-                       }, pMsg->time, pMsg->loop ? pMsg->time : 0);
-    }, ctx);    
-    return pMsg->handle;
+    return get_timer_wheel(ctx).add(new Timer(std::forward<CB>(callback)), time, persist ? time : 0);
 }
 /** Cancels a previously set timeout with setTimeout()
  * @return \c false if the handle is not valid. This can happen if the timeout
@@ -122,32 +51,8 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
  */
 static inline bool cancelTimeout(megaHandle handle, void *ctx)
 {
-    timerMutex.lock();
-
     assert(handle);
-    TimerMsg* timer = static_cast<TimerMsg*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
-    if (!timer)
-    {
-        timerMutex.unlock();
-        return false; //not valid anymore
-    }
-
-//we have to make sure that we delete the timer only after all possibly queued
-//timer messages in the app's message queue are processed. For this purpose,
-//we first stop the timer, and only then post a call to delete the timer.
-//That call should be processed after all timer messages
-    timer->canceled = true; //disable timer callback being called by possibly queued messages, and message freeing in one-shot timer handler
-    timerMutex.unlock();    
-    marshallCall([timer, ctx]()
-    {
-        uv_timer_stop(timer->timerEvent);
-
-        marshallCall([timer, ctx]()
-        {
-            delete timer;
-        }, ctx);
-    }, ctx);
-    return true;
+    return get_timer_wheel(ctx).cancel(handle);
 }
 /** @brief Cancels a previously set timer with setInterval.
  * @return \c false if the handle is not valid.
@@ -0,0 +1,248 @@
+// Standalone test and benchmark of karere::UrlScanner. It checks a corpus of texts,
+// and random texts against the regex-based implementation it replaced, which is the
+// reference of the acceptance rules. Then it measures both with large texts:
+// g++ -std=c++11 -O2 -I.. urlScanner-test.cpp -o urlScanner-test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <regex>
+#include <string>
+#include "urlScanner.h"
+
+using karere::UrlScanner;
+
+// ==== Reference implementation (the former chatd::Message::hasUrl()) ====
+static void refRemoveLastCharacters(std::string& buf)
+{
+    while (!buf.empty() && strchr(".,:?!;", buf.back()))
+        buf.erase(buf.size() - 1);
+}
+
+static void refRemoveFirstCharacters(std::string& buf)
+{
+    while (!buf.empty() && strchr(".,:?!;", buf.front()))
+        buf.erase(0, 1);
+}
+
+static bool refIsValidEmail(const std::string& buf)
+{
+    std::regex regularExpresion("^[a-z0-9A-Z._%+-]+@[a-z0-9A-Z.-]+[.][a-zA-Z]{2,6}");
+    return regex_match(buf, regularExpresion);
+}
+
+static bool refParseUrl(const std::string& url)
+{
+    if (url.find('.') == std::string::npos)
+        return false;
+    if (refIsValidEmail(url))
+        return false;
+
+    std::string urlToParse = url;
+    std::string::size_type position = urlToParse.find("://");
+    if (position != std::string::npos)
+    {
+        std::regex expresion("^(http://|https://)(.+)");
+        if (regex_match(urlToParse, expresion))
+            urlToParse = urlToParse.substr(position + 3);
+        else
+            return false;
+    }
+
+    if (urlToParse.find("mega.co.nz/#!") != std::string::npos || urlToParse.find("mega.co.nz/#F!") != std::string::npos ||
+            urlToParse.find("mega.nz/#!") != std::string::npos || urlToParse.find("mega.nz/#F!") != std::string::npos)
+        return false;
+
+    std::regex regularExpresion("^(WWW.|www.)?[a-z0-9A-Z-._~:/?#@!$&'()*+,;=]+[.][a-zA-Z]{2,5}(:[0-9]{1,5})?([a-z0-9A-Z-._~:/?#@!$&'()*+,;=]*)?$");
+    return regex_match(urlToParse, regularExpresion);
+}
+
+static bool refHasUrl(const std::string& text, std::string& url)
+{
+    std::string partialString;
+    for (size_t position = 0; position <= text.size(); position++)
+    {
+        char character = (position < text.size()) ? text[position] : ' ';
+        if ((character >= 33 && character <= 126) && !strchr("\"'\\<>{}|", character))
+        {
+            partialString.push_back(character);
+            continue;
+        }
+        if (!partialString.empty())
+        {
+            refRemoveFirstCharacters(partialString);
+            refRemoveLastCharacters(partialString);
+            if (refParseUrl(partialString))
+            {
+                url = partialString;
+                return true;
+            }
+        }
+        partialString.clear();
+    }
+    return false;
+}
+// ====
+
+static bool hasUrl(const std::string& text, std::string& url)
+{
+    const char* start;
+    size_t len;
+    if (!UrlScanner::findUrl(text.data(), text.size(), start, len))
+        return false;
+    url.assign(start, len);
+    return true;
+}
+
+struct Case
+{
+    const char* text;
+    const char* url;    // nullptr if there is none
+};
+
+static const Case kCorpus[] =
+{
+    { "", nullptr },
+    { "hello world", nullptr },
+    { "mega.nz", "mega.nz" },
+    { "see mega.nz.", "mega.nz" },
+    { "(see https://mega.nz/blog)", "https://mega.nz/blog)" },
+    { "http://example.com:8080/path?q=1#frag", "http://example.com:8080/path?q=1#frag" },
+    { "https://www.example.co.uk/", "https://www.example.co.uk/" },
+    { "ftp://example.com", nullptr },
+    { "http://", nullptr },
+    { "https://x", nullptr },
+    { "user@example.com", nullptr },
+    { "mail user@example.com or visit example.org", "example.org" },
+    { "user@example.toolongtld", "user@example.toolongtld" },
+    { "https://mega.nz/#!abcdef!key", nullptr },
+    { "mega.co.nz/#F!abc", nullptr },
+    { "https://mega.nz/file/abc#key", "https://mega.nz/file/abc#key" },
+    { "www%example.com", "www%example.com" },
+    { "w%example.com", nullptr },
+    { "a.b", nullptr },
+    { "a.bc", "a.bc" },
+    { ".com", nullptr },
+    { "...example.com!!!", "example.com" },
+    { "version 1.2.3", nullptr },
+    { "std::vector<int>.size()", nullptr },
+    { "foo.bar()", "foo.bar()" },
+    { "x = obj.field;", "obj.field" },
+    { "caf\xc3\xa9.com", nullptr },
+    { "\xc3\xa9 example.com", "example.com" },
+    { "\"example.com\"", "example.com" },
+    { "<a href=example.com>", "href=example.com" },
+    { "path\\to.file", "to.file" },
+    { "1.5GB", nullptr },
+    { "v1.5GB", nullptr },
+    { "node1.eu", "node1.eu" },
+    { "e.g. this", nullptr },
+    { "i.e.", nullptr },
+};
+
+static int checkCorpus()
+{
+    int errors = 0;
+    for (auto& c: kCorpus)
+    {
+        std::string url, refUrl;
+        bool found = hasUrl(c.text, url);
+        bool refFound = refHasUrl(c.text, refUrl);
+        if (found != refFound || url != refUrl)
+        {
+            printf("corpus: reference mismatch for '%s': '%s' vs '%s'\n", c.text, url.c_str(), refUrl.c_str());
+            errors++;
+        }
+        if (found != (c.url != nullptr) || (found && url != c.url))
+        {
+            printf("corpus: unexpected result for '%s': '%s'\n", c.text, found ? url.c_str() : "(none)");
+            errors++;
+        }
+    }
+    printf("corpus: %zu texts, %d errors\n", sizeof(kCorpus) / sizeof(kCorpus[0]), errors);
+    return errors;
+}
+
+static int checkRandom(std::mt19937& rng, int count)
+{
+    // biased towards the characters that matter to the rules
+    static const char* kAlphabet[] =
+    {
+        "abcwWxyzAZ", "0123456789", "......", "::////", "@@", "%#!?;,", " \t\n", "'\"<>{}|\\",
+        "-_~$&()*+=[]^`", "\xc3\xa9", "http://", "https://", "www.", "mega.nz/#!", ".com", ".co.uk"
+    };
+    const int kAlphabetSize = sizeof(kAlphabet) / sizeof(kAlphabet[0]);
+    int errors = 0;
+    for (int i = 0; i < count; i++)
+    {
+        std::string text;
+        int parts = rng() % 24;
+        for (int j = 0; j < parts; j++)
+        {
+            const char* group = kAlphabet[rng() % kAlphabetSize];
+            size_t len = strlen(group);
+            if (len > 3 && rng() % 2)
+                text.append(group);
+            else
+                text.push_back(group[rng() % len]);
+        }
+        std::string url, refUrl;
+        bool found = hasUrl(text, url);
+        bool refFound = refHasUrl(text, refUrl);
+        if (found != refFound || url != refUrl)
+        {
+            if (errors++ < 10)
+                printf("random: mismatch for '%s': '%s' vs '%s'\n", text.c_str(), url.c_str(), refUrl.c_str());
+        }
+    }
+    printf("random: %d texts, %d errors\n", count, errors);
+    return errors;
+}
+
+template <class F>
+static double timeIt(int rounds, F&& func)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+        func();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+static void bench(const char* name, const std::string& text)
+{
+    std::string url;
+    bool found = false;
+    double tRef = timeIt(3, [&]() { found |= refHasUrl(text, url); });
+    double tScan = timeIt(200, [&]() { found |= hasUrl(text, url); });
+    printf("%-28s %7zu bytes: regex %10.1f us, scanner %8.2f us (%s)\n",
+           name, text.size(), tRef, tScan, found ? "url" : "no url");
+}
+
+int main()
+{
+    int errors = checkCorpus();
+    std::mt19937 rng(12345);
+    errors += checkRandom(rng, 50000);
+
+    std::string prose, log, code;
+    while (prose.size() < 32768)
+        prose += "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor. ";
+    while (log.size() < 32768)
+        log += "2019-03-01 12:00:00.123 [chatd] Connection::execCommand: 0x1a2b3c4d opcode NEWMSG. ";
+    while (code.size() < 32768)
+        code += "    if (msg->isEncrypted() && (*it)->dataSize() > 0) { mChat->onMsg(msg); }\n";
+
+    bench("prose", prose);
+    bench("log", log);
+    bench("code", code);
+    bench("prose + url at the end", prose + " https://mega.nz/blog");
+
+    if (errors)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
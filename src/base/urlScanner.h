@@ -0,0 +1,219 @@
+#ifndef URLSCANNER_H
+#define URLSCANNER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace karere
+{
+/** @brief Detection of URLs in the text of messages, to generate rich-link previews.
+ *
+ * The text is split in tokens of printable ASCII characters, trimmed of leading and
+ * trailing punctuation, and a token is an URL if, with an optional http(s) scheme:
+ * it's not an email address, nor a link to a MEGA file or folder, it consists only of
+ * URL characters (RFC 3986 unreserved and reserved ones), and it has a dot followed by
+ * at least two letters (a TLD, optionally followed by a port and path).
+ *
+ * Any URL contains a dot, so \c findUrl() only looks at the tokens around the dots of
+ * the text, which are located by \c memchr(), vectorized by the C library. Text without
+ * URLs is rejected in a single pass, without allocating memory.
+ */
+class UrlScanner
+{
+public:
+    /** Looks for the first URL in \c text. If found, returns true, and the URL is at
+     * [urlStart, urlStart + urlLen) */
+    static bool findUrl(const char* text, size_t len, const char*& urlStart, size_t& urlLen)
+    {
+        const char* end = text + len;
+        const char* pos = text;
+        while (pos < end)
+        {
+            const char* dot = static_cast<const char*>(memchr(pos, '.', end - pos));
+            if (!dot)
+                return false;
+
+            const char* tokenStart = dot;
+            while (tokenStart > text && is(tokenStart[-1], kTokenChar))
+                tokenStart--;
+            const char* tokenEnd = dot + 1;
+            while (tokenEnd < end && is(*tokenEnd, kTokenChar))
+                tokenEnd++;
+            pos = tokenEnd;
+
+            while (tokenStart < tokenEnd && is(*tokenStart, kTrimChar))
+                tokenStart++;
+            while (tokenEnd > tokenStart && is(tokenEnd[-1], kTrimChar))
+                tokenEnd--;
+
+            if (isUrl(tokenStart, tokenEnd - tokenStart))
+            {
+                urlStart = tokenStart;
+                urlLen = tokenEnd - tokenStart;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Returns true if the whole \c token is an URL */
+    static bool isUrl(const char* token, size_t len)
+    {
+        if (!memchr(token, '.', len) || isEmailAddress(token, len))
+            return false;
+
+        if (find(token, len, "://"))
+        {
+            if (startsWith(token, len, "http://") && len > 7)
+            {
+                token += 7;
+                len -= 7;
+            }
+            else if (startsWith(token, len, "https://") && len > 8)
+            {
+                token += 8;
+                len -= 8;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        if (find(token, len, "mega.co.nz/#!") || find(token, len, "mega.co.nz/#F!")
+            || find(token, len, "mega.nz/#!") || find(token, len, "mega.nz/#F!"))
+            return false;
+
+        if (isUrlBody(token, len))
+            return true;
+
+        // an optional "www" prefix, followed by any character
+        return len >= 4 && (startsWith(token, len, "www") || startsWith(token, len, "WWW"))
+            && isUrlBody(token + 4, len - 4);
+    }
+
+    /** Returns true if the whole \c token is an email address */
+    static bool isEmailAddress(const char* token, size_t len)
+    {
+        const char* at = static_cast<const char*>(memchr(token, '@', len));
+        if (!at || at == token)
+            return false;
+        for (const char* p = token; p < at; p++)
+        {
+            if (!is(*p, kEmailLocalChar))
+                return false;
+        }
+
+        // the domain ends with a dot and 2 to 6 letters, which can't contain another dot
+        const char* domain = at + 1;
+        const char* end = token + len;
+        const char* lastDot = nullptr;
+        for (const char* p = domain; p < end; p++)
+        {
+            if (!is(*p, kEmailDomainChar))
+                return false;
+            if (*p == '.')
+                lastDot = p;
+        }
+        if (!lastDot || lastDot == domain)
+            return false;
+
+        size_t tldLen = end - lastDot - 1;
+        if (tldLen < 2 || tldLen > 6)
+            return false;
+        for (const char* p = lastDot + 1; p < end; p++)
+        {
+            if (!is(*p, kAlpha))
+                return false;
+        }
+        return true;
+    }
+
+protected:
+    enum
+    {
+        kTokenChar = 1,         // printable ASCII, except quotes, backslash and <>{}|
+        kTrimChar = 2,          // trimmed from both ends of tokens
+        kUrlChar = 4,
+        kEmailLocalChar = 8,
+        kEmailDomainChar = 16,
+        kAlpha = 32
+    };
+
+    struct CharClasses
+    {
+        uint8_t flags[128];
+        CharClasses()
+        {
+            memset(flags, 0, sizeof(flags));
+            for (int c = 33; c <= 126; c++)
+            {
+                if (!strchr("\"'\\<>{}|", c))
+                    flags[c] |= kTokenChar;
+            }
+            for (int c = 0; c < 128; c++)
+            {
+                bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+                bool alnum = alpha || (c >= '0' && c <= '9');
+                if (alpha)
+                    flags[c] |= kAlpha;
+                if (alnum)
+                    flags[c] |= kUrlChar | kEmailLocalChar | kEmailDomainChar;
+            }
+            set(".,:?!;", kTrimChar);
+            set("-._~:/?#@!$&'()*+,;=", kUrlChar);
+            set("._%+-", kEmailLocalChar);
+            set(".-", kEmailDomainChar);
+        }
+        void set(const char* chars, uint8_t flag)
+        {
+            for (; *chars; chars++)
+                flags[(int)*chars] |= flag;
+        }
+    };
+
+    static bool is(char c, uint8_t flag)
+    {
+        static const CharClasses classes;
+        unsigned char uc = static_cast<unsigned char>(c);
+        return uc < 128 && (classes.flags[uc] & flag);
+    }
+
+    /** Matches the URL without scheme nor "www" prefix: URL characters, with a dot
+     * followed by at least two letters, not at the start */
+    static bool isUrlBody(const char* token, size_t len)
+    {
+        bool hasTld = false;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (!is(token[i], kUrlChar))
+                return false;
+            if (!hasTld && i > 0 && token[i] == '.' && i + 2 < len
+                && is(token[i + 1], kAlpha) && is(token[i + 2], kAlpha))
+                hasTld = true;
+        }
+        return hasTld;
+    }
+
+    static bool startsWith(const char* token, size_t len, const char* prefix)
+    {
+        size_t prefixLen = strlen(prefix);
+        return len >= prefixLen && !memcmp(token, prefix, prefixLen);
+    }
+
+    static bool find(const char* token, size_t len, const char* pattern)
+    {
+        size_t patternLen = strlen(pattern);
+        for (const char* end = token + len; (size_t)(end - token) >= patternLen; token++)
+        {
+            token = static_cast<const char*>(memchr(token, pattern[0], end - token - patternLen + 1));
+            if (!token)
+                return false;
+            if (!memcmp(token, pattern, patternLen))
+                return true;
+        }
+        return false;
+    }
+};
+}
+#endif
@@ -0,0 +1,142 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+#include <assert.h>
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace karere
+{
+/** @brief A pool of threads to run CPU-bound jobs in parallel, in a fork-join manner:
+ * \c parallelFor() splits the work among the threads of the pool and the calling one,
+ * and returns once all of it is done. So, the caller doesn't need any synchronization
+ * with the jobs, other than not sharing mutable state between them.
+ */
+class WorkerPool
+{
+protected:
+    typedef std::function<void(size_t)> Job;
+    std::vector<std::thread> mThreads;
+    std::mutex mBatchMutex;             // one batch at a time
+    std::mutex mMutex;
+    std::condition_variable mWorkCondVar;
+    std::condition_variable mDoneCondVar;
+    const Job* mJob = nullptr;
+    size_t mCount = 0;
+    std::atomic<size_t> mNext;
+    unsigned mActive = 0;               // threads working on the current batch
+    uint64_t mBatchNo = 0;
+    bool mExit = false;
+
+    static void work(const Job& job, size_t count, std::atomic<size_t>& next)
+    {
+        size_t i;
+        while ((i = next++) < count)
+        {
+            job(i);
+        }
+    }
+    void run()
+    {
+        uint64_t lastBatch = 0;
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mWorkCondVar.wait(lock, [this, lastBatch]() { return mExit || mBatchNo != lastBatch; });
+            if (mExit)
+                return;
+
+            lastBatch = mBatchNo;
+            if (!mJob)
+                continue;   // the batch was completed before this thread woke up
+
+            const Job* job = mJob;
+            size_t count = mCount;
+            mActive++;
+            lock.unlock();
+            work(*job, count, mNext);
+            lock.lock();
+            if (--mActive == 0)
+                mDoneCondVar.notify_all();
+        }
+    }
+
+public:
+    enum { kMaxThreads = 64 };
+
+    /** One thread per core, minus the one of the caller. None if the number
+     * of cores is not known */
+    static unsigned defaultNumThreads()
+    {
+        unsigned cores = std::thread::hardware_concurrency();
+        return cores ? cores - 1 : 0;
+    }
+
+    /** @param numThreads Number of threads of the pool, up to kMaxThreads.
+     * By default, defaultNumThreads() */
+    explicit WorkerPool(unsigned numThreads = defaultNumThreads())
+        : mNext(0)
+    {
+        if (numThreads > kMaxThreads)
+            numThreads = kMaxThreads;
+        for (unsigned i = 0; i < numThreads; i++)
+        {
+            mThreads.emplace_back(&WorkerPool::run, this);
+        }
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExit = true;
+        }
+        mWorkCondVar.notify_all();
+        for (auto& thread: mThreads)
+        {
+            thread.join();
+        }
+    }
+    /** The pool shared by the whole app */
+    static WorkerPool& instance()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+    unsigned numThreads() const { return (unsigned)mThreads.size(); }
+
+    /** Calls \c job(i) for each \c i in [0, count), in any order and from any thread
+     * of the pool, and returns when all calls have returned. \c job must not throw */
+    void parallelFor(size_t count, const Job& job)
+    {
+        if (mThreads.empty() || count < 2)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                job(i);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> batchLock(mBatchMutex);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJob = &job;
+            mCount = count;
+            mNext = 0;
+            mBatchNo++;
+        }
+        mWorkCondVar.notify_all();
+        work(job, count, mNext);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDoneCondVar.wait(lock, [this]() { return mActive == 0; });
+        mJob = nullptr;
+        mCount = 0;
+    }
+};
+}
+#endif
@@ -165,12 +165,52 @@ class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    /** If true, \c mBuf is storage provided by a derived class (i.e. inline in the
+     * object), so it's never freed nor reallocated */
+    bool mInline = false;
     enum {kMinBufSize = 64};
     void zero()
     {
         mBuf = nullptr;
         mBufSize = 0;
         mDataSize = 0;
+        mInline = false;
+    }
+    /** Makes the buffer use \c storage, keeping the current data. The data must fit in it */
+    void useInlineStorage(char* storage, size_t size)
+    {
+        assert(mDataSize <= size);
+        if (mDataSize)
+            memcpy(storage, mBuf, mDataSize);
+        if (mBuf && !mInline)
+            ::free(mBuf);
+        mBuf = storage;
+        mBufSize = size;
+        mInline = true;
+    }
+    /** Grows the capacity to \c size bytes, moving the data to the heap if it was inline */
+    void growTo(size_t size, const char* opname)
+    {
+        if (mInline)
+        {
+            char* newBuf = (char*)::malloc(size);
+            if (!newBuf)
+                throw std::runtime_error(std::string(opname)+": error allocating block of size "+std::to_string(size));
+            memcpy(newBuf, mBuf, mDataSize);
+            mBuf = newBuf;
+            mInline = false;
+        }
+        else
+        {
+            auto save = mBuf;
+            mBuf = (char*)::realloc(mBuf, size);
+            if (!mBuf)
+            {
+                mBuf = save;
+                throw std::runtime_error(std::string(opname)+": error reallocating block of size "+std::to_string(size));
+            }
+        }
+        mBufSize = size;
     }
 public:
     char* buf() { return mBuf;}
@@ -210,7 +250,18 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize)
+    {
+        if (other.mInline)  // the storage belongs to the other object, can't be taken
+        {
+            mBuf = nullptr;
+            mBufSize = mDataSize = 0;
+            assign(other.buf(), other.dataSize());
+            other.clear();
+            return;
+        }
+        other.zero();
+    }
 
     template <bool withNull>
     Buffer(const std::string& src)
@@ -226,11 +277,14 @@ public:
         {
             if (datalen <= mBufSize)
             {
-                memcpy(mBuf, data, datalen);
+                // data may be a slice of this same buffer
+                memmove(mBuf, data, datalen);
                 mDataSize = datalen;
                 return;
             }
-            ::free(mBuf);
+            if (!mInline)
+                ::free(mBuf);
+            mInline = false;
         }
         mBufSize = (kMinBufSize > datalen) ? (size_t) kMinBufSize : datalen;
         mBuf = (char*)malloc(mBufSize);
@@ -258,14 +312,7 @@ public:
             size_t newsize = mDataSize+size;
             if (newsize <= mBufSize)
                 return;
-            char* save = mBuf;
-            mBuf = (char*)::realloc(mBuf, newsize);
-            if (!mBuf)
-            {
-                mBuf = save;
-                throw std::runtime_error("Buffer::reserve: Out of memory");
-            }
-            mBufSize = newsize;
+            growTo(newsize, "Buffer::reserve");
         }
     }
     void setDataSize(size_t size)
@@ -307,14 +354,7 @@ public:
         {
             if (reqdSize > mBufSize)
             {
-                auto save = mBuf;
-                mBuf = (char*)::realloc(mBuf, reqdSize);
-                if (!mBuf)
-                {
-                    mBuf = save;
-                    throw std::runtime_error("Buffer::write: error reallocating block of size "+std::to_string(reqdSize));
-                }
-                mBufSize = reqdSize;
+                growTo(reqdSize, "Buffer::write");
             }
             memcpy(mBuf+offset, data, datalen);
             mDataSize = reqdSize;
@@ -346,14 +386,14 @@ public:
     {
         if (!mBuf)
             return;
-        ::free(mBuf);
-        mBuf = nullptr;
-        mBufSize = mDataSize = 0;
+        if (!mInline)
+            ::free(mBuf);
+        zero();
     }
 
     ~Buffer()
     {
-        if (mBuf)
+        if (mBuf && !mInline)
             ::free(mBuf);
     }
 };
@@ -57,6 +57,77 @@ void callAfterInit(T* self, F&& func, void* ctx);
 
 std::string encodeFirstName(const std::string& first);
 
+static void registerDbFunctions(SqliteDb& db);
+
+/** @brief Runs the searches of the local history in a dedicated thread, through its own
+ * read-only connection to the db, so the app thread doesn't wait for the full-text queries.
+ * The searches run one at a time, in the order they were posted. It requires the db to be
+ * in WAL mode, where readers don't block the commits of the main connection.
+ */
+class HistorySearcher
+{
+public:
+    typedef std::function<void(SqliteDb& db)> Job;
+    ~HistorySearcher() { stop(); }
+    bool start(const Client& client)
+    {
+        if (!client.openDbReader(mDb))
+            return false;
+        registerDbFunctions(mDb);
+        mThread = std::thread(&HistorySearcher::run, this);
+        return true;
+    }
+    /** Aborts the search in progress, if any, and discards the pending ones */
+    void stop()
+    {
+        if (mThread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mExit = true;
+            }
+            mCondVar.notify_one();
+            sqlite3_interrupt(mDb);
+            mThread.join();
+        }
+        mJobs.clear();
+        mDb.close();
+    }
+    /** \c job must not throw */
+    void post(Job&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(std::move(job));
+        }
+        mCondVar.notify_one();
+    }
+
+protected:
+    SqliteDb mDb;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::deque<Job> mJobs;
+    bool mExit = false;
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mCondVar.wait(lock, [this]() { return !mJobs.empty() || mExit; });
+            if (mExit)
+                return;
+
+            Job job = std::move(mJobs.front());
+            mJobs.pop_front();
+            lock.unlock();
+            job(mDb);
+            lock.lock();
+        }
+    }
+};
+
 
 /* Warning - the database is not initialzed at construction, but only after
  * init() is called. Therefore, no code in this constructor should access or
@@ -123,6 +194,44 @@ KARERE_EXPORT const std::string& createAppDir(const char* dirname, const char *e
     return path;
 }
 
+/** Ranks a match of a full-text search, from the output of matchinfo(history_fts, 'pcx'): the
+ * number of phrases and columns, followed by 3 values for each phrase and column: hits in this
+ * row, hits in all rows and number of rows with hits. Hits of rare terms weigh more.
+ */
+static void ftsRankFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    const uint32_t* info = (argc == 1) ? static_cast<const uint32_t*>(sqlite3_value_blob(argv[0])) : nullptr;
+    size_t size = (argc == 1) ? sqlite3_value_bytes(argv[0]) / sizeof(uint32_t) : 0;
+    if (!info || size < 2 || size < 2 + 3 * info[0] * info[1])
+    {
+        sqlite3_result_error(ctx, "karere_fts_rank: invalid matchinfo", -1);
+        return;
+    }
+
+    uint32_t numPhrases = info[0];
+    uint32_t numCols = info[1];
+    double score = 0;
+    for (uint32_t i = 0; i < numPhrases * numCols; i++)
+    {
+        uint32_t hits = info[2 + 3 * i];
+        uint32_t globalHits = info[3 + 3 * i];
+        if (hits)
+        {
+            score += (double)hits / globalHits;
+        }
+    }
+    sqlite3_result_double(ctx, score);
+}
+
+static void registerDbFunctions(SqliteDb& db)
+{
+    int ret = sqlite3_create_function(db, "karere_fts_rank", 1, SQLITE_UTF8, nullptr, ftsRankFunc, nullptr, nullptr);
+    if (ret != SQLITE_OK)
+    {
+        KR_LOG_ERROR("Error registering full-text search functions: %s", sqlite3_errstr(ret));
+    }
+}
+
 std::string Client::dbPath(const std::string& sid) const
 {
     if (sid.size() < 50)
@@ -151,6 +260,8 @@ bool Client::openDb(const std::string& sid)
         KR_LOG_WARNING("Error opening database");
         return false;
     }
+    KR_LOG_DEBUG("Database opened, journal mode: %s", db.isWalMode() ? "WAL" : "rollback");
+    registerDbFunctions(db);
     SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
     if (!stmt.step())
     {
@@ -163,6 +274,7 @@ bool Client::openDb(const std::string& sid)
     currentVersion.append("_").append(gDbSchemaVersionSuffix);    // <hash>_<suffix>
 
     std::string cachedVersion(stmt.stringCol(0));
+    stmt.reset();   // don't keep a read statement active while migrating the schema
     if (cachedVersion != currentVersion)
     {
         ok = false;
@@ -238,6 +350,45 @@ bool Client::openDb(const std::string& sid)
                 KR_LOG_WARNING("%d messages added to node history", count);
                 ok = true;
             }
+            else if (cachedVersionSuffix == "5" && gDbSchemaVersionSuffix == "6")
+            {
+                // clients with version 5 store `history` and `node_history` in rowid tables, with the
+                // messages of a chat scattered in the b-tree. The new layout clusters them by (chatid, idx),
+                // so ranges of history are loaded from contiguous pages, and the (chatid, msgid) index
+                // covers the msgid->idx lookups. Tables are rebuilt in place, without wiping the cache.
+                // The history gets the docids of its full-text index, which is built by initSearchIndex()
+                KR_LOG_WARNING("Rebuilding history tables with the new layout...");
+
+                db.simpleQuery("ALTER TABLE history RENAME TO history_old");
+                db.simpleQuery("CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not null,"
+                               "    userid int64, keyid int not null, type tinyint, updated smallint, ts int,"
+                               "    is_encrypted tinyint, data blob, backrefid int64 not null, fts_docid int64,"
+                               "    PRIMARY KEY(chatid, idx)) WITHOUT ROWID");
+                db.simpleQuery("INSERT INTO history(idx, chatid, msgid, userid, keyid, type, updated, ts,"
+                               "    is_encrypted, data, backrefid) SELECT * FROM history_old");
+                int count = sqlite3_changes(db);
+                db.simpleQuery("DROP TABLE history_old");
+                db.simpleQuery("CREATE UNIQUE INDEX history_msgid ON history(chatid, msgid)");
+
+                db.simpleQuery("ALTER TABLE node_history RENAME TO node_history_old");
+                db.simpleQuery("CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,"
+                               "    userid int64, keyid int not null, type tinyint, updated smallint, ts int,"
+                               "    is_encrypted tinyint, data blob, backrefid int64 not null, PRIMARY KEY(chatid, idx)) WITHOUT ROWID");
+                db.simpleQuery("INSERT INTO node_history SELECT * FROM node_history_old");
+                db.simpleQuery("DROP TABLE node_history_old");
+                db.simpleQuery("CREATE UNIQUE INDEX node_history_msgid ON node_history(chatid, msgid)");
+
+                // the cache of pairwise keys is filled as keys are used
+                db.simpleQuery("CREATE TABLE pairwise_keys(userid int64 primary key, pubkey blob not null, key blob not null)");
+
+                // Update DB version number
+                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
+                db.commit();
+
+                KR_LOG_WARNING("%d messages moved to the new history table", count);
+                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
+                ok = true;
+            }
         }
     }
 
@@ -248,6 +399,23 @@ bool Client::openDb(const std::string& sid)
         return false;
     }
 
+    // caches created before the history retention can't return the space of the removed messages
+    // to the filesystem. They are converted once, here, since the VACUUM takes a while for a big db
+    if (hasHistoryRetention() && db.pragmaValue("auto_vacuum") != 2)
+    {
+        KR_LOG_WARNING("Converting the local cache (%lld pages) to incremental vacuum...", (long long)db.pragmaValue("page_count"));
+        try
+        {
+            db.enableIncrementalVacuum();
+            KR_LOG_WARNING("Local cache converted to incremental vacuum (%lld pages)", (long long)db.pragmaValue("page_count"));
+        }
+        catch (std::exception& e)
+        {
+            KR_LOG_ERROR("Error converting the local cache to incremental vacuum: %s", e.what());
+        }
+    }
+
+    initSearchIndex();
     mSid = sid;
     return true;
 }
@@ -255,6 +423,8 @@ bool Client::openDb(const std::string& sid)
 void Client::createDbSchema()
 {
     mMyHandle = Id::null();
+    // must be set before creating any table. It allows to shrink the file after removing old history
+    db.simpleQuery("PRAGMA auto_vacuum = INCREMENTAL");
     db.simpleQuery(gDbSchema); //db.query() uses a prepared statement and will execute only the first statement up to the first semicolon
     std::string ver(gDbSchemaHash);
     ver.append("_").append(gDbSchemaVersionSuffix);
@@ -262,10 +432,66 @@ void Client::createDbSchema()
     db.commit();
 }
 
+void Client::initSearchIndex()
+{
+    mHasSearchIndex = false;
+
+    // the index is an optional feature of sqlite. SQLITE_ENABLE_FTS3 enables FTS4 as well
+    if (!sqlite3_compileoption_used("ENABLE_FTS4") && !sqlite3_compileoption_used("ENABLE_FTS3"))
+    {
+        KR_LOG_WARNING("sqlite has been built without FTS4, the local history can't be searched");
+        return;
+    }
+
+    try
+    {
+        SqliteStmt stmt(db, "select value from vars where name = 'search_index_version'");
+        bool upToDate = stmt.step() && stmt.intCol(0) == kSearchIndexVersion;
+        stmt.reset();
+        if (!upToDate)
+        {
+            // the docid of each entry is kept in the history row, so entries are removed along with
+            // their messages without scanning the index. It's assigned by a temporary table, as the
+            // history has no rowid
+            KR_LOG_WARNING("Building the full-text index of the local history...");
+            db.simpleQuery("DROP TABLE IF EXISTS history_fts");
+            db.simpleQuery("UPDATE history SET fts_docid = NULL WHERE fts_docid IS NOT NULL");
+            db.simpleQuery("CREATE VIRTUAL TABLE history_fts USING fts4(content, chatid, idx,"
+                           "    notindexed=chatid, notindexed=idx)");
+            db.simpleQuery("CREATE TEMP TABLE fts_source(chatid int64 not null, idx int not null, data blob,"
+                           "    PRIMARY KEY(chatid, idx))");
+            db.query("insert into temp.fts_source(chatid, idx, data) select chatid, idx, data from history "
+                     "where type = ? and is_encrypted = ? and length(data) > 0",
+                     chatd::Message::kMsgNormal, chatd::Message::kNotEncrypted);
+            int count = sqlite3_changes(db);
+            db.simpleQuery("INSERT INTO history_fts(docid, content, chatid, idx) "
+                           "SELECT rowid, cast(data as text), chatid, idx FROM temp.fts_source");
+            db.simpleQuery("UPDATE history SET fts_docid = (SELECT rowid FROM temp.fts_source AS s "
+                           "    WHERE s.chatid = history.chatid AND s.idx = history.idx) "
+                           "WHERE EXISTS (SELECT 1 FROM temp.fts_source AS s "
+                           "    WHERE s.chatid = history.chatid AND s.idx = history.idx)");
+            db.simpleQuery("DROP TABLE temp.fts_source");
+            db.query("insert or replace into vars(name, value) values('search_index_version', ?)", (int)kSearchIndexVersion);
+            db.commit();
+            KR_LOG_WARNING("%d messages added to the search index", count);
+        }
+    }
+    catch (std::exception& e)
+    {
+        // the history can't be searched, but the cache is still usable
+        KR_LOG_ERROR("Error building the full-text index of the history: %s", e.what());
+        db.rollback();
+        return;
+    }
+    mHasSearchIndex = true;
+}
+
 void Client::heartbeat()
 {
     if (db.isOpen())
     {
+        pruneHistory();
+        trimHistory();
         db.timedCommit();
     }
 
@@ -282,6 +508,106 @@ void Client::heartbeat()
     }
 }
 
+void Client::setHistoryRetention(const chatd::HistoryRetention& retention, Id chatid)
+{
+    if (chatid.isValid())
+    {
+        mChatHistoryRetention[chatid] = retention;
+    }
+    else
+    {
+        mHistoryRetention = retention;
+    }
+    mPruneNextTs = 0;   // apply it on next heartbeat
+}
+
+bool Client::hasHistoryRetention() const
+{
+    if (mHistoryRetention.isEnabled())
+        return true;
+
+    for (auto& item: mChatHistoryRetention)
+    {
+        if (item.second.isEnabled())
+            return true;
+    }
+    return false;
+}
+
+const chatd::HistoryRetention& Client::historyRetention(Id chatid) const
+{
+    auto it = mChatHistoryRetention.find(chatid);
+    return (it != mChatHistoryRetention.end()) ? it->second : mHistoryRetention;
+}
+
+void Client::pruneHistory()
+{
+    if (!chats || (mInitState != kInitHasOfflineSession && mInitState != kInitHasOnlineSession))
+        return;
+
+    if (!mPruneNextChatid.isValid())    // no pass in progress
+    {
+        if (time(NULL) < mPruneNextTs)
+            return;
+        mPruneNextChatid = Id::null();  // start a new pass from the first chat
+    }
+
+    // remove a few messages per heartbeat, so the app is not blocked for long
+    unsigned budget = kHistoryPruneBatch;
+    auto it = chats->lower_bound(mPruneNextChatid);
+    while (it != chats->end())
+    {
+        unsigned count = it->second->chat().pruneHistory(historyRetention(it->first), budget);
+        mPrunedSinceVacuum += count;
+        budget -= count;
+        if (!budget)
+            break;  // the chat may have more messages to remove, continue with it next time
+        it++;
+    }
+    if (it != chats->end())
+    {
+        mPruneNextChatid = it->first;
+        return;
+    }
+
+    mPruneNextChatid = Id::inval();
+    mPruneNextTs = time(NULL) + kHistoryPruneInterval;
+    if (mPrunedSinceVacuum)
+    {
+        KR_LOG_DEBUG("Removed %u old messages from the local history, shrinking the db file...", mPrunedSinceVacuum);
+        mPrunedSinceVacuum = 0;
+        try
+        {
+            db.incrementalVacuum();
+        }
+        catch (std::exception& e)
+        {
+            KR_LOG_ERROR("Error shrinking the db file: %s", e.what());
+        }
+    }
+}
+
+void Client::setMaxResidentMessages(unsigned count)
+{
+    mMaxResidentMsgs = count;
+}
+
+void Client::trimHistory()
+{
+    if (!mMaxResidentMsgs || !chats || (mInitState != kInitHasOfflineSession && mInitState != kInitHasOnlineSession))
+        return;
+
+    unsigned count = 0;
+    for (auto& item: *chats)
+    {
+        count += item.second->chat().trimHistory(mMaxResidentMsgs);
+    }
+    if (count)
+    {
+        KR_LOG_DEBUG("Released %u old messages from RAM", count);
+    }
+}
+
 Client::~Client()
 {
     assert(isTerminated());
@@ -350,6 +676,7 @@ void Client::saveDb()
     {
         if (db.isOpen())
         {
+            db.sync();  // wait for the writes queued to the writer thread, if any
             db.commit();
         }
     }
@@ -464,6 +791,38 @@ void Client::setCommitMode(bool commitEach)
     db.setCommitMode(commitEach);
 }
 
+void Client::setDbWalMode(bool enable, uint8_t synchronous)
+{
+    if (db.isOpen())
+    {
+        KR_LOG_ERROR("setDbWalMode: database is already open, the journal mode can't be changed");
+        return;
+    }
+    db.setWalMode(enable, synchronous);
+}
+
+void Client::setDbAsyncWrites(bool enable)
+{
+    if (db.isOpen())
+    {
+        KR_LOG_ERROR("setDbAsyncWrites: database is already open, the write mode can't be changed");
+        return;
+    }
+    db.setAsyncWrites(enable);
+    db.setWriteErrorHandler([](const std::exception& e)
+    {
+        KR_LOG_ERROR("Error writing to the db in background: %s", e.what());
+    });
+}
+
+bool Client::openDbReader(SqliteDb& reader) const
+{
+    if (mSid.empty() || !db.isOpen())
+        return false;
+
+    return reader.open(dbPath(mSid).c_str(), true, true);
+}
+
 void Client::commit(const std::string& scsn)
 {
     if (scsn.empty())
@@ -753,9 +1112,13 @@ void Client::onRequestFinish(::mega::MegaApi* /*apiObj*/, ::mega::MegaRequest *r
 void Client::wipeDb(const std::string& sid)
 {
     assert(!sid.empty());
+    mSearcher.reset();
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
+    // in WAL mode, the journal and shared-memory files are left behind when not closed cleanly
+    remove((path + "-wal").c_str());
+    remove((path + "-shm").c_str());
     struct stat info;
     if (stat(path.c_str(), &info) == 0)
         throw std::runtime_error("wipeDb: Could not delete old database file in "+mAppDir);
@@ -767,7 +1130,109 @@ void Client::createDb()
     std::string path = dbPath(mSid);
     if (!db.open(path.c_str(), false))
         throw std::runtime_error("Can't access application database at "+mAppDir);
+    registerDbFunctions(db);
     createDbSchema(); //calls commit() at the end
+    initSearchIndex();
+}
+
+void Client::searchHistory(Id chatid, const std::string& query, unsigned limit,
+                           SearchResultsCb&& onResults, SearchDoneCb&& onDone)
+{
+    if (!mHasSearchIndex)
+        throw std::runtime_error("searchHistory: the local history has no full-text index");
+
+    if (!mSearcher && db.isWalMode())
+    {
+        std::unique_ptr<HistorySearcher> searcher(new HistorySearcher);
+        if (searcher->start(*this))
+        {
+            mSearcher = std::move(searcher);
+        }
+        else
+        {
+            KR_LOG_WARNING("searchHistory: can't open a reader of the local history, searching in the app thread");
+        }
+    }
+
+    std::string sql = "select h.chatid, h.idx, h.msgid, h.userid, h.ts, h.type, h.data, h.keyid, "
+            "h.backrefid, h.updated, h.is_encrypted from (select chatid, idx, "
+            "karere_fts_rank(matchinfo(history_fts, 'pcx')) as rank from history_fts "
+            "where history_fts match ?1";
+    if (chatid.isValid())
+        sql.append(" and chatid = ?3");
+    sql.append(" order by rank desc limit ?2) as hits join history as h "
+               "on h.chatid = hits.chatid and h.idx = hits.idx order by hits.rank desc, h.ts desc");
+
+    struct Search
+    {
+        SearchResultsCb onResults;
+        SearchDoneCb onDone;
+    };
+    std::shared_ptr<Search> search(new Search{std::move(onResults), std::move(onDone)});
+    auto wptr = weakHandle();
+    void* ctx = appCtx;
+    HistorySearcher::Job job = [wptr, ctx, search, sql, query, limit, chatid](SqliteDb& reader)
+    {
+        // the results are delivered in the app thread, in batches
+        std::shared_ptr<std::vector<SearchResult>> batch(new std::vector<SearchResult>);
+        auto deliver = [wptr, ctx, search](std::shared_ptr<std::vector<SearchResult>> results)
+        {
+            marshallCall([wptr, search, results]()
+            {
+                if (!wptr.deleted())
+                    search->onResults(*results);
+            }, ctx);
+        };
+        unsigned count = 0;
+        std::string error;
+        try
+        {
+            SqliteStmt stmt(reader, sql, true);
+            stmt << query << limit;
+            if (chatid.isValid())
+                stmt << chatid;
+
+            while (stmt.step())
+            {
+                Buffer buf;
+                stmt.blobCol(6, buf);
+                std::unique_ptr<chatd::Message> msg(new chatd::Message(stmt.uint64Col(2), stmt.uint64Col(3),
+                    stmt.uintCol(4), stmt.intCol(9), std::move(buf), false, stmt.uintCol(7), (unsigned char)stmt.intCol(5)));
+                msg->backRefId = stmt.uint64Col(8);
+                msg->setEncrypted((uint8_t)stmt.intCol(10));
+                batch->push_back(SearchResult{stmt.uint64Col(0), stmt.intCol(1), std::move(msg)});
+                count++;
+                if (batch->size() == (size_t)kSearchBatchSize)
+                {
+                    deliver(batch);
+                    batch.reset(new std::vector<SearchResult>);
+                }
+            }
+        }
+        catch (std::exception& e)
+        {
+            error = e.what();
+        }
+        if (!batch->empty())
+        {
+            deliver(batch);
+        }
+        marshallCall([wptr, search, count, error]()
+        {
+            if (!wptr.deleted())
+                search->onDone(count, error);
+        }, ctx);
+    };
+
+    if (mSearcher)
+    {
+        db.commit();    // the reader only sees what is committed
+        mSearcher->post(std::move(job));
+    }
+    else
+    {
+        job(db);
+    }
 }
 
 bool Client::checkSyncWithSdkDb(const std::string& scsn,
@@ -1229,6 +1694,7 @@ void Client::terminate(bool deleteDb)
         // stop syncing own-name and close user-attributes cache
         mUserAttrCache->removeCb(mOwnNameAttrHandle);
         mUserAttrCache->onLogOut();
+        mPairwiseKeys.reset();
         mUserAttrCache.reset();
 
         // stop heartbeats
@@ -1253,6 +1719,8 @@ void Client::terminate(bool deleteDb)
         else if (db.isOpen())
         {
             KR_LOG_INFO("Doing final COMMIT to database");
+            mSearcher.reset();
+            db.sync();
             db.commit();
             db.close();
         }
@@ -1382,9 +1850,15 @@ ApiPromise ChatRoom::requestRevokeAccess(mega::MegaNode *node, mega::MegaHandle
 
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid)
 {
+    if (!mPairwiseKeys)
+    {
+        mPairwiseKeys.reset(new strongvelope::PairwiseKeyCache(
+            StaticBuffer(mMyPrivCu25519, 32), *mUserAttrCache, db));
+    }
     return new strongvelope::ProtocolHandler(mMyHandle,
         StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
-        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid, appCtx);
+        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, *mPairwiseKeys,
+        db, chatid, appCtx);
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
@@ -2303,7 +2777,7 @@ promise::Promise<void> GroupChatRoom::invite(uint64_t userid, chatd::Priv priv)
 void ChatRoom::init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
 {
     mChat = &chat;
-    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db);
+    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db, parent.mKarereClient.hasSearchIndex());
     if (mAppChatHandler)
     {
         setAppChatHandler(mAppChatHandler);
@@ -2330,6 +2804,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->resetGetHistory();   // so trimHistory() no longer keeps the window the app was fetching
 }
 
 bool ChatRoom::hasChatHandler() const
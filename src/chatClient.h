@@ -17,7 +17,7 @@
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class PairwiseKeyCache; }
 
 struct sqlite3;
 class Buffer;
@@ -41,6 +41,7 @@ class ContactList;
 
 typedef std::map<Id, chatd::Priv> UserPrivMap;
 class ChatRoomList;
+class HistorySearcher;
 
 /** @brief An abstract class representing a chatd chatroom. It has two
  * descendants - \c PeerChatRoom, representing a 1on1 chatroom,
@@ -610,7 +611,10 @@ public:
 
     enum
     {
-        kHeartbeatTimeout = 10000     /// Timeout for heartbeats (ms)
+        kHeartbeatTimeout = 10000,      /// Timeout for heartbeats (ms)
+        kHistoryPruneBatch = 200,       /// Max number of old messages removed from db per heartbeat
+        kHistoryPruneInterval = 600,    /// Time between checks of the history retention (seconds)
+        kSearchIndexVersion = 1         /// Format of the full-text index, it's rebuilt when it changes
     };
 
     /** @brief Convenience aliases for the \c force flag in \c setPresence() */
@@ -660,6 +664,9 @@ protected:
     std::unique_ptr<UserAttrCache> mUserAttrCache;
     UserAttrCache::Handle mOwnNameAttrHandle;
 
+    // pairwise keys shared by the strongvelope instances of all chats
+    std::unique_ptr<strongvelope::PairwiseKeyCache> mPairwiseKeys;
+
     std::string mSid;
     std::string mLastScsn;
     InitState mInitState = kInitCreated;
@@ -679,6 +686,22 @@ protected:
     megaHandle mHeartbeatTimer = 0;
     bool mGroupCallsEnabled = false;
 
+    // limits of the history kept in cache: default one and per chat
+    chatd::HistoryRetention mHistoryRetention;
+    std::map<karere::Id, chatd::HistoryRetention> mChatHistoryRetention;
+    karere::Id mPruneNextChatid = karere::Id::inval();  // chat to continue the pass of pruning from
+    time_t mPruneNextTs = 0;
+    unsigned mPrunedSinceVacuum = 0;
+
+    // whether the db has a full-text index of the history, which requires sqlite with FTS4
+    bool mHasSearchIndex = false;
+
+    // runs searchHistory() in its own thread, if the db is in WAL mode
+    std::unique_ptr<HistorySearcher> mSearcher;
+
+    // max number of messages kept in RAM for each chat (0: no limit)
+    unsigned mMaxResidentMsgs = 0;
+
 public:
 
     /**
@@ -830,6 +853,85 @@ public:
     void setCommitMode(bool commitEach);
     void saveDb();  // forces a commit
 
+    /**
+     * @brief Uses a write-ahead log for the local cache, instead of the default rollback
+     * journal, with checkpoints done by a background thread. It must be called before \c init()
+     * @param synchronous The level of PRAGMA synchronous. With \c SqliteDb::kSyncNormal commits
+     * don't wait for the disk, at the risk of losing the last commits on power loss.
+     */
+    void setDbWalMode(bool enable, uint8_t synchronous=SqliteDb::kSyncNormal);
+
+    /**
+     * @brief Writes batches of history messages to the local cache in a background
+     * thread, so the processing of incoming history doesn't wait for the disk. Reads
+     * from the cache, \c saveDb() and logout wait for the pending writes to be done.
+     * It must be called before \c init()
+     */
+    void setDbAsyncWrites(bool enable);
+
+    /**
+     * @brief Opens an additional read-only connection to the local cache of the current
+     * session. It can be used from another thread, without blocking the main connection
+     * if the cache is in WAL mode.
+     */
+    bool openDbReader(SqliteDb& reader) const;
+
+    /** Whether the local history can be searched. The full-text index is only available
+     * if sqlite has been built with FTS4 support */
+    bool hasSearchIndex() const { return mHasSearchIndex; }
+
+    /** @brief A message found by \c searchHistory() */
+    struct SearchResult
+    {
+        karere::Id chatid;
+        chatd::Idx idx;
+        std::unique_ptr<chatd::Message> msg;
+    };
+    enum { kSearchBatchSize = 20 };
+    typedef std::function<void(std::vector<SearchResult>& results)> SearchResultsCb;
+    typedef std::function<void(unsigned count, const std::string& error)> SearchDoneCb;
+
+    /**
+     * @brief Searches the text messages of the local history, using its full-text index.
+     * Only messages already in the cache are found.
+     *
+     * If the cache is in WAL mode, the query runs in a dedicated thread, through a read-only
+     * connection. Otherwise, it runs in the calling thread, since a reader would block the
+     * commits of the main connection. Either way, the results are delivered asynchronously,
+     * in the app thread.
+     * @param chatid The chat to search in, or \c Id::inval() to search in all chats
+     * @param query The words to search for, in sqlite FTS syntax (i.e. "word*" to match prefixes)
+     * @param limit The max number of messages to return
+     * @param onResults Called with each batch of up to \c kSearchBatchSize messages found,
+     * sorted by relevance
+     * @param onDone Called after the last batch, with the number of messages found, or with
+     * the error if the query is malformed. Not called if the client is deleted meanwhile
+     * @throws std::runtime_error if there's no index
+     */
+    void searchHistory(karere::Id chatid, const std::string& query, unsigned limit,
+                       SearchResultsCb&& onResults, SearchDoneCb&& onDone);
+
+    /**
+     * @brief Sets limits to the history kept in the local cache. Older messages are
+     * removed in small batches on each heartbeat, and the db file is shrunk afterwards.
+     * They can still be fetched again from server. Caches created by older versions are
+     * only shrunk once converted, when they are opened with limits already set.
+     * @param chatid The chat the limits apply to, or \c Id::inval() to set the default
+     * of all chats. A chat with its own limits doesn't use the default ones.
+     */
+    void setHistoryRetention(const chatd::HistoryRetention& retention, karere::Id chatid = karere::Id::inval());
+    const chatd::HistoryRetention& historyRetention(karere::Id chatid) const;
+    /** @brief Whether limits are set for all chats, or for any of them */
+    bool hasHistoryRetention() const;
+
+    /**
+     * @brief Limits the number of messages of each chat kept in RAM. On each heartbeat,
+     * the oldest messages not yet notified to the app are released, and they are loaded
+     * again from the local cache when needed.
+     * @param count Max number of messages for each chat, or 0 for no limit
+     */
+    void setMaxResidentMessages(unsigned count);
+
     /** @brief There is a call active in the chatroom*/
     bool isCallActive(karere::Id chatid = karere::Id::inval()) const;
 
@@ -849,6 +951,8 @@ public:
 
 protected:
     void heartbeat();
+    void pruneHistory();
+    void trimHistory();
     void setInitState(InitState newState);
 
     // db-related methods
@@ -857,6 +961,9 @@ protected:
     void createDb();
     void wipeDb(const std::string& sid);
     void createDbSchema();
+    /** Creates the full-text index of the history if it's missing or outdated, provided
+     * that sqlite supports it. @see hasSearchIndex() */
+    void initSearchIndex();
 
     // initialization of own handle/email/identity/keys/contacts...
     karere::Id getMyHandleFromDb();
@@ -2,9 +2,9 @@
 #include "chatClient.h"
 #include "chatdICrypto.h"
 #include "base64url.h"
+#include <base/urlScanner.h>
 #include <algorithm>
 #include <random>
-#include <regex>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 
@@ -23,12 +23,12 @@ using ::mega::mega_snprintf;   // enables the calls to snprintf below which are
 #define ID_CSTR(id) id.toString().c_str()
 
 // logging for a specific chatid - prepends the chatid and calls the normal logging macro
-#define CHATID_LOG_DEBUG(fmtString,...) CHATD_LOG_DEBUG("[shard %d]: %s: " fmtString, mConnection.shardNo(), ID_CSTR(chatId()), ##__VA_ARGS__)
+#define CHATID_LOG_DEBUG(fmtString,...) KARERE_LOGB_DEBUG(krLogChannel_chatd, "[shard %d]: %s: " fmtString, mConnection.shardNo(), ID_LOGARG(chatId()), ##__VA_ARGS__)
 #define CHATID_LOG_WARNING(fmtString,...) CHATD_LOG_WARNING("[shard %d]: %s: " fmtString, mConnection.shardNo(), ID_CSTR(chatId()), ##__VA_ARGS__)
 #define CHATID_LOG_ERROR(fmtString,...) CHATD_LOG_ERROR("[shard %d]: %s: " fmtString, mConnection.shardNo(), ID_CSTR(chatId()), ##__VA_ARGS__)
 
 // logging for a specific shard - prepends the shard number and calls the normal logging macro
-#define CHATDS_LOG_DEBUG(fmtString,...) CHATD_LOG_DEBUG("[shard %d]: " fmtString, shardNo(), ##__VA_ARGS__)
+#define CHATDS_LOG_DEBUG(fmtString,...) KARERE_LOGB_DEBUG(krLogChannel_chatd, "[shard %d]: " fmtString, shardNo(), ##__VA_ARGS__)
 #define CHATDS_LOG_WARNING(fmtString,...) CHATD_LOG_WARNING("[shard %d]: " fmtString, shardNo(), ##__VA_ARGS__)
 #define CHATDS_LOG_ERROR(fmtString,...) CHATD_LOG_ERROR("[shard %d]: " fmtString, shardNo(), ##__VA_ARGS__)
 
@@ -255,6 +255,16 @@ uint8_t Client::keepaliveType()
     return mKeepaliveType;
 }
 
+unsigned Client::sendCoalesceWindow() const
+{
+    return mSendCoalesceWindow;
+}
+
+void Client::setSendCoalesceWindow(unsigned ms)
+{
+    mSendCoalesceWindow = ms;
+}
+
 std::shared_ptr<Chat> Client::chatFromId(Id chatid) const
 {
     auto it = mChatForChatId.find(chatid);
@@ -537,6 +547,7 @@ void Connection::setState(State state)
     if (mState == kStateDisconnected)
     {
         mHeartbeatEnabled = false;
+        mSendFailed = false;
 
         // if a socket is opened, close it immediately
         if (wsIsConnected())
@@ -544,6 +555,8 @@ void Connection::setState(State state)
             wsDisconnect(true);
         }
 
+        discardOutput();
+
         // if an ECHO was sent, no need to wait for its response
         if (mEchoTimer)
         {
@@ -912,6 +925,7 @@ void Connection::retryPendingConnection(bool disconnect)
 Connection::~Connection()
 {
     disconnect();
+    discardOutput();
 }
 
 void Connection::heartbeat()
@@ -961,14 +975,95 @@ void Client::heartbeat()
 
 bool Connection::sendBuf(Buffer&& buf)
 {
-    if (!isOnline())
+    if (!isOnline() || mSendFailed)
         return false;
 
-    bool rc = wsSendMessage(buf.buf(), buf.dataSize());
+    // chatd parses several commands per frame, so commands are packed together
+    // instead of sending a frame for each one
+    bool flushNow = mOutput.add(buf);
     buf.free();
+
+    if (flushNow)
+        return flushOutput();
+
+    if (!mFlushTimer)
+    {
+        auto wptr = weakHandle();
+        mFlushTimer = setTimeout([this, wptr]()
+        {
+            if (wptr.deleted())
+                return;
+
+            mFlushTimer = 0;
+            flushOutput();
+        }, mChatdClient.mSendCoalesceWindow, mChatdClient.mKarereClient->appCtx);
+    }
+    return true;
+}
+
+bool Connection::flushOutput()
+{
+    if (mFlushTimer)
+    {
+        cancelTimeout(mFlushTimer, mChatdClient.mKarereClient->appCtx);
+        mFlushTimer = 0;
+    }
+
+    if (mOutput.empty())
+        return true;
+
+    if (!isOnline() || mSendFailed)
+    {
+        discardOutput();
+        return false;
+    }
+
+    const Buffer& frame = mOutput.frame();
+    bool rc = wsSendMessage(frame.buf(), frame.dataSize());
+    if (!rc)
+    {
+        CHATDS_LOG_WARNING("flushOutput: failed to send %zu bytes, reconnecting...", frame.dataSize());
+        onSendFailed();
+    }
+
+    mOutput.clear();
     return rc;
 }
 
+void Connection::onSendFailed()
+{
+    // the commands of the frame were reported as sent to their callers, so they
+    // can't retry them. Restart the connection: upon login, the chats are joined
+    // again and the messages not confirmed yet are resent
+    if (mSendFailed)
+        return; // already restarting
+
+    mSendFailed = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]() // not from within the caller, which may be iterating the chats or the sending queue
+    {
+        if (wptr.deleted() || !mSendFailed || mChatdClient.mKarereClient->isTerminated())
+            return;
+
+        setState(kStateDisconnected);
+        abortRetryController();
+        reconnect();
+    }, mChatdClient.mKarereClient->appCtx);
+}
+
+void Connection::discardOutput()
+{
+    if (mFlushTimer)
+    {
+        cancelTimeout(mFlushTimer, mChatdClient.mKarereClient->appCtx);
+        mFlushTimer = 0;
+    }
+
+    // pending commands are not resent: they are regenerated upon login (JOIN, SEEN...),
+    // or kept by the chat until confirmed (NEWMSG, MSGUPD...)
+    mOutput.discard();
+}
+
 bool Connection::sendCommand(Command&& cmd)
 {
     CHATDS_LOG_DEBUG("send %s", cmd.toString().c_str());
@@ -1429,9 +1524,16 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         mHasMoreHistoryInDb = true;
         mForwardStart = info.newestDbIdx + 1;
         CHATID_LOG_DEBUG("Db has local history: %s - %s (middle point: %u)",
-            ID_CSTR(info.oldestDbId), ID_CSTR(info.newestDbId), mForwardStart);
+            ID_LOGARG(info.oldestDbId), ID_LOGARG(info.newestDbId), mForwardStart);
         loadAndProcessUnsent();
-        getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
+
+        // the history is loaded from db when requested by the app (i.e. the chatroom is opened),
+        // only the last message is needed to list the chat
+        CALL_DB(getLastTextMessage, info.newestDbIdx, mLastTextMsg);
+        if (mLastTextMsg.isValid() && mLastTextMsg.ts() > mLastMsgTs)
+        {
+            mLastMsgTs = mLastTextMsg.ts();
+        }
     }
 }
 Chat::~Chat()
@@ -1441,11 +1543,12 @@ Chat::~Chat()
     catch(std::exception& e)
     { CHATID_LOG_ERROR("EXCEPTION from ICrypto destructor: %s", e.what()); }
     mCrypto = nullptr;
-    clear();
+    // the db may still have a batch of messages to write, which refer to the ones in RAM
     try { delete mDbInterface; }
     catch(std::exception& e)
     { CHATID_LOG_ERROR("EXCEPTION from DbInterface destructor: %s", e.what()); }
     mDbInterface = nullptr;
+    clear();
 }
 
 Idx Chat::getHistoryFromDb(unsigned count)
@@ -1490,7 +1593,47 @@ Idx Chat::getHistoryFromDb(unsigned count)
 void Connection::wsHandleMsgCb(char *data, size_t len)
 {
     mTsLastRecv = time(NULL);
+    mProcessingFrame = true;
     execCommand(StaticBuffer(data, len));
+    mProcessingFrame = false;
+    flushFrameBatches();
+}
+
+void Connection::flushFrameBatches()
+{
+    // the messages decrypted now must not be deferred again
+    bool processingFrame = mProcessingFrame;
+    mProcessingFrame = false;
+    decryptBatches();
+    commitHistoryBatches();
+    mProcessingFrame = processingFrame;
+}
+
+void Connection::decryptBatches()
+{
+    std::set<karere::Id> chatids;
+    chatids.swap(mDecryptBatchChats);
+    for (auto& chatid: chatids)
+    {
+        auto chat = mChatdClient.chatFromId(chatid);
+        if (chat)
+        {
+            chat->decryptBatches();
+        }
+    }
+}
+
+void Connection::commitHistoryBatches()
+{
+    for (auto& chatid: mHistBatchChats)
+    {
+        auto chat = mChatdClient.chatFromId(chatid);
+        if (chat)
+        {
+            chat->commitHistoryBatch();
+        }
+    }
+    mHistBatchChats.clear();
 }
 
 // inbound command processing
@@ -1512,6 +1655,14 @@ void Connection::execCommand(const StaticBuffer& buf)
 #ifndef NDEBUG
         size_t base = pos;
 #endif
+        if (opcode != OP_OLDMSG && opcode != OP_NEWMSG
+                && (!mDecryptBatchChats.empty() || !mHistBatchChats.empty()))
+        {
+            // any other command may refer to the messages received so far in this
+            // frame (MSGUPD, SEEN, RECEIVED...), so they have to be decrypted and
+            // written to db before it is processed
+            flushFrameBatches();
+        }
         switch (opcode)
         {
             case OP_KEEPALIVE:
@@ -1536,7 +1687,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 Priv priv = (Priv)buf.read<int8_t>(pos);
                 pos++;
                 CHATDS_LOG_DEBUG("%s: recv JOIN - user '%s' with privilege level %d",
-                                ID_CSTR(chatid), ID_CSTR(userid), priv);
+                                ID_LOGARG(chatid), ID_LOGARG(userid), priv);
 
                 if (userid == Id::COMMANDER())
                 {
@@ -1567,8 +1718,8 @@ void Connection::execCommand(const StaticBuffer& buf)
                 pos += msglen;
 
                 CHATDS_LOG_DEBUG("%s: recv %s - msgid: '%s', from user '%s' with keyid %u, ts %u, tsdelta %u",
-                    ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
-                    ID_CSTR(userid), keyid, ts, updated);
+                    ID_LOGARG(chatid), Command::opcodeToStr(opcode), ID_LOGARG(msgid),
+                    ID_LOGARG(userid), keyid, ts, updated);
 
                 std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
                 msg->setEncrypted(Message::kEncryptedPending);
@@ -1581,6 +1732,10 @@ void Connection::execCommand(const StaticBuffer& buf)
                 {
                     if (!chat.isFetchingNodeHistory() || opcode == OP_NEWMSG)
                     {
+                        if (mHistBatchChats.insert(chatid).second)
+                        {
+                            chat.beginHistoryBatch();
+                        }
                         chat.msgIncoming((opcode == OP_NEWMSG), msg.release(), false);
                     }
                     else
@@ -1594,7 +1749,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             {
                 READ_CHATID(0);
                 READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("%s: recv SEEN - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
+                CHATDS_LOG_DEBUG("%s: recv SEEN - msgid: '%s'", ID_LOGARG(chatid), ID_LOGARG(msgid));
                 mChatdClient.chats(chatid).onLastSeen(msgid);
                 break;
             }
@@ -1602,7 +1757,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             {
                 READ_CHATID(0);
                 READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("%s: recv RECEIVED - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
+                CHATDS_LOG_DEBUG("%s: recv RECEIVED - msgid: '%s'", ID_LOGARG(chatid), ID_LOGARG(msgid));
                 mChatdClient.chats(chatid).onLastReceived(msgid);
                 break;
             }
@@ -1612,14 +1767,14 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_ID(userid, 8);
                 READ_32(period, 16);
                 CHATDS_LOG_DEBUG("%s: recv RETENTION by user '%s' to %u second(s)",
-                                ID_CSTR(chatid), ID_CSTR(userid), period);
+                                ID_LOGARG(chatid), ID_LOGARG(userid), period);
                 break;
             }
             case OP_MSGID:
             {
                 READ_ID(msgxid, 0);
                 READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("recv MSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
+                CHATDS_LOG_DEBUG("recv MSGID: '%s' -> '%s'", ID_LOGARG(msgxid), ID_LOGARG(msgid));
                 mChatdClient.onMsgAlreadySent(msgxid, msgid);
                 break;
             }
@@ -1627,7 +1782,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             {
                 READ_ID(msgxid, 0);
                 READ_ID(msgid, 8);
-                CHATDS_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
+                CHATDS_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_LOGARG(msgxid), ID_LOGARG(msgid));
                 mChatdClient.msgConfirm(msgxid, msgid);
                 break;
             }
@@ -1637,7 +1792,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_ID(oldest, 8);
                 READ_ID(newest, 16);
                 CHATDS_LOG_DEBUG("%s: recv RANGE - (%s - %s)",
-                                ID_CSTR(chatid), ID_CSTR(oldest), ID_CSTR(newest));
+                                ID_LOGARG(chatid), ID_LOGARG(oldest), ID_LOGARG(newest));
                 auto& msgs = mClient.chats(chatid);
                 if (msgs.onlineState() == kChatStateJoining)
                     msgs.initialFetchHistory(newest);
@@ -1689,7 +1844,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             case OP_HISTDONE:
             {
                 READ_CHATID(0);
-                CHATDS_LOG_DEBUG("%s: recv HISTDONE - history retrieval finished", ID_CSTR(chatid));
+                CHATDS_LOG_DEBUG("%s: recv HISTDONE - history retrieval finished", ID_LOGARG(chatid));
                 Chat &chat = mChatdClient.chats(chatid);
                 chat.onHistDone();
                 break;
@@ -1699,7 +1854,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_CHATID(0);
                 READ_32(keyxid, 8);
                 READ_32(keyid, 12);
-                CHATDS_LOG_DEBUG("%s: recv NEWKEYID: %u -> %u", ID_CSTR(chatid), keyxid, keyid);
+                CHATDS_LOG_DEBUG("%s: recv NEWKEYID: %u -> %u", ID_LOGARG(chatid), keyxid, keyid);
                 mChatdClient.chats(chatid).keyConfirm(keyxid, keyid);
                 break;
             }
@@ -1710,7 +1865,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_32(totalLen, 12);
                 const char* keys = buf.readPtr(pos, totalLen);
                 pos+=totalLen;
-                CHATDS_LOG_DEBUG("%s: recv NEWKEY %u", ID_CSTR(chatid), keyid);
+                CHATDS_LOG_DEBUG("%s: recv NEWKEY %u", ID_LOGARG(chatid), keyid);
                 mChatdClient.chats(chatid).onNewKeys(StaticBuffer(keys, totalLen));
                 break;
             }
@@ -1720,7 +1875,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_CHATID(0);
                 READ_ID(userid, 8);
                 READ_32(clientid, 16);
-                CHATDS_LOG_DEBUG("%s: recv INCALL userid %s, clientid: %x", ID_CSTR(chatid), ID_CSTR(userid), clientid);
+                CHATDS_LOG_DEBUG("%s: recv INCALL userid %s, clientid: %x", ID_LOGARG(chatid), ID_LOGARG(userid), clientid);
                 auto& chat = mChatdClient.chats(chatid);
                 // TODO: remove this block once the groucalls are fully supported by clients
                 if ((chat.isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
@@ -1737,7 +1892,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_CHATID(0);
                 READ_ID(userid, 8);
                 READ_32(clientid, 16);
-                CHATDS_LOG_DEBUG("%s: recv ENDCALL userid: %s, clientid: %x", ID_CSTR(chatid), ID_CSTR(userid), clientid);
+                CHATDS_LOG_DEBUG("%s: recv ENDCALL userid: %s, clientid: %x", ID_LOGARG(chatid), ID_LOGARG(userid), clientid);
                 auto& chat = mChatdClient.chats(chatid);
                 // TODO: remove this block once the groucalls are fully supported by clients
                 if ((chat.isGroup() && !mChatdClient.mKarereClient->areGroupCallsEnabled()))
@@ -1754,7 +1909,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_ID(userid, 8);
                 READ_32(clientid, 16);
                 READ_16(payloadLen, 20);
-                CHATDS_LOG_DEBUG("%s: recv CALLDATA userid: %s, clientid: %x, PayloadLen: %d", ID_CSTR(chatid), ID_CSTR(userid), clientid, payloadLen);
+                CHATDS_LOG_DEBUG("%s: recv CALLDATA userid: %s, clientid: %x, PayloadLen: %d", ID_LOGARG(chatid), ID_LOGARG(userid), clientid, payloadLen);
                 pos += payloadLen; // payload bytes will be consumed by handleCallData(), but does not update `pos` pointer
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -1799,13 +1954,13 @@ void Connection::execCommand(const StaticBuffer& buf)
 #ifndef KARERE_DISABLE_WEBRTC
                 auto& chat = mChatdClient.chats(chatid);
                 StaticBuffer cmd(buf.buf() + cmdstart, 23 + payloadLen);
-                CHATDS_LOG_DEBUG("%s: recv %s", ID_CSTR(chatid), ::rtcModule::rtmsgCommandToString(cmd).c_str());
+                CHATDS_LOG_DEBUG("%s: recv %s", ID_LOGARG(chatid), ::rtcModule::rtmsgCommandToString(cmd).c_str());
                 if (mChatdClient.mRtcHandler)
                 {
                     mChatdClient.mRtcHandler->handleMessage(chat, cmd);
                 }
 #else
-                CHATDS_LOG_DEBUG("%s: recv %s userid: %s, clientid: %x", ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(userid), clientid);
+                CHATDS_LOG_DEBUG("%s: recv %s userid: %s, clientid: %x", ID_LOGARG(chatid), Command::opcodeToStr(opcode), ID_LOGARG(userid), clientid);
 #endif
                 break;
             }
@@ -1836,7 +1991,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_ID(msgid, 16);
                 READ_32(reaction, 24);
                 CHATDS_LOG_DEBUG("%s: recv ADDREACTION from user %s to message %s reaction %d",
-                                ID_CSTR(chatid), ID_CSTR(userid), ID_CSTR(msgid), reaction);
+                                ID_LOGARG(chatid), ID_LOGARG(userid), ID_LOGARG(msgid), reaction);
                 break;
             }
             case OP_DELREACTION:
@@ -1847,13 +2002,13 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_ID(msgid, 16);
                 READ_32(reaction, 24);
                 CHATDS_LOG_DEBUG("%s: recv DELREACTION from user %s to message %s reaction %d",
-                                ID_CSTR(chatid), ID_CSTR(userid), ID_CSTR(msgid), reaction);
+                                ID_LOGARG(chatid), ID_LOGARG(userid), ID_LOGARG(msgid), reaction);
                 break;
             }
             case OP_SYNC:
             {
                 READ_CHATID(0);
-                CHATDS_LOG_DEBUG("%s: recv SYNC", ID_CSTR(chatid));
+                CHATDS_LOG_DEBUG("%s: recv SYNC", ID_LOGARG(chatid));
                 mChatdClient.mKarereClient->onSyncReceived(chatid);
                 break;
             }
@@ -1861,7 +2016,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             {
                 READ_CHATID(0);
                 READ_32(duration, 8);
-                CHATDS_LOG_DEBUG("%s: recv CALLTIME: %d", ID_CSTR(chatid), duration);
+                CHATDS_LOG_DEBUG("%s: recv CALLTIME: %d", ID_LOGARG(chatid), duration);
 #ifndef KARERE_DISABLE_WEBRTC
                 if (mChatdClient.mRtcHandler)
                 {
@@ -1909,7 +2064,7 @@ void Chat::onNewKeys(StaticBuffer&& keybuf)
         const char *key = keybuf.readPtr(pos, keylen);  pos += keylen;
 
         CHATID_LOG_DEBUG("sending key %d for user %s with length %zu to crypto module",
-                         keyid, userid.toString().c_str(), keybuf.dataSize());
+                         keyid, ID_LOGARG(userid), keybuf.dataSize());
         CALL_CRYPTO(onKeyReceived, keyid, userid, mChatdClient.myHandle(), key, keylen);
     }
 
@@ -2062,7 +2217,7 @@ void Chat::replayUnsentNotifications()
         }
         else if (item.opcode() == OP_MSGUPD)
         {
-            CHATID_LOG_DEBUG("Adding a pending edit of msgid %s", ID_CSTR(item.msg->id()));
+            CHATID_LOG_DEBUG("Adding a pending edit of msgid %s", ID_LOGARG(item.msg->id()));
             mPendingEdits[item.msg->id()] = item.msg;
             CALL_LISTENER(onUnsentEditLoaded, *item.msg, false);
         }
@@ -2078,7 +2233,7 @@ void Chat::replayUnsentNotifications()
             //of an edit. Then, when it receives the MSGUPD confirmation, it will
             //suddenly flash an indicator that the message was edited, which may be
             //confusing to the user.
-            CHATID_LOG_DEBUG("Adding a pending edit of msgxid %s", ID_CSTR(item.msg->id()));
+            CHATID_LOG_DEBUG("Adding a pending edit of msgxid %s", ID_LOGARG(item.msg->id()));
             CALL_LISTENER(onUnsentEditLoaded, *item.msg, true);
         }
     }
@@ -2119,8 +2274,8 @@ bool Chat::isGroup() const
 
 void Chat::clearHistory()
 {
+    CALL_DB(clearHistory);  // before the messages in RAM are freed, since they may be batched
     initChat();
-    CALL_DB(clearHistory);
     CALL_CRYPTO(onHistoryReload);
     CALL_LISTENER(onHistoryReloaded);
 }
@@ -2169,6 +2324,34 @@ bool Chat::haveAllHistoryNotified() const
     return (mNextHistFetchIdx < lownum());
 }
 
+Idx Chat::msgIndexFromIdOrDb(Id msgid)
+{
+    Idx idx = msgIndexFromId(msgid);
+    if (idx == CHATD_IDX_INVALID && mHasMoreHistoryInDb)
+    {
+        idx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
+    }
+    return idx;
+}
+
+std::unique_ptr<Message> Chat::findOrLoad(Idx num)
+{
+    if (num == CHATD_IDX_INVALID || num >= lownum())
+    {
+        Message* msg = findOrNull(num);
+        return std::unique_ptr<Message>(msg ? new Message(*msg) : nullptr);
+    }
+    if (!mHasMoreHistoryInDb || num < mDbInterface->getOldestIdx())
+    {
+        return nullptr;
+    }
+
+    // only that message is loaded, so trimHistory() is not undone. Indexes in db are contiguous
+    std::vector<Message*> messages;
+    CALL_DB(fetchDbHistory, num, 1, messages);
+    return std::unique_ptr<Message>(messages.empty() ? nullptr : messages[0]);
+}
+
 Message *Chat::getMessageFromNodeHistory(Id msgid) const
 {
     return mAttachmentNodes->getMessage(msgid);
@@ -2233,6 +2416,8 @@ void Chat::initChat()
     mEncryptionHalted = false;
     mDecryptNewHaltedAt = CHATD_IDX_INVALID;
     mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    mDecryptBatchNew = false;
+    mDecryptBatchOld = false;
     mRefidToIdxMap.clear();
 
     mHasMoreHistoryInDb = false;
@@ -2245,9 +2430,8 @@ void Chat::requestRichLink(Message &message)
     std::string url;
     if (Message::hasUrl(text, url))
     {
-        std::regex expresion("^(http://|https://)(.+)");
         std::string linkRequest = url;
-        if (!regex_match(url, expresion))
+        if (url.compare(0, 7, "http://") && url.compare(0, 8, "https://"))
         {
             linkRequest = std::string("http://") + url;
         }
@@ -2336,7 +2520,7 @@ void Chat::requestRichLink(Message &message)
             }
             else
             {
-                CHATID_LOG_DEBUG("requestRichLink: Message has been updated during rich link request (%s)", ID_CSTR(msgId));
+                CHATID_LOG_DEBUG("requestRichLink: Message has been updated during rich link request (%s)", ID_LOGARG(msgId));
             }
         })
         .fail([wptr, this](const ::promise::Error& err)
@@ -2444,6 +2628,16 @@ void Chat::attachmentHistDone()
     mAttachmentNodes->finishFetchingFromServer();
 }
 
+void Chat::beginHistoryBatch()
+{
+    CALL_DB(beginHistoryBatch);
+}
+
+void Chat::commitHistoryBatch()
+{
+    CALL_DB(commitHistoryBatch);
+}
+
 Message* Chat::msgSubmit(const char* msg, size_t msglen, unsigned char type, void* userp)
 {
     if (msglen > kMaxMsgSize)
@@ -2590,6 +2784,8 @@ bool Chat::sendKeyAndMessage(std::pair<MsgCommand*, KeyCommand*> cmd)
     assert(cmd.first);
     if (cmd.second) // if NEWKEY is required for this NEWMSG...
     {
+        // NEWKEY is only queued, so this fails only if offline. If the frame is lost
+        // later, both commands are resent upon reconnection, since they are in mSending
         if (!sendCommand(*cmd.second))
             return false;
     }
@@ -2684,7 +2880,7 @@ Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void*
     uint32_t age = now - msg.ts;
     if (!msg.isSending() && age > CHATD_MAX_EDIT_AGE)
     {
-        CHATID_LOG_DEBUG("msgModify: Denying edit of msgid %s because message is too old", ID_CSTR(msg.id()));
+        CHATID_LOG_DEBUG("msgModify: Denying edit of msgid %s because message is too old", ID_LOGARG(msg.id()));
         return nullptr;
     }
     if (newlen > kMaxMsgSize)
@@ -2875,7 +3071,7 @@ void Chat::onLastSeen(Id msgid)
     {
         if (mLastSeenIdx == CHATD_IDX_INVALID)  // don't have a previous idx yet --> initialization
         {
-            CHATID_LOG_DEBUG("onLastSeen: Setting last seen msgid to %s", ID_CSTR(msgid));
+            CHATID_LOG_DEBUG("onLastSeen: Setting last seen msgid to %s", ID_LOGARG(msgid));
             mLastSeenId = msgid;
             CALL_DB(setLastSeen, msgid);
 
@@ -2898,7 +3094,7 @@ void Chat::onLastSeen(Id msgid)
         return;
     }
 
-    CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_CSTR(msgid));
+    CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_LOGARG(msgid));
     mLastSeenId = msgid;
     CALL_DB(setLastSeen, msgid);
 
@@ -2937,7 +3133,7 @@ bool Chat::setMessageSeen(Idx idx)
     auto& msg = at(idx);
     if (msg.userid == mChatdClient.mMyHandle)
     {
-        CHATID_LOG_DEBUG("Asked to mark own message %s as seen, ignoring", ID_CSTR(msg.id()));
+        CHATID_LOG_DEBUG("Asked to mark own message %s as seen, ignoring", ID_LOGARG(msg.id()));
         return false;
     }
 
@@ -2953,7 +3149,7 @@ bool Chat::setMessageSeen(Idx idx)
         if ((mLastSeenIdx != CHATD_IDX_INVALID) && (idx <= mLastSeenIdx))
             return;
 
-        CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_CSTR(id));
+        CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_LOGARG(id));
         sendCommand(Command(OP_SEEN) + mChatId + id);
 
         Idx notifyStart;
@@ -3001,33 +3197,108 @@ bool Chat::setMessageSeen(Id msgid)
 
 int Chat::unreadMsgCount() const
 {
+    // the db layer keeps the counter up to date, so this doesn't need to scan the history
+    if (mLastSeenIdx == CHATD_IDX_INVALID && !mHaveAllHistory)
+    {
+        // last seen message is not known: the count is a lower bound
+        return -mDbInterface->getUnreadMsgCountAfterIdx(CHATD_IDX_INVALID);
+    }
+    return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
+}
+
+unsigned Chat::pruneHistory(const HistoryRetention& retention, unsigned maxRows)
+{
+    // only messages in db but not in RAM can be removed, and not while fetching from server,
+    // since the index of the history received is determined by the oldest message in db
+    if (!retention.isEnabled() || !mHasMoreHistoryInDb || isFetchingFromServer())
+        return 0;
+
+    // if the history hasn't been loaded from db (the chat was never opened), the newest message
+    // in db is kept: it's the point where the history received from server is attached to
+    Idx maxIdx = empty() ? mForwardStart - 2 : lownum() - 1;
+
+    // keep seen/received messages, so their indexes can be resolved when the chat is loaded
+    if (mLastSeenIdx != CHATD_IDX_INVALID && mLastSeenIdx <= maxIdx)
+        maxIdx = mLastSeenIdx - 1;
+    if (mLastReceivedIdx != CHATD_IDX_INVALID && mLastReceivedIdx <= maxIdx)
+        maxIdx = mLastReceivedIdx - 1;
+
+    unsigned count = 0;
+    try
+    {
+        count = mDbInterface->pruneHistory(retention, maxIdx, maxRows);
+    }
+    catch (std::exception& e)
+    {
+        CHATID_LOG_ERROR("Error removing old history from db: %s", e.what());
+        return 0;
+    }
+    if (!count)
+        return 0;
+
+    ChatDbInfo info;
+    mDbInterface->getHistoryInfo(info);
+    mOldestKnownMsgId = info.oldestDbId;
+    mHasMoreHistoryInDb = (mDbInterface->getOldestIdx() < lownum());
+    mHaveAllHistory = false;
+    CHATID_LOG_DEBUG("Removed %u old messages from db, oldest message in db is now %s",
+                     count, ID_LOGARG(mOldestKnownMsgId));
+
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
-        if (mHaveAllHistory)
-        {
-            return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
-        }
-        else
-        {
-            return -mDbInterface->getUnreadMsgCountAfterIdx(CHATD_IDX_INVALID);
-        }
+        // the unread count was based on the whole history, it's a lower bound now
+        CALL_LISTENER(onUnreadChanged);
     }
-    else if (mLastSeenIdx < lownum())
+    return count;
+}
+
+unsigned Chat::trimHistory(unsigned maxMsgs)
+{
+    // not while history is being fetched or decrypted, since the index and processing
+    // of the incoming messages depend on the ones in RAM
+    if (maxMsgs < initialHistoryFetchCount)
     {
-        return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
+        maxMsgs = initialHistoryFetchCount;  // keep, at least, what's shown upon opening the chat
     }
+    if ((size() <= (Idx)maxMsgs) || (mServerFetchState != kHistNotFetching)
+            || (mDecryptOldHaltedAt != CHATD_IDX_INVALID) || (mDecryptNewHaltedAt != CHATD_IDX_INVALID))
+        return 0;
 
-    Idx first = mLastSeenIdx+1;
-    unsigned count = 0;
-    auto last = highnum();
-    for (Idx i=first; i<=last; i++)
+    // the released messages must be in db, to be loaded again
+    if (!mOldestKnownMsgId || mDbInterface->getOldestIdx() > lownum())
+        return 0;
+
+    // the history in RAM is contiguous up to the newest message, so only the oldest
+    // end can be released. If the app is fetching history, keep a window around the
+    // fetch position: the messages it was notified of, and some of the next ones
+    Idx end = highnum() - (Idx)maxMsgs;
+    if (mNextHistFetchIdx != CHATD_IDX_INVALID && mNextHistFetchIdx - (Idx)maxMsgs / 2 <= end)
     {
-        auto& msg = at(i);
-        if (msg.isValidUnread(mChatdClient.myHandle()))
+        end = mNextHistFetchIdx - (Idx)maxMsgs / 2 - 1;
+    }
+    Idx idx = lownum();
+    for (; idx <= end; idx++)
+    {
+        Message& msg = at(idx);
+        if (msg.isPendingToDecrypt() || msg.isEncrypted() == Message::kEncryptedNoType)
+            break;  // the decryption in progress refers to it
+
+        mIdToIndexMap.erase(msg.id());
+        if (msg.backRefId)
         {
-            count++;
+            auto it = mRefidToIdxMap.find(msg.backRefId);
+            if (it != mRefidToIdxMap.end() && it->second == idx)
+                mRefidToIdxMap.erase(msg.backRefId);
         }
     }
+
+    unsigned count = idx - lownum();
+    if (!count)
+        return 0;
+
+    deleteMessagesBefore(idx);
+    mHasMoreHistoryInDb = true;
+    CHATID_LOG_DEBUG("Released %u old messages from RAM, oldest message in RAM is now idx %d", count, idx);
     return count;
 }
 
@@ -3083,7 +3354,7 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
     assert(dbInfo.oldestDbId && dbInfo.newestDbId);
     mServerFetchState = kHistFetchingNewFromServer;
     CHATID_LOG_DEBUG("Sending JOINRANGEHIST based on app db: %s - %s",
-            dbInfo.oldestDbId.toString().c_str(), dbInfo.newestDbId.toString().c_str());
+            ID_LOGARG(dbInfo.oldestDbId), ID_LOGARG(dbInfo.newestDbId));
 
     mFetchRequest.push(FetchType::kFetchMessages);
     sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + at(highnum()).id());
@@ -3128,7 +3399,7 @@ bool Chat::msgAlreadySent(Id msgxid, Id msgid)
     if (!msg)
         return false; // message does not belong to our chat
 
-    CHATID_LOG_DEBUG("message is sending status was already received by server '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
+    CHATID_LOG_DEBUG("message is sending status was already received by server '%s' -> '%s'", ID_LOGARG(msgxid), ID_LOGARG(msgid));
     CALL_LISTENER(onMessageRejected, *msg, 0);
     delete msg;
     return true;
@@ -3151,7 +3422,7 @@ Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
     if ((item.opcode() == OP_NEWMSG || item.opcode() == OP_NEWNODEMSG) && (msgxidOri != msgxid))
     {
         CHATID_LOG_DEBUG("msgConfirm: sendQueue starts with NEWMSG, but the msgxid is different"
-                         " (sent msgxid: '%s', received '%s')", ID_CSTR(msgxidOri), ID_CSTR(msgxid));
+                         " (sent msgxid: '%s', received '%s')", ID_LOGARG(msgxidOri), ID_LOGARG(msgxid));
         return nullptr;
     }
 
@@ -3184,7 +3455,7 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
     if (!msg)
         return CHATD_IDX_INVALID;
 
-    CHATID_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
+    CHATID_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_LOGARG(msgxid), ID_LOGARG(msgid));
 
     // update msgxid to msgid
     msg->setId(msgid, false);
@@ -3607,7 +3878,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
 // To avoid this, we have to detect the replay. But if we detect it, we can actually
 // avoid the whole replay (even the idempotent part), and just bail out.
 
-    CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
+    CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_LOGARG(msg.id()), idx, mForwardStart);
     CALL_CRYPTO(resetSendKey);      // discard current key, if any
     CALL_DB(truncateHistory, msg);
     if (idx != CHATD_IDX_INVALID)   // message is loaded in RAM
@@ -3875,7 +4146,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
 
     if (!msg.isPendingToDecrypt() && msg.isEncrypted() != Message::kEncryptedNoType)
     {
-        CHATID_LOG_DEBUG("Message already decrypted or undecryptable: %s, bailing out", ID_CSTR(msg.id()));
+        CHATID_LOG_DEBUG("Message already decrypted or undecryptable: %s, bailing out", ID_LOGARG(msg.id()));
         return true;
     }
 
@@ -3895,6 +4166,24 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             return false;
         }
     }
+    if (mConnection.mProcessingFrame)
+    {
+        // defer it to the end of the frame, so the messages received in the
+        // same frame (i.e. a history fetch) are decrypted in parallel
+        if (isNew)
+        {
+            mDecryptNewHaltedAt = idx;
+            mDecryptBatchNew = true;
+        }
+        else
+        {
+            mDecryptOldHaltedAt = idx;
+            mDecryptBatchOld = true;
+        }
+        mConnection.mDecryptBatchChats.insert(mChatId);
+        return false;
+    }
+
     CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
     auto pms = mCrypto->msgDecrypt(&msg);
     if (pms.succeeded())
@@ -3962,51 +4251,16 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         msgIncomingAfterDecrypt(isNew, false, *message, idx);
         if (isNew)
         {
-            // Decrypt the rest - try to decrypt immediately (synchromously),
-            // so that order is guaranteed. Bail out of the loop at the first
-            // message that can't be decrypted immediately(msgIncomingAfterAdd()
-            // returns false). Will continue when the delayed decrypt finishes
-
             auto first = mDecryptNewHaltedAt + 1;
             mDecryptNewHaltedAt = CHATD_IDX_INVALID;
-            auto last = highnum();
-            for (Idx i = first; i <= last; i++)
-            {
-                if (!msgIncomingAfterAdd(isNew, false, at(i), i))
-                    break;
-            }
-            if ((mServerFetchState == kHistDecryptingNew) &&
-                (mDecryptNewHaltedAt == CHATD_IDX_INVALID)) //all messages decrypted
-            {
-                mServerFetchState = kHistNotFetching;
-            }
+            resumeDecryption(isNew, first);
         }
         else
         {
-            // Old history
-            // Decrypt the rest synchronously, bail out on first that can't
-            // decrypt synchonously.
-            // Local messages are always decrypted, this is handled
-            // at the start of this func
-
             assert(!isLocal);
             auto first = mDecryptOldHaltedAt - 1;
             mDecryptOldHaltedAt = CHATD_IDX_INVALID;
-            auto last = lownum();
-            for (Idx i = first; i >= last; i--)
-            {
-                if (!msgIncomingAfterAdd(isNew, false, at(i), i))
-                    break;
-            }
-            if ((mServerFetchState == kHistDecryptingOld) &&
-                (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
-            {
-                mServerFetchState = kHistNotFetching;
-                if (mServerOldHistCbEnabled)
-                {
-                    CALL_LISTENER(onHistoryDone, kHistSourceServer);
-                }
-            }
+            resumeDecryption(isNew, first);
         }
     })
     .fail([this, message](const ::promise::Error& err)
@@ -4030,6 +4284,113 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
 }
 
 // Save to history db, handle received and seen pointers, call new/old message user callbacks
+/** Continues the processing of the received messages queued while decryption was
+ * halted, starting at \c first. Messages are decrypted immediately (synchronously),
+ * so that order is guaranteed. Bails out at the first message that can't be decrypted
+ * immediately (msgIncomingAfterAdd() returns false), and will continue when the delayed
+ * decrypt finishes.
+ * Local messages are always decrypted, this is handled at the start of msgIncomingAfterAdd() */
+void Chat::resumeDecryption(bool isNew, Idx first)
+{
+    if (isNew)
+    {
+        auto last = highnum();
+        for (Idx i = first; i <= last; i++)
+        {
+            if (!msgIncomingAfterAdd(isNew, false, at(i), i))
+                break;
+        }
+        if ((mServerFetchState == kHistDecryptingNew) &&
+            (mDecryptNewHaltedAt == CHATD_IDX_INVALID)) //all messages decrypted
+        {
+            mServerFetchState = kHistNotFetching;
+        }
+    }
+    else
+    {
+        auto last = lownum();
+        for (Idx i = first; i >= last; i--)
+        {
+            if (!msgIncomingAfterAdd(isNew, false, at(i), i))
+                break;
+        }
+        if ((mServerFetchState == kHistDecryptingOld) &&
+            (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
+        {
+            mServerFetchState = kHistNotFetching;
+            if (mServerOldHistCbEnabled)
+            {
+                CALL_LISTENER(onHistoryDone, kHistSourceServer);
+            }
+        }
+    }
+}
+
+void Chat::decryptBatches()
+{
+    if (mDecryptBatchNew)
+    {
+        mDecryptBatchNew = false;
+        decryptBatch(true);
+    }
+    if (mDecryptBatchOld)
+    {
+        mDecryptBatchOld = false;
+        decryptBatch(false);
+    }
+}
+
+/** Decrypts the messages queued while the frame that brought them was processed. The
+ * ones whose keys are already known are decrypted in parallel by ICrypto::msgDecryptBatch(),
+ * and then processed in order, as if they had been decrypted one by one. The rest go
+ * through the usual path, which may halt the decryption again */
+void Chat::decryptBatch(bool isNew)
+{
+    Idx& haltedAt = isNew ? mDecryptNewHaltedAt : mDecryptOldHaltedAt;
+    if (haltedAt == CHATD_IDX_INVALID)
+        return; // history was reset in the meantime
+
+    Idx first = haltedAt;
+    Idx step = isNew ? 1 : -1;
+    std::vector<Message*> msgs;
+    for (Idx i = first; isNew ? (i <= highnum()) : (i >= lownum()); i += step)
+    {
+        Message& msg = at(i);
+        if (!msg.isPendingToDecrypt())
+            break;
+        msgs.push_back(&msg);
+    }
+
+    size_t count = 0;
+    try
+    {
+        CHATD_LOG_CRYPTO_CALL("Calling ICrypto::msgDecryptBatch()");
+        count = mCrypto->msgDecryptBatch(msgs);
+    }
+    catch(std::exception& e)
+    {
+        CHATID_LOG_WARNING("msgDecryptBatch threw error: %s. Decrypting messages one by one", e.what());
+    }
+    CHATID_LOG_DEBUG("Decrypted %zu of %zu received messages in a batch", count, msgs.size());
+
+    haltedAt = CHATD_IDX_INVALID;
+    Idx idx = first;
+    for (size_t i = 0; i < count; i++, idx += step)
+    {
+        Message& msg = *msgs[i];
+        if (msg.isEncrypted() == Message::kEncryptedSignature)
+        {
+            CHATID_LOG_ERROR("Signature verification failure for message: %s", ID_CSTR(msg.id()));
+        }
+        else if (msg.isEncrypted() == Message::kEncryptedMalformed)
+        {
+            CHATID_LOG_ERROR("Malformed message: %s", ID_CSTR(msg.id()));
+        }
+        msgIncomingAfterDecrypt(isNew, false, msg, idx);
+    }
+    resumeDecryption(isNew, idx);
+}
+
 void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx)
 {
     assert(idx != CHATD_IDX_INVALID);
@@ -4041,6 +4402,7 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
     if (!isLocal)
     {
         assert(!msg.isPendingToDecrypt()); //either decrypted or error
+        msg.compact();  // the cleartext may fit inline, where the ciphertext didn't
         if (!msg.empty() && msg.type == Message::kMsgNormal && (*msg.buf() == 0)) //'special' message - attachment etc
         {
             if (msg.dataSize() < 2)
@@ -4231,7 +4593,7 @@ void Chat::handleLastReceivedSeen(Id msgid)
     if (msgid == mLastSeenId) //we didn't have the message when we received the last seen id
     {
         CHATID_LOG_DEBUG("Received the message with the last-seen msgid '%s', "
-            "setting the index pointer to it", ID_CSTR(msgid));
+            "setting the index pointer to it", ID_LOGARG(msgid));
         onLastSeen(msgid);
     }
     if (mLastReceivedId == msgid)
@@ -4239,7 +4601,7 @@ void Chat::handleLastReceivedSeen(Id msgid)
         //we didn't have the message when we received the last received msgid pointer,
         //and now we just received the message - set the index pointer
         CHATID_LOG_DEBUG("Received the message with the last-received msgid '%s', "
-            "setting the index pointer to it", ID_CSTR(msgid));
+            "setting the index pointer to it", ID_LOGARG(msgid));
         onLastReceived(msgid);
     }
 }
@@ -4437,7 +4799,7 @@ bool Chat::findLastTextMsg()
             }
         }
     }
-    if (!empty())
+    if (!empty() || mHasMoreHistoryInDb)
     {
         //check in ram
         auto low = lownum();
@@ -4451,7 +4813,7 @@ bool Chat::findLastTextMsg()
                 return true;
             }
         }
-        //check in db
+        //check in db (the RAM buffer may be empty, since history is loaded on demand)
         CALL_DB(getLastTextMessage, lownum()-1, mLastTextMsg);
         if (mLastTextMsg.isValid())
         {
@@ -4604,100 +4966,114 @@ const char* Command::opcodeToStr(uint8_t code)
     };
 }
 
-const char* Message::statusNames[] =
+struct MessagePool::Slab
 {
-  "Sending", "SendingManual", "ServerReceived", "ServerRejected", "Delivered", "NotSeen", "Seen"
+    char* mem;              // kBlocksPerSlab blocks of mBlockSize bytes
+    size_t used = 0;
+    size_t nextUnused = 0;  // blocks from this one on have never been used
+    void* freeList = nullptr;
+    bool avail = true;      // whether it's in mAvailSlabs
 };
 
-bool Message::hasUrl(const string &text, string &url)
+MessagePool& MessagePool::instance()
 {
-    std::string::size_type position = 0;
-    std::string partialString;
-    while (position < text.size())
-    {
-        char character = text[position];
-        if ((character >= 33 && character <= 126)
-                && character != '"'
-                && character != '\''
-                && character != '\\'
-                && character != '<'
-                && character != '>'
-                && character != '{'
-                && character != '}'
-                && character != '|')
-        {
-            partialString.push_back(character);
-        }
-        else
-        {
-            if (!partialString.empty())
-            {
-                removeUnnecessaryFirstCharacters(partialString);
-                removeUnnecessaryLastCharacters(partialString);
-                if (parseUrl(partialString))
-                {
-                    url = partialString;
-                    return true;
-                }
-            }
+    // never destroyed, messages may outlive static objects
+    static MessagePool* pool = new MessagePool(sizeof(Message));
+    return *pool;
+}
 
-            partialString.clear();
-        }
+MessagePool::MessagePool(size_t blockSize)
+    // round up, so the blocks keep the alignment of malloc()
+    : mBlockSize(sizeof(BlockHeader) + ((blockSize + 15) & ~(size_t)15))
+{}
 
-        position ++;
+void* MessagePool::alloc(size_t size)
+{
+    if (sizeof(BlockHeader) + size > mBlockSize)
+    {
+        BlockHeader* hdr = (BlockHeader*)::operator new(sizeof(BlockHeader) + size);
+        hdr->slab = nullptr;
+        return hdr + 1;
     }
 
-    if (!partialString.empty())
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mAvailSlabs.empty())
     {
-        removeUnnecessaryFirstCharacters(partialString);
-        removeUnnecessaryLastCharacters(partialString);
-        if (parseUrl(partialString))
-        {
-            url = partialString;
-            return true;
-        }
+        Slab* slab = new Slab;
+        slab->mem = (char*)::operator new(mBlockSize * kBlocksPerSlab);
+        mAvailSlabs.push_back(slab);
     }
-
-    return false;
+    Slab* slab = mAvailSlabs.back();
+    BlockHeader* hdr;
+    if (slab->freeList)
+    {
+        hdr = (BlockHeader*)slab->freeList;
+        slab->freeList = hdr->next;
+    }
+    else
+    {
+        hdr = (BlockHeader*)(slab->mem + mBlockSize * slab->nextUnused++);
+    }
+    hdr->slab = slab;
+    if (++slab->used == kBlocksPerSlab)
+    {
+        mAvailSlabs.pop_back();
+        slab->avail = false;
+    }
+    return hdr + 1;
 }
 
-bool Message::parseUrl(const std::string &url)
+void MessagePool::free(void* ptr)
 {
-    if (url.find('.') == std::string::npos)
+    if (!ptr)
+        return;
+
+    BlockHeader* hdr = (BlockHeader*)ptr - 1;
+    Slab* slab = hdr->slab;
+    if (!slab)
     {
-        return false;
+        ::operator delete(hdr);
+        return;
     }
 
-    if (isValidEmail(url))
+    std::lock_guard<std::mutex> lock(mMutex);
+    hdr->next = slab->freeList;
+    slab->freeList = hdr;
+    if (!slab->avail)
     {
-        return false;
+        slab->avail = true;
+        mAvailSlabs.push_back(slab);
     }
-
-    std::string urlToParse = url;
-    std::string::size_type position = urlToParse.find("://");
-    if (position != std::string::npos)
+    // release empty slabs, but keep one to avoid allocating a new one for the next message
+    if (--slab->used == 0 && mAvailSlabs.size() > 1)
     {
-        std::regex expresion("^(http://|https://)(.+)");
-        if (regex_match(urlToParse, expresion))
-        {
-            urlToParse = urlToParse.substr(position + 3);
-        }
-        else
-        {
-            return false;
-        }
+        mAvailSlabs.erase(std::find(mAvailSlabs.begin(), mAvailSlabs.end(), slab));
+        ::operator delete(slab->mem);
+        delete slab;
     }
+}
+
+const char* Message::statusNames[] =
+{
+  "Sending", "SendingManual", "ServerReceived", "ServerRejected", "Delivered", "NotSeen", "Seen"
+};
 
-    if (urlToParse.find("mega.co.nz/#!") != std::string::npos || urlToParse.find("mega.co.nz/#F!") != std::string::npos ||
-            urlToParse.find("mega.nz/#!") != std::string::npos || urlToParse.find("mega.nz/#F!") != std::string::npos)
+bool Message::hasUrl(const string &text, string &url)
+{
+    const char* urlStart;
+    size_t urlLen;
+    if (!UrlScanner::findUrl(text.data(), text.size(), urlStart, urlLen))
     {
         return false;
     }
 
-    std::regex regularExpresion("^(WWW.|www.)?[a-z0-9A-Z-._~:/?#@!$&'()*+,;=]+[.][a-zA-Z]{2,5}(:[0-9]{1,5})?([a-z0-9A-Z-._~:/?#@!$&'()*+,;=]*)?$");
-
+    url.assign(urlStart, urlLen);
+    return true;
+}
 
-    return regex_match(urlToParse, regularExpresion);
+bool Message::parseUrl(const std::string &url)
+{
+    return UrlScanner::isUrl(url.data(), url.size());
 }
 
 Chat::SendingItem::SendingItem(uint8_t aOpcode, Message *aMsg, const SetOfIds &aRcpts, uint64_t aRowid)
@@ -4763,8 +5139,7 @@ void Message::removeUnnecessaryFirstCharacters(string &buf)
 
 bool Message::isValidEmail(const string &buf)
 {
-    std::regex regularExpresion("^[a-z0-9A-Z._%+-]+@[a-z0-9A-Z.-]+[.][a-zA-Z]{2,6}");
-    return regex_match(buf, regularExpresion);
+    return UrlScanner::isEmailAddress(buf.data(), buf.size());
 }
 
 FilteredHistory::FilteredHistory(DbInterface &db, Chat &chat)
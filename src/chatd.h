@@ -11,6 +11,7 @@
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
+#include <base/hashIndex.h>
 #include <chatdMsg.h>
 #include <url.h>
 #include <net/websocketsIO.h>
@@ -394,7 +395,8 @@ public:
     {
         kIdleTimeout = 64,      // (in seconds) chatd closes connection after 48-64s of not receiving a response
         kEchoTimeout = 1,       // (in seconds) echo to check connection is alive when back to foreground
-        kConnectTimeout = 30    // (in seconds) timeout reconnection to succeeed
+        kConnectTimeout = 30,   // (in seconds) timeout reconnection to succeeed
+        kMaxCoalescedSize = 65536   // (in bytes) commands are flushed as soon as the pending frame reaches this size
     };
 
 protected:
@@ -445,6 +447,29 @@ protected:
 
     /** Handler of the timeout for the connection establishment */
     megaHandle mConnectTimer = 0;
+
+    /** Chats that received history messages in the frame being processed. Those messages
+     * are written to db in a batch once the whole frame has been processed */
+    std::set<karere::Id> mHistBatchChats;
+
+    /** Chats whose received messages are queued for decryption until the frame
+     * being processed ends, so they are decrypted together. @see decryptBatches() */
+    std::set<karere::Id> mDecryptBatchChats;
+
+    /** True while the commands of a received frame are executed */
+    bool mProcessingFrame = false;
+
+    /** Commands waiting to be sent to chatd, packed together in a single frame. They are
+     * flushed when the send window of the client expires, or earlier if an urgent command
+     * is sent. See \c sendBuf() */
+    CommandCoalescer mOutput{kMaxCoalescedSize};
+
+    /** Set when a frame could not be sent, until the connection is restarted. Meanwhile,
+     * sending fails as if the connection was down. See \c onSendFailed() */
+    bool mSendFailed = false;
+
+    /** Handler of the timer that flushes \c mOutput */
+    megaHandle mFlushTimer = 0;
     
     // ---- callbacks called from libwebsocketsIO ----
     virtual void wsConnectCb();
@@ -456,14 +481,26 @@ protected:
     void abortRetryController();
     void disconnect();
     void doConnect();
-// Destroys the buffer content
+    /** Queues \c buf in \c mOutput, destroying its content. Urgent commands (see
+     * \c CommandCoalescer::isUrgentOpcode()) flush the frame right away, and the result
+     * tells if it was written to the socket. Other commands wait for the send window, and \c true only means they were queued: if the
+     * frame fails to be sent later, the connection is restarted and, upon login, the chats
+     * are joined again and the unconfirmed messages are resent. \c false means that the
+     * connection is offline, or restarting after such a failure */
     bool sendBuf(Buffer&& buf);
+    bool flushOutput();
+    void discardOutput();
+    void onSendFailed();
     bool rejoinExistingChats();
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
     bool sendCommand(Command&& cmd); // used internally only for OP_HELLO
     void execCommand(const StaticBuffer& buf);
+    void commitHistoryBatches();
+    void decryptBatches();
+    /** Decrypts and writes to db the messages batched so far in the frame being processed */
+    void flushFrameBatches();
     bool sendKeepalive(uint8_t opcode);
     void sendEcho();
     void sendCallReqDeclineNoSupport(karere::Id chatid, karere::Id callid);
@@ -557,12 +594,15 @@ struct LastTextMsgState: public LastTextMsg
     bool isValid() const { return mState == kHave; }
     bool isFetching() const { return mState == kFetching; }
     void setState(uint8_t state) { mState = state; }
+    /** Timestamp of the message, used to sort the list of chats */
+    uint32_t ts() const { return mTs; }
     void assign(const chatd::Message& from, Idx idx)
     {
-        assign(from, from.type, from.id(), idx, from.userid);
+        assign(from, from.type, from.id(), idx, from.userid, from.ts);
     }
-    void assign(const Buffer& buf, uint8_t type, karere::Id id, Idx idx, karere::Id sender)
+    void assign(const Buffer& buf, uint8_t type, karere::Id id, Idx idx, karere::Id sender, uint32_t ts = 0)
     {
+        mTs = ts;
         mType = type;
         mIdx = idx;
         mId = id;
@@ -582,6 +622,7 @@ struct LastTextMsgState: public LastTextMsg
 protected:
     friend class Chat;
     uint8_t mState = kNone;
+    uint32_t mTs = 0;
 };
 
 /**
@@ -661,6 +702,7 @@ protected:
 };
 
 struct ChatDbInfo;
+struct HistoryRetention;
 
 /** @brief Represents a single chatroom together with the message history.
  * Message sending is done by calling methods on this class.
@@ -732,7 +774,7 @@ protected:
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::HashIndex<karere::Id, Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
@@ -800,6 +842,11 @@ protected:
      * of new messages may work synchronously and not be delayed.
      */
     Idx mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+
+    /** Set when the decryption of new/old messages is halted by a frame still being
+     * processed, rather than by a delayed decrypt. @see decryptBatch() */
+    bool mDecryptBatchNew = false;
+    bool mDecryptBatchOld = false;
     uint32_t mLastMsgTs;
     bool mIsGroup;
     std::set<karere::Id> mMsgsToUpdateWithRichLink;
@@ -816,7 +863,7 @@ protected:
     bool mTruncateAttachment = false;
     // ====
     std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::HashIndex<BackRefId, Idx> mRefidToIdxMap;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
     void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
@@ -833,6 +880,9 @@ protected:
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
+    void resumeDecryption(bool isNew, Idx first);
+    void decryptBatches();
+    void decryptBatch(bool isNew);
     bool msgNodeHistIncoming(Message* msg);
     void onUserJoin(karere::Id userid, Priv priv);
     void onUserLeave(karere::Id userid);
@@ -872,6 +922,8 @@ protected:
     void removePendingRichLinks(Idx idx);
     void manageRichLinkMessage(Message &message);
     void attachmentHistDone();
+    void beginHistoryBatch();
+    void commitHistoryBatch();
     friend class Connection;
     friend class Client;
 /// @endcond PRIVATE
@@ -1053,6 +1105,20 @@ public:
         return (it == mIdToIndexMap.end()) ? CHATD_IDX_INVALID : it->second;
     }
 
+    /**
+     * @brief Same as \c msgIndexFromId(), but if the message is not loaded in RAM,
+     * its index is looked up in the local db history.
+     */
+    Idx msgIndexFromIdOrDb(karere::Id msgid);
+
+    /**
+     * @brief Same as \c findOrNull(), but if the message is older than the ones
+     * in RAM and it's in the local db history, it's loaded from db. The messages
+     * in RAM don't change, so a copy of the message is returned in both cases,
+     * which stays valid regardless of later trims and loads.
+     */
+    std::unique_ptr<Message> findOrLoad(Idx num);
+
     /**
      * @brief Returns the message with specific msgid that it's stored at node history
      * @param msgid The message id
@@ -1175,6 +1241,23 @@ public:
       */
     int unreadMsgCount() const;
 
+    /** @brief Removes from the local cache up to \c maxRows of the oldest messages that
+     * exceed the limits of \c retention. Only messages not loaded in RAM are removed, and
+     * never the last seen/received ones, nor the newest one. They can still be fetched
+     * again from server.
+     * @return The number of messages removed
+     */
+    unsigned pruneHistory(const HistoryRetention& retention, unsigned maxRows);
+
+    /** @brief Releases from RAM the oldest messages, so no more than \c maxMsgs are
+     * kept. They are loaded again from the local db when needed. Indexes don't change.
+     * While the app fetches history, a window of \c maxMsgs/2 messages older than the
+     * fetch position is kept as well, so the messages it was notified of and the next
+     * ones it will fetch stay in RAM.
+     * @return The number of messages released
+     */
+    unsigned trimHistory(unsigned maxMsgs);
+
     /** @brief Returns the text of the most-recent message in the chat that can
      * be displayed as text in the chat list. If it is not found in RAM,
      * the database will be queried. If not found there as well, server is queried,
@@ -1252,6 +1335,9 @@ public:
      * picked by the compiler whenever the command object is a temporary, avoiding
      * copying the buffer, and the const reference one is picked when the Command
      * object is read-only and has to be preserved
+     * @note The call signalling commands are urgent, so they are sent before this
+     * returns and the result tells if they were written. Other commands may only be
+     * queued for the next frame, see \c Connection::sendBuf()
      */
     bool sendCommand(Command&& cmd);
     bool sendCommand(const Command& cmd);
@@ -1368,6 +1454,11 @@ public:
     IRtcHandler* mRtcHandler = nullptr;
     uint8_t mKeepaliveType = OP_KEEPALIVE;
 
+    /** Time (in ms) that commands to be sent are retained, so the ones sent in the meantime
+     * are packed in the same frame. With 0, the commands sent in the same iteration of the
+     * event loop are packed together */
+    unsigned mSendCoalesceWindow = 0;
+
     /* --- getters --- */
     const karere::Id myHandle() const;
     std::shared_ptr<Chat> chatFromId(karere::Id chatid) const;
@@ -1378,6 +1469,9 @@ public:
     uint8_t keepaliveType();
     void setKeepaliveType(bool isInBackground);
 
+    unsigned sendCoalesceWindow() const;
+    void setSendCoalesceWindow(unsigned ms);
+
     /** @brief Joins the specifed chatroom on the specified shard, using the specified url, and
      * associates the specified Listener and ICrypto instances with the newly created Chat object.
      */
@@ -1434,6 +1528,15 @@ struct ChatDbInfo
     karere::Id lastRecvId;
 };
 
+/** Limits of the history kept in the local cache. Zero means no limit */
+struct HistoryRetention
+{
+    uint32_t maxMessages = 0;   /// Max number of messages kept per chat
+    uint32_t maxAge = 0;        /// Max age of the messages kept, in seconds
+    uint64_t maxBytes = 0;      /// Max size of the content of the messages kept per chat
+    bool isEnabled() const { return maxMessages || maxAge || maxBytes; }
+};
+
 class DbInterface
 {
 public:
@@ -1459,6 +1562,17 @@ public:
     /// update a message in the history buffer with the specified \c msgid
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
 
+    /// starts collecting the messages passed to \c addMsgToHistory, in order to write them in a single
+    /// batch. Any other access to the history must behave as if they were already written
+    virtual void beginHistoryBatch() {}
+
+    /// writes the messages collected since \c beginHistoryBatch
+    virtual void commitHistoryBatch() {}
+
+    /// removes up to \c maxRows of the oldest messages that exceed the limits of \c retention,
+    /// and none with index above \c maxIdx. Returns the number of messages removed
+    virtual unsigned pruneHistory(const HistoryRetention& /*retention*/, Idx /*maxIdx*/, unsigned /*maxRows*/) { return 0; }
+
 
 //  <<<--- Management of the SENDING QUEUE --->>>
 
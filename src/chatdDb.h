@@ -12,12 +12,389 @@ protected:
     chatd::Chat& mChat;
     std::string mSendingTblName;
     std::string mHistTblName;
+    /** Whether the db has the full-text index of the history. @see karere::Client::hasSearchIndex() */
+    bool mHasSearchIndex;
+
+    /** Max number of rows per multi-row insert. Each row binds 11 values, and
+     * sqlite limits the number of variables per statement to 999 by default */
+    enum { kHistBatchRowsPerStmt = 64 };
+
+    /** True while history messages are collected in \c mHistBatch instead of being
+     * written to db. @see beginHistoryBatch() */
+    bool mHistBatchOpen = false;
+    /** The messages are the ones held in RAM by the chat. Any change to them, or their
+     * removal, goes through a method of this class that flushes the batch first */
+    typedef std::vector<std::pair<chatd::Idx, const chatd::Message*>> HistBatch;
+    HistBatch mHistBatch;
+    /** Only accessed by \c writeHistoryBatch(), which may run in the db writer thread */
+    std::string mHistBatchSql;
+
+    /** Number of unread messages after \c mUnreadBaseIdx, maintained incrementally as
+     * messages are added, updated or seen, so unread queries don't need to scan the
+     * history. It's persisted in \c chat_vars. A negative value means it's unknown and
+     * has to be recounted from the history table. @see getUnreadMsgCountAfterIdx() */
+    int mUnreadCount = -1;
+    chatd::Idx mUnreadBaseIdx = CHATD_IDX_INVALID;
+    bool mUnreadLoaded = false;
+    bool mUnreadDirty = false;
+
+    /** Queues a write whose result is not needed by the caller. With async writes, it's done later,
+     * after the writes queued before it. Errors can't reach the caller then, so they are logged, as
+     * the callers in chatd do. Otherwise, it's done now and errors are thrown to the caller.
+     * It must capture copies of the data it writes */
+    void postWrite(const char* opname, std::function<void()>&& write)
+    {
+        if (!mDb.isAsyncWrites() || mDb.isInPostedWrite())
+        {
+            write();
+            return;
+        }
+
+        karere::Id chatid = mChat.chatId();
+        mDb.post([opname, chatid, write]()
+        {
+            try
+            {
+                write();
+            }
+            catch (std::exception& e)
+            {
+                CHATD_LOG_ERROR("chatid %s: error in %s: %s", chatid.toString().c_str(), opname, e.what());
+            }
+        });
+    }
+
+    SqliteStmt& bindHistoryRow(SqliteStmt& stmt, const chatd::Message& msg, chatd::Idx idx)
+    {
+        return stmt << idx << mChat.chatId() << msg.id() << msg.keyid << msg.type
+                    << msg.userid << msg.ts << msg.updated << msg << msg.backRefId
+                    << msg.isEncrypted();
+    }
+
+#ifndef NDEBUG
+    void checkHistoryBatchContinuity(const HistBatch& batch)
+    {
+        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?", true);
+        stmt << mChat.chatId();
+        stmt.step();
+        int low = stmt.intCol(0);
+        int high = stmt.intCol(1);
+        bool empty = (stmt.intCol(2) == 0);
+        for (auto& item: batch)
+        {
+            chatd::Idx idx = item.first;
+            if (empty)
+            {
+                low = high = idx;
+                empty = false;
+            }
+            else if (idx == low - 1)
+            {
+                low = idx;
+            }
+            else if (idx == high + 1)
+            {
+                high = idx;
+            }
+            else
+            {
+                CHATD_LOG_ERROR("chatid %s: history batch: discontinuity detected: "
+                    "index of added msg %s is not adjacent to neither end of db history: "
+                    "add idx=%d, histlow=%d, histhigh=%d", mChat.chatId().toString().c_str(),
+                    item.second->id().toString().c_str(), idx, low, high);
+                assert(false);
+            }
+        }
+    }
+#endif
+
+    /** Writes the history messages collected so far to db. Must be called before
+     * any access to the history table, so reads always see the batched messages.
+     * With async writes, a copy of the batch is handed over to the db writer thread,
+     * since the messages may change before it's written, and the next access to the
+     * db waits for it to be written */
+    void flushHistoryBatch()
+    {
+        if (mHistBatch.empty())
+            return;
+
+        HistBatch batch;
+        batch.swap(mHistBatch);
+        if (!mDb.isAsyncWrites())
+        {
+            writeHistoryBatch(batch);
+            return;
+        }
+
+        std::shared_ptr<std::vector<chatd::Message>> msgs = std::make_shared<std::vector<chatd::Message>>();
+        msgs->reserve(batch.size());
+        for (auto& item: batch)
+        {
+            msgs->emplace_back(*item.second);
+            item.second = &msgs->back();
+        }
+        // std::function must be copyable, so the batch can't be moved into the lambda
+        std::shared_ptr<HistBatch> snapshot = std::make_shared<HistBatch>(std::move(batch));
+        postWrite("writeHistoryBatch", [this, msgs, snapshot]()
+        {
+            writeHistoryBatch(*snapshot);
+        });
+    }
+
+    /** Writes \c batch in a savepoint. If any row fails, the whole batch is rolled back
+     * and the error is thrown, as it was when the rows were written one by one */
+    void writeHistoryBatch(const HistBatch& batch)
+    {
+#ifndef NDEBUG
+        checkHistoryBatchContinuity(batch);
+#endif
+        SqliteSavepoint savepoint(mDb);
+        size_t i = 0;
+        if (batch.size() >= kHistBatchRowsPerStmt)
+        {
+            if (mHistBatchSql.empty())
+            {
+                mHistBatchSql = "insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) values";
+                for (int row = 0; row < kHistBatchRowsPerStmt; row++)
+                {
+                    mHistBatchSql.append(row ? ",(?,?,?,?,?,?,?,?,?,?,?)" : "(?,?,?,?,?,?,?,?,?,?,?)");
+                }
+            }
+            SqliteStmt stmt(mDb, mHistBatchSql, true);
+            for (; i + kHistBatchRowsPerStmt <= batch.size(); i += kHistBatchRowsPerStmt)
+            {
+                for (size_t j = i; j < i + kHistBatchRowsPerStmt; j++)
+                {
+                    bindHistoryRow(stmt, *batch[j].second, batch[j].first);
+                }
+                stmt.step();
+                stmt.reset().clearBind();
+            }
+        }
+        for (; i < batch.size(); i++)
+        {
+            insertHistoryRow(*batch[i].second, batch[i].first);
+        }
+        for (auto& item: batch)
+        {
+            addMsgToSearchIndex(*item.second, item.first);
+        }
+        savepoint.release();
+    }
+
+    void insertHistoryRow(const chatd::Message& msg, chatd::Idx idx)
+    {
+        SqliteStmt stmt(mDb, "insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+                             "values(?,?,?,?,?,?,?,?,?,?,?)", true);
+        bindHistoryRow(stmt, msg, idx).step();
+    }
+
+    /** Adds the message at \c idx, already in the history table, to the full-text index of the
+     * history if it's a decrypted text message. The docid of the entry is stored in the history
+     * row, so it can be removed along with the message without scanning the index */
+    void addMsgToSearchIndex(const chatd::Message& msg, chatd::Idx idx)
+    {
+        if (!mHasSearchIndex
+                || msg.type != chatd::Message::kMsgNormal
+                || msg.isEncrypted() != chatd::Message::kNotEncrypted
+                || msg.empty())
+        {
+            return;
+        }
+
+        auto lock = mDb.lock();   // nothing else may run on the connection before reading the docid
+        SqliteStmt stmt(mDb, "insert into history_fts(content, chatid, idx) values(?,?,?)", true);
+        stmt.bind(1, msg.buf(), msg.dataSize())     // bound as text, to be tokenized
+            .bind(2, mChat.chatId())
+            .bind(3, idx)
+            .step();
+        mDb.cachedQuery("update history set fts_docid = ? where chatid = ? and idx = ?",
+                  (int64_t)sqlite3_last_insert_rowid(mDb), mChat.chatId(), idx);
+    }
+
+    /** Removes from the full-text index the messages of the history up to \c upTo, included,
+     * or all of them if it's CHATD_IDX_INVALID. Must be called before removing them from the
+     * history table, as the docids are looked up there */
+    void removeMsgsFromSearchIndex(chatd::Idx upTo)
+    {
+        if (!mHasSearchIndex)
+            return;
+
+        if (upTo == CHATD_IDX_INVALID)
+        {
+            mDb.query("delete from history_fts where docid in (select fts_docid from history "
+                      "where chatid = ? and fts_docid is not null)", mChat.chatId());
+        }
+        else
+        {
+            mDb.query("delete from history_fts where docid in (select fts_docid from history "
+                      "where chatid = ? and idx <= ? and fts_docid is not null)", mChat.chatId(), upTo);
+        }
+    }
+
+    /** Counts the unread messages in the range (after, upTo]. Any of the limits can be
+     * CHATD_IDX_INVALID, meaning the range is not bound at that end */
+    int countUnreadMsgs(chatd::Idx after, chatd::Idx upTo = CHATD_IDX_INVALID)
+    {
+        // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
+        std::string sql = "select count(*) from history where (chatid = ?1)"
+                "and (userid != ?2)"
+                "and not (updated != 0 and length(data) = 0)"
+                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
+                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
+        if (after != CHATD_IDX_INVALID)
+            sql+=" and (idx > ?11)";
+        if (upTo != CHATD_IDX_INVALID)
+            sql+=" and (idx <= ?12)";
+
+        SqliteStmt stmt(mDb, sql, true);
+        stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
+             << chatd::Message::kNotEncrypted               // include decrypted messages
+             << chatd::Message::kEncryptedMalformed         // include encrypted messages due to malformed payload
+             << chatd::Message::kEncryptedSignature         // include encrypted messages due to invalid signature
+             << chatd::Message::kMsgNormal                  // include only known type of messages
+             << chatd::Message::kMsgAttachment
+             << chatd::Message::kMsgContact
+             << chatd::Message::kMsgContainsMeta
+             << chatd::Message::kMsgVoiceClip;
+        if (after != CHATD_IDX_INVALID)
+            stmt.bind(11, after);
+        if (upTo != CHATD_IDX_INVALID)
+            stmt.bind(12, upTo);
+        stmt.stepMustHaveData("get peer msg count");
+        return stmt.intCol(0);
+    }
+
+    void loadUnreadCounter()
+    {
+        if (mUnreadLoaded)
+            return;
+
+        mUnreadLoaded = true;
+        SqliteStmt stmt(mDb, "select name, value from chat_vars where chatid=? and "
+                             "(name='unread_count' or name='unread_base_idx')", true);
+        stmt << mChat.chatId();
+        int count = -1;
+        chatd::Idx baseIdx = CHATD_IDX_INVALID;
+        bool hasBase = false;
+        while (stmt.step())
+        {
+            if (stmt.stringCol(0) == "unread_count")
+            {
+                count = stmt.intCol(1);
+            }
+            else
+            {
+                baseIdx = stmt.intCol(1);
+                hasBase = true;
+            }
+        }
+        if (hasBase)
+        {
+            mUnreadCount = count;
+            mUnreadBaseIdx = baseIdx;
+        }
+    }
+
+    void saveUnreadCounter()
+    {
+        if (mHistBatchOpen)
+        {
+            mUnreadDirty = true;    // will be saved by commitHistoryBatch()
+            return;
+        }
+
+        mUnreadDirty = false;
+        SqliteDb& db = mDb;
+        karere::Id chatid = mChat.chatId();
+        int count = mUnreadCount;
+        chatd::Idx baseIdx = mUnreadBaseIdx;
+        mDb.post([&db, chatid, count, baseIdx]()
+        {
+            try
+            {
+                db.cachedQuery("insert or replace into chat_vars(chatid, name, value) values(?, 'unread_count', ?)",
+                         chatid, count);
+                db.cachedQuery("insert or replace into chat_vars(chatid, name, value) values(?, 'unread_base_idx', ?)",
+                         chatid, baseIdx);
+            }
+            catch (std::exception& e)
+            {
+                // the counter is recalculated if it doesn't match the history
+                CHATD_LOG_ERROR("chatid %s: error saving unread counter: %s", chatid.toString().c_str(), e.what());
+            }
+        });
+    }
+
+    void invalidateUnreadCounter()
+    {
+        loadUnreadCounter();
+        if (mUnreadCount < 0)
+            return;
+
+        mUnreadCount = -1;
+        saveUnreadCounter();
+    }
+
+    /** Applies to the unread counter the change of a message at \c idx from \c wasUnread to \c isUnread */
+    void updateUnreadCounter(chatd::Idx idx, bool wasUnread, bool isUnread)
+    {
+        if (wasUnread == isUnread)
+            return;
+
+        loadUnreadCounter();
+        if (mUnreadCount < 0)
+            return;
+
+        if (mUnreadBaseIdx != CHATD_IDX_INVALID && idx <= mUnreadBaseIdx)
+            return; // already seen, not accounted
+
+        mUnreadCount += isUnread ? 1 : -1;
+        assert(mUnreadCount >= 0);
+        saveUnreadCounter();
+    }
+
 public:
-    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
-        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, bool hasSearchIndex, const std::string& sendingTblName="sending", const std::string& histTblName="history")
+        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName), mHasSearchIndex(hasSearchIndex){}
+    virtual ~ChatdSqliteDb()
+    {
+        try
+        {
+            commitHistoryBatch();
+            mDb.sync(); // pending writes reference this object
+        }
+        catch (std::exception& e)
+        {
+            CHATD_LOG_ERROR("Error writing pending history batch to db: %s", e.what());
+        }
+    }
+    virtual void beginHistoryBatch()
+    {
+        mHistBatchOpen = true;
+    }
+    virtual void commitHistoryBatch()
+    {
+        mHistBatchOpen = false;
+        try
+        {
+            flushHistoryBatch();
+        }
+        catch (std::exception&)
+        {
+            // the unread counter includes the messages that couldn't be written
+            invalidateUnreadCounter();
+            throw;
+        }
+        if (mUnreadDirty)
+        {
+            saveUnreadCounter();
+        }
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
+        flushHistoryBatch();
+        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1", true);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
         info.newestDbIdx = stmt.intCol(1);
@@ -26,7 +403,7 @@ public:
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
             return;
         }
-        SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2");
+        SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2", true);
         stmt2 << mChat.chatId() << minIdx;
         stmt2.stepMustHaveData();
         info.oldestDbId = stmt2.uint64Col(0);
@@ -39,7 +416,7 @@ public:
             CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
             info.oldestDbId = 0;
         }
-        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?");
+        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?", true);
         stmt3 << mChat.chatId();
         stmt3.stepMustHaveData();
         info.lastSeenId = stmt3.uint64Col(0);
@@ -63,7 +440,7 @@ public:
     {
 #ifndef NDEBUG
         std::string checkQuery = "select min(idx), max(idx), count(*) from " + table + " where chatid = ?";
-        SqliteStmt stmt(mDb, checkQuery.c_str());
+        SqliteStmt stmt(mDb, checkQuery.c_str(), true);
         stmt << mChat.chatId();
         stmt.step();
         int low = stmt.intCol(0);
@@ -81,7 +458,7 @@ public:
 #endif
         std::string query = "insert into " + table + " (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) " +
                                                      "values(?,?,?,?,?,?,?,?,?,?,?)";
-        mDb.query(query.c_str(), idx, mChat.chatId(), msg.id(), msg.keyid,
+        mDb.cachedQuery(query.c_str(), idx, mChat.chatId(), msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
     }
 
@@ -98,7 +475,8 @@ public:
         Buffer rcpts;
         item.recipients.save(rcpts);
 
-        mDb.query("insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
+        auto lock = mDb.lock();   // nothing else may run on the connection before reading the rowid
+        mDb.cachedQuery("insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
                          "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
             (uint64_t)mChat.chatId(), opcode, msg->ts, msg->id(),
             *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
@@ -109,7 +487,8 @@ public:
 
     virtual int updateSendingItemsKeyid(chatd::KeyId localkeyid, chatd::KeyId keyid)
     {
-        mDb.query("update sending set keyid = ? where keyid = ? and chatid = ?", keyid, localkeyid, mChat.chatId());
+        auto lock = mDb.lock();   // nothing else may run on the connection before reading the result
+        mDb.cachedQuery("update sending set keyid = ? where keyid = ? and chatid = ?", keyid, localkeyid, mChat.chatId());
         return sqlite3_changes(mDb);
     }
 
@@ -119,16 +498,22 @@ public:
         // possible values of `keyid`:
         // - NEWMSG/MSGUPDX: local keyxid = rowid of the KeyCmd related to this MsgCmd
         // - MSGUPD: chat keyid (already confirmed)
-        mDb.query("update sending set keyid=?, msg_cmd=?, key_cmd=? where rowid=?",
-                  keyid, msgCmd->msg(),
-                  keyCmd ? keyCmd->keyblob() : StaticBuffer(nullptr, 0),
-                  rowid);
-        assertAffectedRowCount(1,"addBlobsToSendingItem");
+        std::shared_ptr<Buffer> msgBlob = std::make_shared<Buffer>(msgCmd->msg().buf(), msgCmd->msg().dataSize());
+        std::shared_ptr<Buffer> keyBlob = keyCmd
+                ? std::make_shared<Buffer>(keyCmd->keyblob().buf(), keyCmd->keyblob().dataSize())
+                : std::make_shared<Buffer>(0);
+        postWrite("addBlobsToSendingItem", [this, rowid, keyid, msgBlob, keyBlob]()
+        {
+            mDb.cachedQuery("update sending set keyid=?, msg_cmd=?, key_cmd=? where rowid=?",
+                      keyid, *msgBlob, *keyBlob, rowid);
+            assertAffectedRowCount(1, "addBlobsToSendingItem");
+        });
     }
 
     virtual int updateSendingItemsMsgidAndOpcode(karere::Id msgxid, karere::Id msgid)
     {
-        mDb.query(
+        auto lock = mDb.lock();   // nothing else may run on the connection before reading the result
+        mDb.cachedQuery(
             "update sending set opcode=?, msgid=? where chatid=? and opcode=? and msgid=?",
             chatd::OP_MSGUPD, msgid, mChat.chatId(), chatd::OP_MSGUPDX, msgxid);
         return sqlite3_changes(mDb);
@@ -136,37 +521,79 @@ public:
 
     virtual void deleteSendingItem(uint64_t rowid)
     {
-        mDb.query("delete from sending where rowid = ?1", rowid);
-        assertAffectedRowCount(1, "deleteSendingItem");
+        postWrite("deleteSendingItem", [this, rowid]()
+        {
+            mDb.cachedQuery("delete from sending where rowid = ?1", rowid);
+            assertAffectedRowCount(1, "deleteSendingItem");
+        });
     }
     virtual int updateSendingItemsContentAndDelta(const chatd::Message& msg)
     {
-        mDb.query("update sending set msg = ?, updated = ? where msgid = ? and chatid = ?",
+        auto lock = mDb.lock();   // nothing else may run on the connection before reading the result
+        mDb.cachedQuery("update sending set msg = ?, updated = ? where msgid = ? and chatid = ?",
                   msg, msg.updated, msg.id(), mChat.chatId());
         return sqlite3_changes(mDb);
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-        addMessage(msg, idx, "history");
+        if (mHistBatchOpen)
+        {
+            mHistBatch.emplace_back(idx, &msg);
+        }
+        else
+        {
+            addMessage(msg, idx, "history");
+            addMsgToSearchIndex(msg, idx);
+        }
+        updateUnreadCounter(idx, false, msg.isValidUnread(mChat.client().myHandle()));
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
-        if (msg.type == chatd::Message::kMsgTruncate)
+        flushHistoryBatch();
+        SqliteStmt stmtOld(mDb, "select idx, userid, updated, length(data), is_encrypted, type, fts_docid "
+                                "from history where chatid = ? and msgid = ?", true);
+        stmtOld << mChat.chatId() << msgid;
+        if (!stmtOld.step())
         {
-            mDb.query("update history set type = ?, data = ?, ts = ?, userid = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.ts, msg.userid, mChat.chatId(), msgid);
+            // the row is missing: fail here, as the update itself would, instead of
+            // in the writer, and before the unread counter is touched
+            throw std::runtime_error("updateMsgInHistory: message "+msgid.toString()+" not found in history");
         }
-        else    // "updated" instead of "ts"
+        chatd::Idx idx = stmtOld.intCol(0);
+        bool wasUnread = chatd::Message::isValidUnread(karere::Id(stmtOld.uint64Col(1)) == mChat.client().myHandle(),
+                                                       stmtOld.intCol(2) && !stmtOld.intCol(3),
+                                                       stmtOld.intCol(4), stmtOld.intCol(5));
+        int64_t ftsDocid = stmtOld.int64Col(6);
+        stmtOld.reset();
+
+        std::shared_ptr<chatd::Message> newMsg = std::make_shared<chatd::Message>(msg);
+        postWrite("updateMsgInHistory", [this, msgid, idx, ftsDocid, newMsg]()
         {
-            mDb.query("update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
-        }
-        assertAffectedRowCount(1, "updateMsgInHistory");
+            const chatd::Message& msg = *newMsg;
+            if (ftsDocid && mHasSearchIndex)
+            {
+                mDb.cachedQuery("delete from history_fts where docid = ?", ftsDocid);
+            }
+            if (msg.type == chatd::Message::kMsgTruncate)
+            {
+                mDb.cachedQuery("update history set type = ?, data = ?, ts = ?, userid = ?, fts_docid = NULL where chatid = ? and msgid = ?",
+                    msg.type, msg, msg.ts, msg.userid, mChat.chatId(), msgid);
+            }
+            else    // "updated" instead of "ts"
+            {
+                mDb.cachedQuery("update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ?, fts_docid = NULL where chatid = ? and msgid = ?",
+                    msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
+            }
+            assertAffectedRowCount(1, "updateMsgInHistory");
+            addMsgToSearchIndex(msg, idx);
+        });
+        updateUnreadCounter(idx, wasUnread, msg.isValidUnread(mChat.client().myHandle()));
     }
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
     {
-        SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?");
+        flushHistoryBatch();
+        SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?", true);
         stmt3 << mChat.chatId() << msgid;
         stmt3.stepMustHaveData();
         *updated = stmt3.intCol(0);
@@ -176,7 +603,7 @@ public:
     {
         SqliteStmt stmt(mDb, "select rowid, opcode, msgid, keyid, msg, type, "
             "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
-            "from sending where chatid=? order by rowid asc");
+            "from sending where chatid=? order by rowid asc", true);
         stmt << mChat.chatId();
 
         // Fill the sending queue with SendingItems from DB
@@ -244,13 +671,15 @@ public:
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
+        flushHistoryBatch();
         loadMessages(count, idx, messages, "history");
     }
 
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
     {
+        flushHistoryBatch();
         std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, query.c_str(), true);
         stmt << mChat.chatId() << msgid;
         return (stmt.step()) ? stmt.int64Col(0) : CHATD_IDX_INVALID;
     }
@@ -261,42 +690,34 @@ public:
     }
     virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
     {
-        // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
-        std::string sql = "select count(*) from history where (chatid = ?1)"
-                "and (userid != ?2)"
-                "and not (updated != 0 and length(data) = 0)"
-                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
-                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
-        if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?)";
+        loadUnreadCounter();
+        if (mUnreadCount >= 0 && mUnreadBaseIdx == idx)
+            return mUnreadCount;
 
-        SqliteStmt stmt(mDb, sql);
-        stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
-             << chatd::Message::kNotEncrypted               // include decrypted messages
-             << chatd::Message::kEncryptedMalformed         // include encrypted messages due to malformed payload
-             << chatd::Message::kEncryptedSignature         // include encrypted messages due to invalid signature
-             << chatd::Message::kMsgNormal                  // include only known type of messages
-             << chatd::Message::kMsgAttachment
-             << chatd::Message::kMsgContact
-             << chatd::Message::kMsgContainsMeta
-             << chatd::Message::kMsgVoiceClip;
-        if (idx != CHATD_IDX_INVALID)
-            stmt << idx;
-        stmt.stepMustHaveData("get peer msg count");
-        return stmt.intCol(0);
+        flushHistoryBatch();
+        mUnreadCount = countUnreadMsgs(idx);
+        mUnreadBaseIdx = idx;
+        saveUnreadCounter();
+        return mUnreadCount;
     }
     virtual void saveItemToManualSending(const chatd::Chat::SendingItem& item, int reason)
     {
-        auto& msg = *item.msg;
-        mDb.query("insert into manual_sending(chatid, rowid, msgid, type, "
-            "ts, updated, msg, opcode, reason) values(?,?,?,?,?,?,?,?,?)",
-            mChat.chatId(), item.rowid, item.msg->id(), msg.type, msg.ts,
-            msg.updated, msg, item.opcode(), reason);
+        std::shared_ptr<chatd::Message> msgCopy = std::make_shared<chatd::Message>(*item.msg);
+        uint64_t rowid = item.rowid;
+        uint8_t opcode = item.opcode();
+        postWrite("saveItemToManualSending", [this, msgCopy, rowid, opcode, reason]()
+        {
+            auto& msg = *msgCopy;
+            mDb.query("insert into manual_sending(chatid, rowid, msgid, type, "
+                "ts, updated, msg, opcode, reason) values(?,?,?,?,?,?,?,?,?)",
+                mChat.chatId(), rowid, msg.id(), msg.type, msg.ts,
+                msg.updated, msg, opcode, reason);
+        });
     }
     virtual void loadManualSendItems(std::vector<chatd::Chat::ManualSendItem>& items)
     {
         SqliteStmt stmt(mDb, "select rowid, msgid, type, ts, updated, msg, opcode, "
-            "reason from manual_sending where chatid=? order by rowid asc");
+            "reason from manual_sending where chatid=? order by rowid asc", true);
         stmt << mChat.chatId();
         while(stmt.step())
         {
@@ -310,13 +731,14 @@ public:
     }
     virtual bool deleteManualSendItem(uint64_t rowid)
     {
+        auto lock = mDb.lock();   // nothing else may run on the connection before reading the result
         mDb.query("delete from manual_sending where rowid = ?", rowid);
         return sqlite3_changes(mDb) != 0;
     }
     virtual void loadManualSendItem(uint64_t rowid, chatd::Chat::ManualSendItem& item)
     {
         SqliteStmt stmt(mDb, "select msgid, type, ts, updated, msg, opcode, "
-            "reason from manual_sending where chatid=? and rowid=?");
+            "reason from manual_sending where chatid=? and rowid=?", true);
         stmt << mChat.chatId() << rowid;
         stmt.stepMustHaveData("load manual sending item");
 
@@ -332,56 +754,163 @@ public:
     }
     virtual void truncateHistory(const chatd::Message& msg)
     {
+        flushHistoryBatch();
         auto idx = getIdxOfMsgidFromHistory(msg.id());
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
-        mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        postWrite("truncateHistory", [this, idx]()
+        {
+            removeMsgsFromSearchIndex(idx - 1);
+            mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        });
+        invalidateUnreadCounter();
 
 #ifndef NDEBUG
-        SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
+        SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?", true);
         stmt << mChat.chatId() << msg.id();
         stmt.step();
         if (stmt.intCol(0) != chatd::Message::kMsgTruncate)
             throw std::runtime_error("DbInterface::truncateHistory: Truncate message type is not 'truncate'");
 #endif
     }
+    virtual unsigned pruneHistory(const chatd::HistoryRetention& retention, chatd::Idx maxIdx, unsigned maxRows)
+    {
+        flushHistoryBatch();
+        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid = ?", true);
+        stmt << mChat.chatId();
+        stmt.stepMustHaveData("prune history");
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+            return 0;
+
+        chatd::Idx oldest = stmt.intCol(0);
+        chatd::Idx newest = stmt.intCol(1);
+        stmt.reset();
+        chatd::Idx cutoff = oldest - 1;     // messages up to this index are removed
+        if (retention.maxMessages && (newest - oldest + 1) > (int64_t)retention.maxMessages)
+        {
+            cutoff = newest - (chatd::Idx)retention.maxMessages;
+        }
+        if (retention.maxAge)
+        {
+            SqliteStmt stmtAge(mDb, "select max(idx) from history where chatid = ? and ts < ?", true);
+            stmtAge << mChat.chatId() << (int64_t)(time(NULL) - retention.maxAge);
+            stmtAge.stepMustHaveData("prune history by age");
+            if (sqlite3_column_type(stmtAge, 0) != SQLITE_NULL)
+            {
+                cutoff = std::max(cutoff, (chatd::Idx)stmtAge.intCol(0));
+            }
+        }
+        if (retention.maxBytes)
+        {
+            // walk from the newest message until the budget is exhausted
+            SqliteStmt stmtSize(mDb, "select idx, length(data) from history where chatid = ? and idx > ? "
+                                     "order by idx desc", true);
+            stmtSize << mChat.chatId() << cutoff;
+            uint64_t total = 0;
+            while (stmtSize.step())
+            {
+                total += stmtSize.uint64Col(1);
+                if (total > retention.maxBytes)
+                {
+                    cutoff = stmtSize.intCol(0);
+                    break;
+                }
+            }
+        }
+
+        // remove from the oldest end only, so the history in db remains contiguous
+        cutoff = std::min(cutoff, maxIdx);
+        if (maxRows && cutoff >= oldest + (chatd::Idx)maxRows)
+        {
+            cutoff = oldest + (chatd::Idx)maxRows - 1;
+        }
+        if (cutoff < oldest)
+            return 0;
+
+        removeMsgsFromSearchIndex(cutoff);
+        unsigned count;
+        {
+            auto lock = mDb.lock();
+            mDb.query("delete from history where chatid = ? and idx <= ?", mChat.chatId(), cutoff);
+            count = sqlite3_changes(mDb);
+        }
+
+        loadUnreadCounter();
+        if (mUnreadBaseIdx == CHATD_IDX_INVALID || cutoff > mUnreadBaseIdx)
+        {
+            invalidateUnreadCounter();
+        }
+        setHaveAllHistory(false);
+        return count;
+    }
     virtual chatd::Idx getOldestIdx()
     {
-        SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
+        flushHistoryBatch();
+        SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?", true);
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
         return stmt.uint64Col(0);
     }
     virtual void setLastSeen(karere::Id msgid)
     {
-        mDb.query("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
-        assertAffectedRowCount(1, "setLastSeen");
+        postWrite("setLastSeen", [this, msgid]()
+        {
+            mDb.cachedQuery("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
+            assertAffectedRowCount(1, "setLastSeen");
+        });
+
+        // move the base of the unread counter forward, discounting the messages now seen
+        loadUnreadCounter();
+        if (mUnreadCount < 0)
+            return;
+
+        chatd::Idx idx = msgid.isValid() ? getIdxOfMsgidFromHistory(msgid) : CHATD_IDX_INVALID;
+        if (idx == CHATD_IDX_INVALID
+                || (mUnreadBaseIdx != CHATD_IDX_INVALID && idx < mUnreadBaseIdx))
+        {
+            invalidateUnreadCounter();
+            return;
+        }
+        if (idx != mUnreadBaseIdx)
+        {
+            mUnreadCount -= countUnreadMsgs(mUnreadBaseIdx, idx);
+            mUnreadBaseIdx = idx;
+            assert(mUnreadCount >= 0);
+            saveUnreadCounter();
+        }
     }
     virtual void setLastReceived(karere::Id msgid)
     {
-        mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
-        assertAffectedRowCount(1);
+        postWrite("setLastReceived", [this, msgid]()
+        {
+            mDb.cachedQuery("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
+            assertAffectedRowCount(1, "setLastReceived");
+        });
     }
     virtual void setHaveAllHistory(bool haveAllHistory)
     {
-        mDb.query(
-            "insert or replace into chat_vars(chatid, name, value) "
-            "values(?, 'have_all_history', ?)", mChat.chatId(), haveAllHistory ? 1 : 0);
-        assertAffectedRowCount(1, "setHaveAllHistory");
+        postWrite("setHaveAllHistory", [this, haveAllHistory]()
+        {
+            mDb.query(
+                "insert or replace into chat_vars(chatid, name, value) "
+                "values(?, 'have_all_history', ?)", mChat.chatId(), haveAllHistory ? 1 : 0);
+            assertAffectedRowCount(1, "setHaveAllHistory");
+        });
     }
     virtual bool haveAllHistory()
     {
         SqliteStmt stmt(mDb,
-            "select value from chat_vars where chatid=? and name='have_all_history' and value='1'");
+            "select value from chat_vars where chatid=? and name='have_all_history' and value='1'", true);
         stmt << mChat.chatId();
         return stmt.step();
     }
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
     {
+        flushHistoryBatch();
         SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid from history where chatid=?1 and "
+            "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
             "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
-            "order by idx desc limit 1");
+            "order by idx desc limit 1", true);
         stmt << mChat.chatId()
              << chatd::Message::kMsgTruncate
              << chatd::Message::kMsgRevokeAttachment
@@ -394,12 +923,18 @@ public:
         }
         Buffer buf(128);
         stmt.blobCol(2, buf);
-        msg.assign(buf, stmt.intCol(0), stmt.uint64Col(3), stmt.intCol(1), stmt.uint64Col(4));
+        msg.assign(buf, stmt.intCol(0), stmt.uint64Col(3), stmt.intCol(1), stmt.uint64Col(4), stmt.uintCol(5));
     }
 
     virtual void clearHistory()
     {
-        mDb.query("delete from history where chatid = ?", mChat.chatId());
+        flushHistoryBatch();
+        postWrite("clearHistory", [this]()
+        {
+            removeMsgsFromSearchIndex(CHATD_IDX_INVALID);
+            mDb.query("delete from history where chatid = ?", mChat.chatId());
+        });
+        invalidateUnreadCounter();
         setHaveAllHistory(false);
     }
 
@@ -407,32 +942,47 @@ public:
     {
         if (getIdxOfMsgid(msg.id(), "node_history") == CHATD_IDX_INVALID)
         {
-            addMessage(msg, idx, "node_history");
-            assertAffectedRowCount(1, "addMsgToNodeHistory");
+            std::shared_ptr<chatd::Message> msgCopy = std::make_shared<chatd::Message>(msg);
+            postWrite("addMsgToNodeHistory", [this, msgCopy, idx]()
+            {
+                addMessage(*msgCopy, idx, "node_history");
+                assertAffectedRowCount(1, "addMsgToNodeHistory");
+            });
         }
     }
 
     virtual void deleteMsgFromNodeHistory(const chatd::Message& msg)
     {
-        mDb.query("update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?",
-                  msg, msg.updated, msg.type, mChat.chatId(), msg.id());
-        assertAffectedRowCount(1, "deleteMsgFromNodeHistory");
+        std::shared_ptr<chatd::Message> msgCopy = std::make_shared<chatd::Message>(msg);
+        postWrite("deleteMsgFromNodeHistory", [this, msgCopy]()
+        {
+            const chatd::Message& msg = *msgCopy;
+            mDb.cachedQuery("update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?",
+                      msg, msg.updated, msg.type, mChat.chatId(), msg.id());
+            assertAffectedRowCount(1, "deleteMsgFromNodeHistory");
+        });
     }
 
     virtual void truncateNodeHistory(karere::Id id)
     {
         auto idx = getIdxOfMsgid(id, "node_history");
-        mDb.query("delete from node_history where chatid = ? and idx <= ?", mChat.chatId(), idx);
+        postWrite("truncateNodeHistory", [this, idx]()
+        {
+            mDb.query("delete from node_history where chatid = ? and idx <= ?", mChat.chatId(), idx);
+        });
     }
 
     virtual void clearNodeHistory()
     {
-        mDb.query("delete from node_history where chatid = ?", mChat.chatId());
+        postWrite("clearNodeHistory", [this]()
+        {
+            mDb.query("delete from node_history where chatid = ?", mChat.chatId());
+        });
     }
 
     virtual void getNodeHistoryInfo(chatd::Idx &newest, chatd::Idx &oldest)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from node_history where chatid=?1");
+        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from node_history where chatid=?1", true);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
 
         int count = stmt.intCol(2);
@@ -456,7 +1006,7 @@ public:
         std::string query = "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
                             " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
 
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, query.c_str(), true);
         stmt << mChat.chatId() << idx << count;
         int i = 0;
         while(stmt.step())
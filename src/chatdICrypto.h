@@ -77,6 +77,14 @@ public:
      */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+    /**
+     * @brief Decrypts, in parallel, the longest prefix of \c msgs that can be decrypted
+     * immediately (all the keys it needs are available), and returns its length. Each
+     * of those messages ends up decrypted, or marked as undecryptable
+     * (see \c Message::setEncrypted()). The rest must be decrypted by \c msgDecrypt().
+     */
+    virtual size_t msgDecryptBatch(const std::vector<Message*>& /*msgs*/) { return 0; }
+
     /**
      * @brief The chatroom connection (to the chatd server shard) state state has changed.
      */
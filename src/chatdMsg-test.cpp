@@ -0,0 +1,125 @@
+// Standalone test of chatd::CommandCoalescer, which packs the outbound commands
+// of a chatd connection in frames. It checks that commands are held until the frame
+// is full or an urgent command comes, and that the order of the commands is kept:
+// g++ -std=c++11 -I. -Ibase chatdMsg-test.cpp -o chatdMsg-test
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "chatdMsg.h"
+
+using namespace chatd;
+
+static int gErrors = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); gErrors++; } } while(0)
+
+/** A command with \c opcode and \c payloadSize bytes of payload, tagged with \c tag */
+static Buffer makeCmd(uint8_t opcode, uint8_t tag, size_t payloadSize = 8)
+{
+    Buffer cmd;
+    cmd.append<uint8_t>(opcode);
+    for (size_t i = 0; i < payloadSize; i++)
+        cmd.append<uint8_t>(tag);
+    return cmd;
+}
+
+/** Splits a frame made by makeCmd() commands back into (opcode, tag) pairs */
+static std::vector<std::pair<uint8_t, uint8_t>> parseFrame(const Buffer& frame, size_t payloadSize = 8)
+{
+    std::vector<std::pair<uint8_t, uint8_t>> cmds;
+    for (size_t pos = 0; pos + 1 + payloadSize <= frame.dataSize(); pos += 1 + payloadSize)
+        cmds.emplace_back(frame.read<uint8_t>(pos), frame.read<uint8_t>(pos + 1));
+    return cmds;
+}
+
+static void testCoalescing()
+{
+    CommandCoalescer out(1024);
+    CHECK(out.empty());
+    CHECK(!out.add(makeCmd(OP_NEWMSG, 1)));
+    CHECK(!out.add(makeCmd(OP_SEEN, 2)));
+    CHECK(!out.add(makeCmd(OP_MSGUPD, 3)));
+    CHECK(!out.empty());
+
+    auto cmds = parseFrame(out.frame());
+    CHECK(cmds.size() == 3);
+    CHECK(cmds.size() == 3 && cmds[0].first == OP_NEWMSG && cmds[0].second == 1);
+    CHECK(cmds.size() == 3 && cmds[1].first == OP_SEEN && cmds[1].second == 2);
+    CHECK(cmds.size() == 3 && cmds[2].first == OP_MSGUPD && cmds[2].second == 3);
+
+    out.clear();
+    CHECK(out.empty());
+    CHECK(!out.add(makeCmd(OP_JOIN, 4)));
+    CHECK(parseFrame(out.frame()).size() == 1);
+}
+
+static void testUrgentOrdering()
+{
+    const uint8_t urgent[] = { OP_KEEPALIVE, OP_KEEPALIVEAWAY, OP_ECHO, OP_RTMSG_BROADCAST,
+        OP_RTMSG_USER, OP_RTMSG_ENDPOINT, OP_INCALL, OP_ENDCALL, OP_CALLDATA };
+    for (uint8_t opcode: urgent)
+    {
+        CHECK(CommandCoalescer::isUrgentOpcode(opcode));
+
+        // the urgent command is sent right away, after the ones queued before it
+        CommandCoalescer out(1024);
+        CHECK(!out.add(makeCmd(OP_NEWMSG, 1)));
+        CHECK(!out.add(makeCmd(OP_SEEN, 2)));
+        CHECK(out.add(makeCmd(opcode, 3)));
+
+        auto cmds = parseFrame(out.frame());
+        CHECK(cmds.size() == 3);
+        CHECK(cmds.size() == 3 && cmds[0].second == 1 && cmds[1].second == 2
+              && cmds[2].first == opcode && cmds[2].second == 3);
+    }
+
+    const uint8_t nonUrgent[] = { OP_NEWMSG, OP_MSGUPD, OP_MSGUPDX, OP_SEEN, OP_RECEIVED,
+        OP_JOIN, OP_HIST, OP_BROADCAST, OP_NEWKEY, OP_SYNC };
+    for (uint8_t opcode: nonUrgent)
+    {
+        CHECK(!CommandCoalescer::isUrgentOpcode(opcode));
+    }
+
+    // an urgent command alone is not held either
+    CommandCoalescer out(1024);
+    CHECK(out.add(makeCmd(OP_KEEPALIVE, 1, 0)));
+    CHECK(out.frame().dataSize() == 1);
+}
+
+static void testSizeLimit()
+{
+    // 9 bytes per command: the 4th one fills the 32-byte frame
+    CommandCoalescer out(32);
+    CHECK(!out.add(makeCmd(OP_NEWMSG, 1)));
+    CHECK(!out.add(makeCmd(OP_NEWMSG, 2)));
+    CHECK(!out.add(makeCmd(OP_NEWMSG, 3)));
+    CHECK(out.add(makeCmd(OP_NEWMSG, 4)));
+    auto cmds = parseFrame(out.frame());
+    CHECK(cmds.size() == 4);
+    for (size_t i = 0; i < cmds.size(); i++)
+        CHECK(cmds[i].second == i + 1);
+
+    // a command bigger than the frame is sent alone
+    out.clear();
+    CHECK(out.add(makeCmd(OP_NEWMSG, 5, 100)));
+
+    out.discard();
+    CHECK(out.empty());
+}
+
+int main()
+{
+    testCoalescing();
+    testUrgentOrdering();
+    testSizeLimit();
+
+    if (gErrors)
+    {
+        printf("FAILED: %d errors\n", gErrors);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
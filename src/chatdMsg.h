@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
+#include <mutex>
 #include <buffer.h>
 #include "karereId.h"
 
@@ -385,6 +387,34 @@ enum Priv: signed char
     PRIV_OPER = 3
 };
 
+/** @brief Allocator of fixed-size blocks, carved from slabs of \c kBlocksPerSlab blocks.
+ * Used for \c Message objects, so that the history of a chat doesn't pay the overhead
+ * of a heap allocation per message. Slabs are returned to the heap as soon as all their
+ * blocks are freed, i.e. when the history of a chat is cleared or the chat is closed.
+ * It's thread-safe, since messages are also created and destroyed by the app thread.
+ */
+class MessagePool
+{
+public:
+    enum { kBlocksPerSlab = 128 };
+    static MessagePool& instance();
+    MessagePool(size_t blockSize);
+    void* alloc(size_t size);
+    void free(void* ptr);
+protected:
+    struct Slab;
+    /** Each block is preceded by a pointer to its slab, or NULL if it's not pooled */
+    struct BlockHeader
+    {
+        Slab* slab;
+        void* next; // next free block of the slab. It also keeps the block aligned to 16 bytes
+    };
+    size_t mBlockSize;
+    std::mutex mMutex;
+    /** Slabs that have free blocks */
+    std::vector<Slab*> mAvailSlabs;
+};
+
 class Message: public Buffer
 {
 public:
@@ -429,6 +459,9 @@ public:
     };
     enum { kFlagForceNonText = 0x01 };
 
+    /** Max size of the contents stored within the object itself, without another allocation */
+    enum { kInlineDataSize = 48 };
+
     enum EncryptionStatus
     {
         kNotEncrypted        = 0,    /// Message already decrypted
@@ -530,6 +563,14 @@ private:
 
 protected:
     uint8_t mIsEncrypted = kNotEncrypted;
+    char mInlineData[kInlineDataSize];
+    void initData(const char* data, size_t len)
+    {
+        if (len <= kInlineDataSize)
+            useInlineStorage(mInlineData, kInlineDataSize);
+        if (data && len)
+            assign(data, len);
+    }
 
 public:
     karere::Id userid;
@@ -543,6 +584,18 @@ public:
     mutable uint8_t userFlags = 0;
     bool richLinkRemoved = 0;
 
+    static void* operator new(size_t size) { return MessagePool::instance().alloc(size); }
+    static void operator delete(void* ptr) { MessagePool::instance().free(ptr); }
+
+    /** Moves the contents to the inline storage, if they fit and they are in the heap */
+    void compact()
+    {
+        if (!mInline && mDataSize <= kInlineDataSize)
+            useInlineStorage(mInlineData, kInlineDataSize);
+    }
+    /** Whether the contents are stored within the object */
+    bool isInline() const { return mInline; }
+
     karere::Id id() const { return mId; }
     void setId(karere::Id aId, bool isXid) { mId = aId; mIdIsXid = isXid; }
     bool isSending() const { return mIdIsXid; }
@@ -559,19 +612,27 @@ public:
           Buffer&& buf, bool aIsSending=false, KeyId aKeyid=CHATD_KEYID_INVALID,
           unsigned char aType=kMsgNormal, void* aUserp=nullptr)
       :Buffer(std::forward<Buffer>(buf)), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid),
-          ts(aTs), updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
+          ts(aTs), updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp)
+    {
+        compact();
+    }
 
     explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
             const char* msg, size_t msglen, bool aIsSending=false,
             KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid, void* aUserp=nullptr)
-        :Buffer(msg, msglen), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
-            updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
+        :Buffer((size_t)0), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
+            updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp)
+    {
+        initData(msg, msglen);
+    }
 
     Message(const Message& msg)
-        : Buffer(msg.buf(), msg.dataSize()), mId(msg.id()), mIdIsXid(msg.mIdIsXid), mIsEncrypted(msg.mIsEncrypted),
+        : Buffer((size_t)0), mId(msg.id()), mIdIsXid(msg.mIdIsXid), mIsEncrypted(msg.mIsEncrypted),
           userid(msg.userid), ts(msg.ts), updated(msg.updated), keyid(msg.keyid), type(msg.type), backRefId(msg.backRefId),
           backRefs(msg.backRefs), userp(msg.userp), userFlags(msg.userFlags), richLinkRemoved(msg.richLinkRemoved)
-    {}
+    {
+        initData(msg.buf(), msg.dataSize());
+    }
 
     /** @brief Returns the ManagementInfo structure contained within the message
      * content. Throws if the message is not a management message, or if the
@@ -646,13 +707,18 @@ public:
                     || isUndecryptable()));         // or undecryptable messages due to permantent error
     }
     // conditions to consider unread messages should match the
-    // ones in ChatdSqliteDb::getUnreadMsgCountAfterIdx()
+    // ones in ChatdSqliteDb::countUnreadMsgs()
     bool isValidUnread(karere::Id myHandle) const
     {
-        return (!isOwnMessage(myHandle)             // exclude own messages
-                && !isDeleted()                     // exclude deleted messages
-                && (!mIsEncrypted                   // include decrypted messages
-                    || isUndecryptable())           // or undecryptable messages due to permantent error
+        return isValidUnread(userid == myHandle, isDeleted(), mIsEncrypted, type);
+    }
+    static bool isValidUnread(bool isOwn, bool isDeleted, uint8_t isEncrypted, unsigned char type)
+    {
+        return (!isOwn                              // exclude own messages
+                && !isDeleted                       // exclude deleted messages
+                && (!isEncrypted                    // include decrypted messages
+                    || isEncrypted == kEncryptedMalformed  // or undecryptable messages due to permantent error
+                    || isEncrypted == kEncryptedSignature)
                 && (type == kMsgNormal              // exclude any unknown type (not shown in the apps)
                     || type == kMsgAttachment
                     || type == kMsgContact
@@ -847,6 +913,55 @@ public:
     }
 };
 
+/** Packs outbound commands together, so several of them are sent to chatd in a single
+ * frame. Urgent commands can't wait for the frame to fill, but they are sent along with
+ * the ones added before them, so the order of the commands is kept */
+class CommandCoalescer
+{
+protected:
+    Buffer mFrame;
+    size_t mMaxSize;
+public:
+    /** @param maxSize The frame is ready to be sent when it reaches this size (in bytes) */
+    explicit CommandCoalescer(size_t maxSize): mMaxSize(maxSize) {}
+    /** Commands that must be sent right away, as they are timed by the server or
+     * by the peers (keepalives, call signalling) */
+    static bool isUrgentOpcode(uint8_t opcode)
+    {
+        switch (opcode)
+        {
+            // timed by the server or by us to detect dead connections
+            case OP_KEEPALIVE:
+            case OP_KEEPALIVEAWAY:
+            case OP_ECHO:
+            // call signalling
+            case OP_RTMSG_BROADCAST:
+            case OP_RTMSG_USER:
+            case OP_RTMSG_ENDPOINT:
+            case OP_INCALL:
+            case OP_ENDCALL:
+            case OP_CALLDATA:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+    /** Appends \c cmd to the frame. Returns true if the frame must be sent now */
+    bool add(const StaticBuffer& cmd)
+    {
+        uint8_t opcode = cmd.dataSize() ? cmd.read<uint8_t>(0) : (uint8_t)OP_INVALIDCODE;
+        mFrame.append(cmd.buf(), cmd.dataSize());
+        return isUrgentOpcode(opcode) || mFrame.dataSize() >= mMaxSize;
+    }
+    const Buffer& frame() const { return mFrame; }
+    bool empty() const { return mFrame.empty(); }
+    /** Empties the frame once sent, keeping its memory for the next one */
+    void clear() { mFrame.clear(); }
+    /** Drops the pending commands */
+    void discard() { mFrame.free(); }
+};
+
 //for exception message purposes
 static inline std::string operator+(const char* str, karere::Id id)
 {
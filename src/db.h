@@ -2,6 +2,15 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <string>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 
 struct SqliteString
 {
@@ -16,24 +25,350 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** @brief Runs the WAL checkpoints of a db in a dedicated thread, through its own
+ * connection to the db file, so the connection that does the writes never blocks
+ * on them. The thread sleeps until \c notify() is called.
+ */
+class SqliteCheckpointer
+{
+protected:
+    sqlite3* mDb = nullptr;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    bool mPending = false;
+    bool mExit = false;
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mCondVar.wait(lock, [this]() { return mPending || mExit; });
+            if (mExit)
+                return;
+
+            mPending = false;
+            lock.unlock();
+            // a passive checkpoint doesn't wait for readers nor writers, whatever can't
+            // be copied back to the db now will be on the next run
+            sqlite3_wal_checkpoint_v2(mDb, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+            lock.lock();
+        }
+    }
+public:
+    ~SqliteCheckpointer() { stop(); }
+    bool start(const char* fname)
+    {
+        assert(!mDb);
+        if (sqlite3_open_v2(fname, &mDb, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        // make the connection read the db header, otherwise it doesn't know the db is in WAL mode
+        if (sqlite3_exec(mDb, "PRAGMA journal_mode", nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        mThread = std::thread(&SqliteCheckpointer::run, this);
+        return true;
+    }
+    void stop()
+    {
+        if (mThread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mExit = true;
+            }
+            mCondVar.notify_one();
+            mThread.join();
+        }
+        sqlite3_close(mDb);
+        mDb = nullptr;
+    }
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending = true;
+        }
+        mCondVar.notify_one();
+    }
+};
+
+/** @brief Applies the writes posted to a db in a dedicated thread, in the same order
+ * they were posted. The connection is shared with the other threads that use the db,
+ * so the writes are applied with the db locked. A thread that locks the db applies the
+ * pending writes itself, with \c runPending(), before using it, so reads always see the
+ * writes posted before them.
+ */
+class SqliteWriter
+{
+protected:
+    std::recursive_mutex& mDbMutex;
+    std::function<void(const std::exception&)> mErrorHandler;
+    std::thread mThread;
+    std::mutex mMutex;  // protects the fields below
+    std::condition_variable mCondVar;
+    std::deque<std::function<void()>> mJobs;
+    bool mExit = false;
+    static SqliteWriter*& runningWriter()
+    {
+        static thread_local SqliteWriter* writer = nullptr;
+        return writer;
+    }
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mCondVar.wait(lock, [this]() { return !mJobs.empty() || mExit; });
+            if (mJobs.empty()) // exit only once all pending writes are done
+                return;
+
+            lock.unlock();
+            {
+                std::lock_guard<std::recursive_mutex> dbLock(mDbMutex);
+                runPending();
+            }
+            lock.lock();
+        }
+    }
+    void runJob(std::function<void()>& job)
+    {
+        try
+        {
+            job();
+        }
+        catch (std::exception& e)
+        {
+            if (mErrorHandler)
+                mErrorHandler(e);
+        }
+        catch (...)
+        {
+            // jobs are expected to throw std::exception only
+            assert(false);
+        }
+    }
+public:
+    /** @param dbMutex The lock of the db, held while the writes are applied
+     * @param errorHandler Receives the errors thrown by the writes, which can't reach
+     * the thread that posted them */
+    SqliteWriter(std::recursive_mutex& dbMutex, std::function<void(const std::exception&)> errorHandler)
+        : mDbMutex(dbMutex), mErrorHandler(errorHandler) {}
+    ~SqliteWriter() { stop(); }
+    void start()
+    {
+        assert(!mThread.joinable());
+        mExit = false;
+        mThread = std::thread(&SqliteWriter::run, this);
+    }
+    /** Stops the thread, after applying all the pending writes */
+    void stop()
+    {
+        if (!mThread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExit = true;
+        }
+        mCondVar.notify_one();
+        mThread.join();
+    }
+    void post(std::function<void()>&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(std::move(job));
+        }
+        mCondVar.notify_one();
+    }
+    /** Applies the pending writes in the calling thread, in order. Must be called with
+     * the db locked. Does nothing if called from one of the writes */
+    void runPending()
+    {
+        SqliteWriter*& running = runningWriter();
+        if (running == this)
+            return;
+
+        SqliteWriter* prev = running;
+        running = this;
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mJobs.empty())
+        {
+            auto job = std::move(mJobs.front());
+            mJobs.pop_front();
+            lock.unlock();
+            runJob(job);
+            lock.lock();
+        }
+        running = prev;
+    }
+    /** Whether the calling thread is applying one of the writes */
+    bool isRunningJob() const { return runningWriter() == this; }
+};
+
 class SqliteDb
 {
+public:
+    /** Values for PRAGMA synchronous */
+    enum Synchronous: uint8_t { kSyncOff = 0, kSyncNormal = 1, kSyncFull = 2, kSyncExtra = 3 };
+
+    /** Number of pages in the WAL file that trigger a checkpoint (same as sqlite's default) */
+    enum { kWalCheckpointPages = 1000 };
+
+    typedef std::unique_lock<std::recursive_mutex> Lock;
+
 protected:
     friend class SqliteStmt;
     sqlite3* mDb = nullptr;
+    /** Serializes the use of the connection, shared by the thread that owns the db, the
+     * writer thread and any other thread that reads from it. It's held by \c SqliteStmt
+     * for its whole life, by the methods that run sql, and by the writer thread while it
+     * applies the posted writes */
+    std::recursive_mutex mMutex;
     bool mCommitEach = true;
-    bool mHasOpenTransaction = false;
+    /** The transaction state is also changed by the writer thread, i.e. by the timed commits
+     * of posted writes. It's only changed with the db locked, and it's atomic so it can be
+     * read at any time */
+    std::atomic<bool> mHasOpenTransaction{false};
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    /** Number of nested SqliteSavepoint scopes. While any is active, timed commits are
+     * deferred, so that the writes done inside them end up in the same transaction */
+    std::atomic<int> mSavepointLevel{0};
+
+    /** A prepared statement owned by the db, that can be borrowed by a SqliteStmt */
+    struct CachedStmt
+    {
+        sqlite3_stmt* stmt = nullptr;
+        bool inUse = false;
+    };
+
+    /** Maximum number of prepared statements kept in the cache. Statements
+     * beyond this limit are prepared and finalized on every use */
+    enum { kMaxCachedStmts = 128 };
+
+    /** Prepared statements, keyed by their sql. Only accessed with the db locked */
+    std::map<std::string, CachedStmt> mStmtCache;
+
+    /** Journal settings, applied upon open() */
+    bool mWalMode = false;
+    bool mWalActive = false;
+    uint8_t mSynchronous = kSyncNormal;
+    std::unique_ptr<SqliteCheckpointer> mCheckpointer;
+
+    /** Writes posted with \c post() are applied by \c mWriter, if enabled before \c open() */
+    bool mAsyncWrites = false;
+    std::unique_ptr<SqliteWriter> mWriter;
+    std::function<void(const std::exception&)> mWriteErrorHandler;
+
+    static int walHookCb(void* userp, sqlite3*, const char*, int pages)
+    {
+        SqliteDb* self = static_cast<SqliteDb*>(userp);
+        if (pages >= kWalCheckpointPages && self->mCheckpointer)
+        {
+            self->mCheckpointer->notify();
+        }
+        return SQLITE_OK;
+    }
+    /** Switches the journal to WAL mode. Returns false if not supported, i.e. by
+     * the VFS or for in-memory databases */
+    bool enableWal(const char* fname)
+    {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(mDb, "PRAGMA journal_mode=WAL", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        bool ok = (sqlite3_step(stmt) == SQLITE_ROW)
+                && (sqlite3_stricmp((const char*)sqlite3_column_text(stmt, 0), "wal") == 0);
+        sqlite3_finalize(stmt);
+        if (!ok)
+            return false;
+
+        simpleQuery((std::string("PRAGMA synchronous=") + std::to_string(mSynchronous)).c_str());
+
+        // checkpoints are done by a dedicated thread instead of by the committing connection
+        mCheckpointer.reset(new SqliteCheckpointer);
+        if (mCheckpointer->start(fname))
+        {
+            sqlite3_wal_hook(mDb, &SqliteDb::walHookCb, this);
+        }
+        else
+        {
+            mCheckpointer.reset();  // sqlite does the checkpoints itself then
+        }
+        return true;
+    }
     inline int step(SqliteStmt& stmt);
+
+    /** Returns a cached statement for \c sql, preparing it if needed, and marks it as
+     * in use. Returns NULL if the statement is already borrowed by someone else
+     * (i.e. nested use of the same query) or the cache is full, in which case the
+     * caller should prepare a statement of its own */
+    CachedStmt* borrowStmt(const char* sql)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        auto it = mStmtCache.find(sql);
+        if (it == mStmtCache.end())
+        {
+            if (mStmtCache.size() >= kMaxCachedStmts)
+                return nullptr;
+
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                if (stmt)
+                    sqlite3_finalize(stmt);
+                return nullptr; // let the caller prepare it again and report the error
+            }
+            it = mStmtCache.emplace(sql, CachedStmt()).first;
+            it->second.stmt = stmt;
+        }
+        else if (it->second.inUse)
+        {
+            return nullptr;
+        }
+        it->second.inUse = true;
+        return &it->second;
+    }
+    void returnStmt(CachedStmt* cached)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        // leave the statement ready to be rebound
+        sqlite3_reset(cached->stmt);
+        sqlite3_clear_bindings(cached->stmt);
+        cached->inUse = false;
+    }
+    void clearStmtCache()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        for (auto& item: mStmtCache)
+        {
+            assert(!item.second.inUse);
+            sqlite3_finalize(item.second.stmt);
+        }
+        mStmtCache.clear();
+    }
     void beginTransaction()
     {
+        Lock lock(mMutex);
+        sync();
         assert(!mHasOpenTransaction);
         simpleQuery("BEGIN TRANSACTION");
         mHasOpenTransaction = true;
     }
     bool commitTransaction()
     {
+        Lock lock(mMutex);
+        sync();
         if (!mHasOpenTransaction)
             return false;
         simpleQuery("COMMIT TRANSACTION");
@@ -41,14 +376,48 @@ protected:
         mLastCommitTs = time(NULL);
         return true;
     }
+    void beginSavepoint()
+    {
+        Lock lock(mMutex);
+        simpleQuery("SAVEPOINT batch");
+        mSavepointLevel++;
+    }
+    void endSavepoint(bool release)
+    {
+        Lock lock(mMutex);
+        sync();
+        assert(mSavepointLevel > 0);
+        mSavepointLevel--;
+        if (release)
+        {
+            auto ret = sqlite3_exec(mDb, "RELEASE batch", nullptr, nullptr, nullptr);
+            if (ret == SQLITE_OK)
+                return;
+        }
+        // as with rollback(), errors here are harmless - sqlite may have already
+        // rolled back the transaction by itself
+        sqlite3_exec(mDb, "ROLLBACK TO batch", nullptr, nullptr, nullptr);
+        sqlite3_exec(mDb, "RELEASE batch", nullptr, nullptr, nullptr);
+        if (release)
+            throw std::runtime_error("Error releasing savepoint, changes have been rolled back");
+    }
+    friend class SqliteSavepoint;
 public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
-    bool open(const char* fname, bool commitEach=true)
+    /**
+     * @brief Opens the db file
+     * @param commitEach If false, all changes are done in a long running transaction,
+     * committed periodically by \c timedCommit(), or explicitly by \c commit()
+     * @param readOnly Opens a read-only connection. If the db is in WAL mode, such a
+     * connection can be used in parallel with the one that writes, i.e. from another thread
+     */
+    bool open(const char* fname, bool commitEach=true, bool readOnly=false)
     {
         assert(!mDb);
-        int ret = sqlite3_open(fname, &mDb);
+        int flags = readOnly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        int ret = sqlite3_open_v2(fname, &mDb, flags, nullptr);
         if (!mDb)
             return false;
         if (ret != SQLITE_OK)
@@ -57,27 +426,117 @@ public:
             mDb = nullptr;
             return false;
         }
+        if (readOnly)
+        {
+            commitEach = true;  // nothing to commit
+        }
+        else if (mWalMode)
+        {
+            mWalActive = enableWal(fname);
+        }
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
             beginTransaction();
             mLastCommitTs = time(NULL);
         }
+        if (mAsyncWrites && !readOnly)
+        {
+            mWriter.reset(new SqliteWriter(mMutex, mWriteErrorHandler));
+            mWriter->start();
+        }
         return true;
     }
     void close()
     {
         if (!mDb)
             return;
+        if (mWriter)
+        {
+            mWriter->stop();
+            mWriter.reset();
+        }
+        Lock lock(mMutex);
         if (!mCommitEach)
             commitTransaction();
+        clearStmtCache();
+        if (mCheckpointer)
+        {
+            sqlite3_wal_hook(mDb, nullptr, nullptr);
+            mCheckpointer.reset();
+        }
+        mWalActive = false;
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
     }
     bool isOpen() const { return mDb != nullptr; }
+    /**
+     * @brief Sets the journal mode to WAL, with the specified \c synchronous level.
+     * Checkpoints are then run by a background thread. It must be called before \c open().
+     * If WAL is not supported, the default rollback journal is used.
+     */
+    void setWalMode(bool enable, uint8_t synchronous=kSyncNormal)
+    {
+        assert(!mDb);
+        mWalMode = enable;
+        mSynchronous = synchronous;
+    }
+    /** Whether the db is open and actually using a WAL journal */
+    bool isWalMode() const { return mWalActive; }
+    /**
+     * @brief Applies the writes done via \c post() in a dedicated thread, so the caller
+     * doesn't wait for them. It must be called before \c open().
+     */
+    void setAsyncWrites(bool enable)
+    {
+        assert(!mDb);
+        mAsyncWrites = enable;
+    }
+    /** Sets the handler of the errors thrown by the writes applied asynchronously, which
+     * can't reach the caller of \c post(). It must be called before \c open() */
+    void setWriteErrorHandler(std::function<void(const std::exception&)> handler)
+    {
+        assert(!mDb);
+        mWriteErrorHandler = handler;
+    }
+    bool isAsyncWrites() const { return mWriter != nullptr; }
+    /** Whether the calling thread is applying a write posted with \c post() */
+    bool isInPostedWrite() const { return mWriter && mWriter->isRunningJob(); }
+    /**
+     * @brief Queues a write to the db. If async writes are not enabled, or it's called from
+     * another posted write, \c job is run immediately, and its errors reach the caller.
+     * Otherwise it runs later, in the writer thread or in the next thread that uses the db,
+     * and must only capture data that remains valid until then. The errors it throws are
+     * then passed to the handler set with \c setWriteErrorHandler().
+     */
+    void post(std::function<void()>&& job)
+    {
+        if (!mWriter || mWriter->isRunningJob())
+        {
+            job();
+        }
+        else
+        {
+            mWriter->post(std::move(job));
+        }
+    }
+    /** Locks the db, i.e. to read \c sqlite3_changes() after a query, before the writer
+     * thread runs any other */
+    Lock lock() { return Lock(mMutex); }
+    /** Applies the writes queued with \c post() that are still pending, waiting for
+     * the writer thread if it's applying them */
+    void sync()
+    {
+        if (!mWriter)
+            return;
+        Lock lock(mMutex);
+        mWriter->runPending();
+    }
     void setCommitMode(bool commitEach)
     {
+        Lock lock(mMutex);
+        sync(); // posted writes commit depending on it
         if (commitEach == mCommitEach)
             return;
         mCommitEach = commitEach;
@@ -87,13 +546,22 @@ public:
         }
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    size_t cachedStmtCount() const { return mStmtCache.size(); }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
+    /** Runs a one-off query, compiling \c sql on every call */
     template <class... Args>
     inline bool query(const char* sql, Args&&... args);
+    /** Like \c query(), but the statement is kept in the prepared statement cache.
+     * Only for the frequent queries with a fixed \c sql, so the cache is not filled
+     * with one-off dynamic sql (migrations, lists of values...) */
+    template <class... Args>
+    inline bool cachedQuery(const char* sql, Args&&... args);
     void simpleQuery(const char* sql)
     {
+        Lock lock(mMutex);
+        sync();
         SqliteString err;
         auto ret = sqlite3_exec(mDb, sql, nullptr, nullptr, &err.mStr);
         if (ret == SQLITE_OK)
@@ -111,6 +579,8 @@ public:
     {
         if (mCommitEach)
             return;
+        Lock lock(mMutex);
+        sync();
         commitTransaction();
         beginTransaction();
     }
@@ -118,6 +588,8 @@ public:
     {
         if (mCommitEach)
             return false;
+        Lock lock(mMutex);
+        sync();
         // the rollback may fail - in case of some critical errors, sqlite automatically
         // does a rollback. In such cases, we should ignore the error returned by
         // rollback, it's harmless
@@ -125,11 +597,67 @@ public:
         beginTransaction();
         return true;
     }
+    /** Returns the value of an integer pragma, i.e. "freelist_count", or -1 on error */
+    int64_t pragmaValue(const char* name)
+    {
+        std::string sql("PRAGMA ");
+        sql.append(name);
+        Lock lock(mMutex);
+        sync();
+        sqlite3_stmt* stmt = nullptr;
+        int64_t value = -1;
+        if (sqlite3_prepare_v2(mDb, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK
+                && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return value;
+    }
+    /**
+     * @brief Switches the db to auto_vacuum=INCREMENTAL, so that \c incrementalVacuum() can
+     * return free pages to the filesystem. An existing db has to be rebuilt for this to take
+     * effect, which is done with a VACUUM and may take a while for big databases, so it's
+     * meant to be called while opening the db, not from the event loop.
+     */
+    void enableIncrementalVacuum()
+    {
+        if (pragmaValue("auto_vacuum") == 2)
+            return;
+
+        Lock lock(mMutex);
+        assert(!mSavepointLevel);
+        bool hadTransaction = commitTransaction();  // VACUUM can't run inside a transaction
+        try
+        {
+            simpleQuery("PRAGMA auto_vacuum = INCREMENTAL");
+            simpleQuery("VACUUM");
+        }
+        catch (...)
+        {
+            if (hadTransaction)
+                beginTransaction();
+            throw;
+        }
+        if (hadTransaction)
+            beginTransaction();
+    }
+    /** Truncates the file, returning the free pages to the filesystem. Requires auto_vacuum
+     * to be INCREMENTAL, otherwise it has no effect. @see enableIncrementalVacuum() */
+    void incrementalVacuum()
+    {
+        simpleQuery("PRAGMA incremental_vacuum");
+    }
     bool timedCommit()
     {
         if (mCommitEach)
             return false;
 
+        Lock lock(mMutex);
+        sync();
+        if (mSavepointLevel)
+            return false;
+
         auto now = time(NULL);
         if (now - mLastCommitTs < mCommitInterval)
             return false;
@@ -144,7 +672,12 @@ class SqliteStmt
 protected:
     sqlite3_stmt* mStmt;
     SqliteDb& mDb;
+    /** The db is locked while the statement exists, as it may be reset or stepped at any time */
+    SqliteDb::Lock mLock;
     int mLastBindCol = 0;
+    /** If not NULL, \c mStmt is borrowed from the statement cache of \c mDb,
+     * and is reset and returned to it upon destruction instead of being finalized */
+    SqliteDb::CachedStmt* mCached = nullptr;
     void retCheck(int code, const char* opname)
     {
         if (code != SQLITE_OK)
@@ -169,8 +702,22 @@ protected:
         return msg;
     }
 public:
-    SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
+    /** @param cached If true, the statement is borrowed from the prepared statement
+     * cache of \c db (or added to it, if not there yet), avoiding to compile the
+     * sql on every use. Only use it for queries with a fixed set of values for \c sql.
+     */
+    SqliteStmt(SqliteDb& db, const char* sql, bool cached=false):mDb(db), mLock(db.mMutex)
     {
+        db.sync();
+        if (cached)
+        {
+            mCached = db.borrowStmt(sql);
+            if (mCached)
+            {
+                mStmt = mCached->stmt;
+                return;
+            }
+        }
         if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
         {
             const char* errMsg = sqlite3_errmsg(mDb);
@@ -181,12 +728,20 @@ public:
         }
         assert(mStmt);
     }
-    SqliteStmt(SqliteDb& db, const std::string& sql)
-        :SqliteStmt(db, sql.c_str()){}
+    SqliteStmt(SqliteDb& db, const std::string& sql, bool cached=false)
+        :SqliteStmt(db, sql.c_str(), cached){}
+    SqliteStmt(const SqliteStmt&) = delete;
+    SqliteStmt& operator=(const SqliteStmt&) = delete;
     ~SqliteStmt()
     {
-        if (mStmt)
+        if (mCached)
+        {
+            mDb.returnStmt(mCached);
+        }
+        else if (mStmt)
+        {
             sqlite3_finalize(mStmt);
+        }
     }
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
@@ -291,8 +846,17 @@ inline bool SqliteDb::query(const char* sql, Args&&... args)
     return stmt.step();
 }
 
+template <class... Args>
+inline bool SqliteDb::cachedQuery(const char* sql, Args&&... args)
+{
+    SqliteStmt stmt(*this, sql, true);
+    stmt.bindV(args...);
+    return stmt.step();
+}
+
 inline int SqliteDb::step(SqliteStmt& stmt)
 {
+    sync(); // the statement may have been prepared before the last post()
     auto ret = sqlite3_step(stmt);
     if (ret == SQLITE_DONE)
     {
@@ -320,4 +884,29 @@ public:
     }
 };
 
+/** @brief Groups a batch of writes so that they are applied atomically. Unlike
+ * SqliteTransaction, it doesn't commit the currently open transaction (if any)
+ * so it's cheap to use for every batch. If not released, all writes done in its
+ * scope are rolled back upon destruction.
+ */
+class SqliteSavepoint
+{
+protected:
+    SqliteDb* mDb;
+public:
+    SqliteSavepoint(SqliteDb& db): mDb(&db) { mDb->beginSavepoint(); }
+    void release()
+    {
+        assert(mDb);
+        SqliteDb* db = mDb;
+        mDb = nullptr;
+        db->endSavepoint(true);
+    }
+    ~SqliteSavepoint()
+    {
+        if (mDb)
+            mDb->endSavepoint(false);
+    }
+};
+
 #endif
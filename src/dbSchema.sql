@@ -29,12 +29,19 @@ CREATE TABLE chat_vars(chatid int64 not null, name text not null, value text,
 
 CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
-    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+    is_encrypted tinyint, data blob, backrefid int64 not null, fts_docid int64,
+    PRIMARY KEY(chatid, idx)) WITHOUT ROWID;
+
+CREATE UNIQUE INDEX history_msgid ON history(chatid, msgid);
 
 CREATE TABLE sendkeys(chatid int64 not null, userid int64 not null, keyid int64 not null, key blob not null,
     ts int not null, UNIQUE(chatid, userid, keyid));
 
+CREATE TABLE pairwise_keys(userid int64 primary key, pubkey blob not null, key blob not null);
+
 CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
-    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+    is_encrypted tinyint, data blob, backrefid int64 not null, PRIMARY KEY(chatid, idx)) WITHOUT ROWID;
+
+CREATE UNIQUE INDEX node_history_msgid ON node_history(chatid, msgid);
 
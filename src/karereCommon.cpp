@@ -11,10 +11,11 @@ namespace rtcModule {void globalCleanup(); }
 
 namespace karere
 {
-const char* gDbSchemaVersionSuffix = "5";
+const char* gDbSchemaVersionSuffix = "6";
 // 2 --> +3: invalidate cached chats to reload history (so call-history msgs are fetched)
 // 3 --> +4: invalidate both caches, SDK + MEGAchat, if there's at least one chat (so deleted chats are re-fetched from API)
 // 4 --> +5: modify attachment, revoke, contact and containsMeta and create a new table node_history
+// 5 --> +6: rebuild history and node_history as WITHOUT ROWID tables, with fts_docid in history, and create pairwise_keys
 
 bool gCatchException = true;
 
@@ -68,8 +69,8 @@ void RemoteLogger::log(krLogLevel /*level*/, const char* msg, size_t len, unsign
         });
 }
 
-void init_uv_timer(void *ctx, uv_timer_t *timer)
+TimerWheel& get_timer_wheel(void *ctx)
 {
-    uv_timer_init(((::mega::LibuvWaiter *)(((megachat::MegaChatApiImpl *)ctx)->waiter))->eventloop, timer);
+    return *((megachat::MegaChatApiImpl *)ctx)->timerWheel;
 }
 }
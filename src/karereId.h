@@ -13,7 +13,8 @@ class Id
 {
 public:
     uint64_t val;
-    std::string toString() const { return base64urlencode(&val, sizeof(val)); }
+    std::string toString() const { return valToString(val); }
+    static std::string valToString(uint64_t val) { return base64urlencode(&val, sizeof(val)); }
     bool isValid() const { return val != ~((uint64_t)0); }
     Id(const uint64_t& from=0): val(from){}
     explicit Id(const char* b64, size_t len=0) { base64urldecode(b64, len?len:strlen(b64), &val, sizeof(val)); }
@@ -33,6 +34,9 @@ public:
     }
 };
 
+/** Passes an Id to KARERE_LOGB() as a value, so that it's converted to base64 only when
+ * the line is actually formatted. To be printed with %s */
+#define ID_LOGARG(id) karere::LogDeferred{karere::Id(id).val, karere::Id::valToString}
 
 //for exception message purposes
 static inline std::string operator+(const char* str, const Id& id)
@@ -217,6 +217,35 @@ MegaChatHandle MegaChatCall::getCaller() const
     return MEGACHAT_INVALID_HANDLE;
 }
 
+MegaChatVideoFrame::~MegaChatVideoFrame()
+{
+}
+
+MegaChatVideoFrame *MegaChatVideoFrame::copy() const
+{
+    return NULL;
+}
+
+char *MegaChatVideoFrame::getBuffer() const
+{
+    return NULL;
+}
+
+size_t MegaChatVideoFrame::getSize() const
+{
+    return 0;
+}
+
+int MegaChatVideoFrame::getWidth() const
+{
+    return 0;
+}
+
+int MegaChatVideoFrame::getHeight() const
+{
+    return 0;
+}
+
 MegaChatApi::MegaChatApi(MegaApi *megaApi)
 {
     this->pImpl = new MegaChatApiImpl(this, megaApi);
@@ -252,11 +281,36 @@ void MegaChatApi::setLogToConsole(bool enable)
     MegaChatApiImpl::setLogToConsole(enable);
 }
 
+void MegaChatApi::setLogAsync(bool enable, bool dropWhenFull, bool flushOnCrash)
+{
+    MegaChatApiImpl::setLogAsync(enable, dropWhenFull, flushOnCrash);
+}
+
 int MegaChatApi::init(const char *sid)
 {
     return pImpl->init(sid);
 }
 
+void MegaChatApi::setDatabaseWalMode(bool enable, int synchronous)
+{
+    pImpl->setDatabaseWalMode(enable, synchronous);
+}
+
+void MegaChatApi::setDatabaseAsyncWrites(bool enable)
+{
+    pImpl->setDatabaseAsyncWrites(enable);
+}
+
+void MegaChatApi::setMaxMessagesInMemory(unsigned int maxMessages)
+{
+    pImpl->setMaxMessagesInMemory(maxMessages);
+}
+
+void MegaChatApi::setHistoryRetention(MegaChatHandle chatid, unsigned int maxMessages, unsigned int maxAge, long long maxBytes)
+{
+    pImpl->setHistoryRetention(chatid, maxMessages, maxAge, maxBytes);
+}
+
 int MegaChatApi::getInitState()
 {
     return pImpl->getInitState();
@@ -876,6 +930,11 @@ int MegaChatApi::loadAttachments(MegaChatHandle chatid, int count)
     return pImpl->loadAttachments(chatid, count);
 }
 
+void MegaChatApi::searchMessages(MegaChatHandle chatid, const char *query, int limit, MegaChatSearchListener *searchListener, MegaChatRequestListener *listener)
+{
+    pImpl->searchMessages(chatid, query, limit, searchListener, listener);
+}
+
 void MegaChatApi::addChatListener(MegaChatListener *listener)
 {
     pImpl->addChatListener(listener);
@@ -1224,6 +1283,11 @@ void MegaChatVideoListener::onChatVideoData(MegaChatApi * /*api*/, MegaChatHandl
 
 }
 
+void MegaChatVideoListener::onChatVideoFrame(MegaChatApi *api, MegaChatHandle chatid, MegaChatVideoFrame *frame)
+{
+    onChatVideoData(api, chatid, frame->getWidth(), frame->getHeight(), frame->getBuffer(), frame->getSize());
+}
+
 
 void MegaChatCallListener::onChatCallUpdate(MegaChatApi * /*api*/, MegaChatCall * /*call*/)
 {
@@ -1701,3 +1765,7 @@ void MegaChatNodeHistoryListener::onAttachmentDeleted(MegaChatApi */*api*/, Mega
 void MegaChatNodeHistoryListener::onTruncate(MegaChatApi */*api*/, MegaChatHandle /*msgid*/)
 {
 }
+
+void MegaChatSearchListener::onMessageFound(MegaChatApi */*api*/, MegaChatMessage */*msg*/)
+{
+}
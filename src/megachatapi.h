@@ -54,10 +54,12 @@ class MegaChatRoomListener;
 class MegaChatCall;
 class MegaChatCallListener;
 class MegaChatVideoListener;
+class MegaChatVideoFrame;
 class MegaChatListener;
 class MegaChatNotificationListener;
 class MegaChatListItem;
 class MegaChatNodeHistoryListener;
+class MegaChatSearchListener;
 
 /**
  * @brief Provide information about a session
@@ -526,6 +528,65 @@ public:
     virtual MegaChatHandle getCaller() const;
 };
 
+/**
+ * @brief Provide a video frame received by a MegaChatVideoListener
+ *
+ * The pixels are not copied to the object: it's a reference to a buffer that the SDK reuses
+ * for the following frames of the same peer once all the references to it are deleted.
+ * The object received by MegaChatVideoListener::onChatVideoFrame is valid until that function
+ * returns. To keep the frame after that without copying its pixels, use MegaChatVideoFrame::copy.
+ */
+class MegaChatVideoFrame
+{
+public:
+    virtual ~MegaChatVideoFrame();
+
+    /**
+     * @brief Creates a new reference to this frame
+     *
+     * The pixels are not copied: the returned object keeps the buffer alive, so it will
+     * be valid after the original object is deleted. The buffer is given back to the SDK
+     * when all the references to it are deleted, so they should not be kept longer than
+     * needed, otherwise the SDK has to allocate a new buffer for each frame.
+     *
+     * You are the owner of the returned object
+     *
+     * @return Reference to the frame
+     */
+    virtual MegaChatVideoFrame *copy() const;
+
+    /**
+     * @brief Returns the pixels of the frame
+     *
+     * The buffer is in format ARGB: 4 bytes per pixel. It's shared by all the references to
+     * the frame, so it must not be modified once the frame has been copied.
+     *
+     * @return Data buffer of the frame, of size MegaChatVideoFrame::getSize
+     */
+    virtual char *getBuffer() const;
+
+    /**
+     * @brief Returns the size of the buffer of the frame
+     *
+     * @return Buffer size in bytes (width * height * 4)
+     */
+    virtual size_t getSize() const;
+
+    /**
+     * @brief Returns the width of the frame
+     *
+     * @return Width in pixels
+     */
+    virtual int getWidth() const;
+
+    /**
+     * @brief Returns the height of the frame
+     *
+     * @return Height in pixels
+     */
+    virtual int getHeight() const;
+};
+
 /**
  * @brief Interface to get video frames from calls
  *
@@ -553,6 +614,23 @@ public:
      *  The MegaChatVideoListener retains the ownership of the buffer.
      */
     virtual void onChatVideoData(MegaChatApi *api, MegaChatHandle chatid, int width, int height, char *buffer, size_t size);
+
+    /**
+     * @brief This function is called when a new image from a local or remote device is available
+     *
+     * The default implementation calls MegaChatVideoListener::onChatVideoData with the
+     * pixels of the frame. Override this function instead if you need to keep the frame
+     * after the callback, e.g. to render it from another thread, without copying it.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param chatid MegaChatHandle that provides the video
+     * @param frame MegaChatVideoFrame with the image
+     *
+     * The SDK retains the ownership of the MegaChatVideoFrame.
+     * The frame object will be valid until this function returns.
+     * If you want to keep the frame, use MegaChatVideoFrame::copy.
+     */
+    virtual void onChatVideoFrame(MegaChatApi *api, MegaChatHandle chatid, MegaChatVideoFrame *frame);
 };
 
 /**
@@ -1447,6 +1525,7 @@ public:
         TYPE_SET_PRESENCE_PERSIST, TYPE_SET_PRESENCE_AUTOAWAY,
         TYPE_LOAD_AUDIO_VIDEO_DEVICES, TYPE_ARCHIVE_CHATROOM,
         TYPE_PUSH_RECEIVED, TYPE_SET_LAST_GREEN_VISIBLE, TYPE_LAST_GREEN,
+        TYPE_SEARCH_MESSAGES,
         TOTAL_OF_REQUEST_TYPES
     };
 
@@ -2004,6 +2083,13 @@ public:
         CHAT_CONNECTION_ONLINE      = 3     /// Connection with chatd is ready and logged in
     };
 
+    enum
+    {
+        DB_SYNC_OFF     = 0,    /// Commits don't wait for the data to reach the disk
+        DB_SYNC_NORMAL  = 1,    /// Only checkpoints wait for the disk. Recent commits may be lost on power loss
+        DB_SYNC_FULL    = 2     /// Every commit waits for the disk
+    };
+
 
     // chat will reuse an existent megaApi instance (ie. the one for cloud storage)
     /**
@@ -2071,6 +2157,26 @@ public:
      */
     static void setLogToConsole(bool enable);
 
+    /**
+     * @brief Write the logs of MEGAchat in a background thread
+     *
+     * By default, each log line is written to the console, the log file and the MegaChatLogger
+     * by the thread that logs it, which slows down the library when the log level is high.
+     * When enabled, the lines are queued by each thread and written in batches by a background
+     * thread, in the same order. The queued lines are written when it's disabled and, on POSIX
+     * systems and if requested, when the app crashes.
+     *
+     * The MegaChatLogger is called from the background thread while this mode is enabled.
+     *
+     * @param enable True to write the logs in a background thread, false to write them synchronously.
+     * @param dropWhenFull True to drop the lines that don't fit in the queue of a thread, when the
+     * background thread can't keep up, false to wait for it. The number of dropped lines is logged.
+     * @param flushOnCrash True to write the queued lines when the app crashes, on POSIX systems.
+     * It installs handlers of SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, which pass the signal
+     * to the handlers installed before them. They are installed the first time it's enabled.
+     */
+    static void setLogAsync(bool enable, bool dropWhenFull = false, bool flushOnCrash = false);
+
     /**
      * @brief Initializes karere
      *
@@ -2095,6 +2201,81 @@ public:
      */
     int init(const char *sid);
 
+    /**
+     * @brief Enables the write-ahead log (WAL) mode for the local cache
+     *
+     * By default, the local cache uses a rollback journal, and every commit waits for the
+     * data to be written to disk. In WAL mode, commits are appended to a separate log and
+     * copied back to the database by a background thread, so they don't block the chat engine.
+     *
+     * If the platform doesn't support WAL, the default mode is used.
+     *
+     * This function must be called before MegaChatApi::init. A MegaChatApi::logout doesn't
+     * reset its value.
+     *
+     * @param enable True to enable WAL mode, false to use the default rollback journal.
+     * @param synchronous Level of synchronization with the disk in WAL mode. Valid values are:
+     * - MegaChatApi::DB_SYNC_OFF
+     * - MegaChatApi::DB_SYNC_NORMAL
+     * - MegaChatApi::DB_SYNC_FULL
+     */
+    void setDatabaseWalMode(bool enable, int synchronous = DB_SYNC_NORMAL);
+
+    /**
+     * @brief Writes the history received from the server to the local cache in a background thread
+     *
+     * By default, the messages are written to the local cache as they are received, so loading
+     * a large history waits for the disk. When enabled, the writes are queued to a dedicated thread,
+     * in order. Reads from the local cache, MegaChatApi::saveCurrentState and MegaChatApi::logout
+     * wait for the queued writes to be done.
+     *
+     * This function must be called before MegaChatApi::init. A MegaChatApi::logout doesn't
+     * reset its value.
+     *
+     * @param enable True to write in a background thread, false to write synchronously.
+     */
+    void setDatabaseAsyncWrites(bool enable);
+
+    /**
+     * @brief Limits the history kept in the local cache
+     *
+     * Messages older than any of the limits are removed from the local cache in small
+     * batches, in the background, and the space is returned to the filesystem. They can
+     * still be loaded again from server by MegaChatApi::loadMessages. Messages loaded in
+     * memory for an open chatroom are never removed.
+     *
+     * Limits can be set for all chats, or for a specific one. A chat with its own limits
+     * does not use the limits set for all chats. A value of 0 means no limit.
+     *
+     * A local cache created by a version without this feature is converted, so its file can be
+     * shrunk, the first time MegaChatApi::init opens it with limits already set. It may take a
+     * while for a big cache, so this function should be called before MegaChatApi::init.
+     *
+     * A MegaChatApi::logout doesn't reset these limits.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE
+     * to set the limits for all chats
+     * @param maxMessages Max number of messages kept for each chat
+     * @param maxAge Max age of the messages kept, in seconds
+     * @param maxBytes Max size of the content of the messages kept for each chat, in bytes
+     */
+    void setHistoryRetention(MegaChatHandle chatid, unsigned int maxMessages, unsigned int maxAge, long long maxBytes);
+
+    /**
+     * @brief Limits the number of messages of each chat kept in memory
+     *
+     * By default, the messages loaded for a chatroom stay in memory until the app is closed.
+     * When a limit is set, the oldest messages are periodically released from memory. They are loaded
+     * again from the local cache when needed, ie. by MegaChatApi::loadMessages or MegaChatApi::getMessage,
+     * and keep their index. In an open chatroom, the messages already loaded by the app and the next
+     * ones to be loaded are not released.
+     *
+     * A MegaChatApi::logout doesn't reset this limit.
+     *
+     * @param maxMessages Max number of messages kept in memory for each chat, or 0 for no limit
+     */
+    void setMaxMessagesInMemory(unsigned int maxMessages);
+
     /**
      * @brief Returns the current initialization state
      *
@@ -4231,6 +4412,44 @@ public:
      */
     int loadAttachments(MegaChatHandle chatid, int count);
 
+    /**
+     * @brief Searches text messages in the local history
+     *
+     * The search uses a full-text index of the history stored in the local cache, so only
+     * messages already loaded at some point are found. Messages do not need to be loaded
+     * in memory: there's no need to call MegaChatApi::openChatRoom nor MegaChatApi::loadMessages.
+     *
+     * The query is a list of words, and messages containing all of them are returned. A word
+     * ending in '*' matches any word with that prefix (ie. "meet*" matches "meeting").
+     *
+     * The messages found will be notified one by one through the MegaChatSearchListener, sorted
+     * by relevance. After the last one, the callback MegaChatSearchListener::onMessageFound will be
+     * called with a NULL message. If the local cache is in WAL mode, the search runs in background,
+     * and the messages are notified in small batches, as they are found.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received on callbacks:
+     * - MegaChatRequest::getChatHandle - Returns the handle of the chatroom, or MEGACHAT_INVALID_HANDLE
+     * - MegaChatRequest::getText - Returns the query
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getNumber - Returns the number of messages found
+     *
+     * On the onRequestFinish error, the error code associated to the MegaChatError can be:
+     * - MegaChatError::ERROR_ARGS - If the query is empty or malformed, or the limit is not positive
+     * - MegaChatError::ERROR_NOENT - If the chatroom does not exist
+     * - MegaChatError::ERROR_ACCESS - If search is not supported, because the sqlite library
+     * has been built without full-text search (FTS4)
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE to search in all chats
+     * @param query Words to search for
+     * @param limit Maximum number of messages to return
+     * @param searchListener MegaChatSearchListener to receive the messages found
+     * @param listener MegaChatRequestListener to track this request
+     */
+    void searchMessages(MegaChatHandle chatid, const char *query, int limit, MegaChatSearchListener *searchListener, MegaChatRequestListener *listener = NULL);
+
 private:
     MegaChatApiImpl *pImpl;
 };
@@ -5026,6 +5245,30 @@ public:
     virtual void onTruncate(MegaChatApi *api, MegaChatHandle msgid);
 };
 
+/**
+ * @brief Interface to receive the results of MegaChatApi::searchMessages
+ */
+class MegaChatSearchListener
+{
+public:
+    virtual ~MegaChatSearchListener() {}
+
+    /**
+     * @brief This function is called for every message found by MegaChatApi::searchMessages
+     *
+     * Messages are notified from the most to the least relevant. When there are no more
+     * messages, this function is also called, but the second parameter will be NULL.
+     *
+     * The SDK retains the ownership of the MegaChatMessage in the second parameter. The MegaChatMessage
+     * object will be valid until this function returns. If you want to save the MegaChatMessage object,
+     * use MegaChatMessage::copy for the message.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param msg The MegaChatMessage object, or NULL if no more messages were found.
+     */
+    virtual void onMessageFound(MegaChatApi *api, MegaChatMessage *msg);
+};
+
 }
 
 #endif // MEGACHATAPI_H
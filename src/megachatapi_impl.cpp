@@ -38,6 +38,8 @@
 #include "megachatapi_impl.h"
 #include <base/cservices.h>
 #include <base/logger.h>
+#include <base/urlScanner.h>
+#include <inttypes.h>
 #include <IGui.h>
 #include <chatClient.h>
 #include <mega/base64.h>
@@ -109,7 +111,12 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
 
     this->mClient = NULL;
     this->terminating = false;
-    this->waiter = new MegaChatWaiter();
+    MegaChatWaiter *chatWaiter = new MegaChatWaiter();
+    this->waiter = chatWaiter;
+    this->timerWheel = new karere::TimerWheel(chatWaiter->eventloop, [this]()
+    {
+        waiter->notify();
+    });
     this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, megaApi, this);
 
     //Start blocking thread
@@ -141,11 +148,13 @@ void MegaChatApiImpl::loop()
 
         waiter->init(NEVER);
         waiter->wakeupby(websocketsIO, ::mega::Waiter::NEEDEXEC);
+        timerWheel->prepare();
         waiter->wait();
 
         sdkMutex.lock();
 
         sendPendingEvents();
+        timerWheel->expire();
         sendPendingRequests();
 
         if (threadExit)
@@ -154,6 +163,16 @@ void MegaChatApiImpl::loop()
             assert(eventQueue.isEmpty() || (eventQueue.size() == 1));
             sendPendingEvents();
 
+            EventQueue::Stats eventStats = eventQueue.stats();
+            ChatRequestQueue::Stats requestStats = requestQueue.stats();
+            API_LOG_INFO("Events processed: %" PRIu64 ", max queued: %zu, avg wait: %" PRIu64 " us, max wait: %" PRIu64 " us",
+                         eventStats.popped, eventStats.maxDepth, eventStats.avgWaitUs(), eventStats.maxWaitUs);
+            API_LOG_INFO("Requests processed: %" PRIu64 ", max queued: %zu, avg wait: %" PRIu64 " us, max wait: %" PRIu64 " us",
+                         requestStats.popped, requestStats.maxDepth, requestStats.avgWaitUs(), requestStats.maxWaitUs);
+            MsgPool::Stats poolStats = MsgPool::stats();
+            API_LOG_INFO("Message pool: %" PRIu64 " allocations, %" PRIu64 " in use, %" PRIu64 " from the heap, %" PRIu64 " oversized",
+                         poolStats.allocs, poolStats.inUse(), poolStats.heapAllocs, poolStats.oversized);
+
             sdkMutex.unlock();
             break;
         }
@@ -162,6 +181,10 @@ void MegaChatApiImpl::loop()
 #ifndef KARERE_DISABLE_WEBRTC
     rtcModule::globalCleanup();
 #endif
+
+    // the wheel must be destroyed by the thread that runs its loop
+    delete timerWheel;
+    timerWheel = NULL;
 }
 
 void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
@@ -1360,6 +1383,65 @@ void MegaChatApiImpl::sendPendingRequests()
             });
             break;
         }
+        case MegaChatRequest::TYPE_SEARCH_MESSAGES:
+        {
+            MegaChatHandle chatid = request->getChatHandle();
+            const char *query = request->getText();
+            unsigned limit = (unsigned)request->getNumber();
+            MegaChatSearchListener *searchListener = request->getSearchListener();
+            if (!query || !query[0] || !limit || !searchListener)
+            {
+                errorCode = MegaChatError::ERROR_ARGS;
+                break;
+            }
+
+            if (chatid != MEGACHAT_INVALID_HANDLE && !findChatRoom(chatid))
+            {
+                errorCode = MegaChatError::ERROR_NOENT;
+                break;
+            }
+
+            if (!mClient->hasSearchIndex())
+            {
+                API_LOG_ERROR("Search messages: the local cache has no full-text index");
+                errorCode = MegaChatError::ERROR_ACCESS;
+                break;
+            }
+
+            // the query runs off the loop, and the messages found are notified in batches
+            mClient->searchHistory(chatid, query, limit,
+            [this, searchListener](std::vector<karere::Client::SearchResult>& results)
+            {
+                for (auto& result: results)
+                {
+                    // the status requires the pointers of the chat, but it may not be known anymore
+                    Message::Status status = Message::kServerReceived;
+                    ChatRoom *chatroom = findChatRoom(result.chatid);
+                    if (chatroom)
+                    {
+                        status = chatroom->chat().getMsgStatus(*result.msg, result.idx);
+                    }
+                    MegaChatMessagePrivate message(*result.msg, status, result.idx);
+                    searchListener->onMessageFound(chatApi, &message);
+                }
+            },
+            [this, request, searchListener](unsigned count, const std::string& error)
+            {
+                if (!error.empty())
+                {
+                    API_LOG_ERROR("Error searching messages: %s", error.c_str());
+                    MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_ARGS);
+                    fireOnChatRequestFinish(request, megaChatError);
+                    return;
+                }
+
+                searchListener->onMessageFound(chatApi, NULL);
+                request->setNumber(count);
+                MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_OK);
+                fireOnChatRequestFinish(request, megaChatError);
+            });
+            break;
+        }
         default:
         {
             errorCode = MegaChatError::ERROR_UNKNOWN;
@@ -1410,6 +1492,11 @@ void MegaChatApiImpl::setLogToConsole(bool enable)
     }
 }
 
+void MegaChatApiImpl::setLogAsync(bool enable, bool dropWhenFull, bool flushOnCrash)
+{
+    gLogger.setAsync(enable, !dropWhenFull, 0, flushOnCrash);
+}
+
 void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
 {
     if (!megaLogger)   // removing logger
@@ -1439,6 +1526,13 @@ int MegaChatApiImpl::init(const char *sid)
 #endif
 
         mClient = new karere::Client(*this->megaApi, websocketsIO, *this, this->megaApi->getBasePath(), caps, this);
+        mClient->setDbWalMode(mDbWalMode, mDbSynchronous);
+        mClient->setDbAsyncWrites(mDbAsyncWrites);
+        for (auto& it: mHistoryRetention)
+        {
+            mClient->setHistoryRetention(it.second, it.first);
+        }
+        mClient->setMaxResidentMessages(mMaxMessagesInMemory);
         terminating = false;
     }
 
@@ -1456,6 +1550,64 @@ int MegaChatApiImpl::init(const char *sid)
     return MegaChatApiImpl::convertInitState(state);
 }
 
+void MegaChatApiImpl::setDatabaseWalMode(bool enable, int synchronous)
+{
+    if (synchronous < MegaChatApi::DB_SYNC_OFF || synchronous > MegaChatApi::DB_SYNC_FULL)
+    {
+        API_LOG_ERROR("setDatabaseWalMode: invalid synchronous level %d", synchronous);
+        return;
+    }
+
+    sdkMutex.lock();
+    mDbWalMode = enable;
+    mDbSynchronous = synchronous;
+    if (mClient)
+    {
+        // only effective if the cache has not been opened yet
+        mClient->setDbWalMode(enable, (uint8_t)synchronous);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setDatabaseAsyncWrites(bool enable)
+{
+    sdkMutex.lock();
+    mDbAsyncWrites = enable;
+    if (mClient)
+    {
+        // only effective if the cache has not been opened yet
+        mClient->setDbAsyncWrites(enable);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setHistoryRetention(MegaChatHandle chatid, unsigned int maxMessages, unsigned int maxAge, long long maxBytes)
+{
+    chatd::HistoryRetention retention;
+    retention.maxMessages = maxMessages;
+    retention.maxAge = maxAge;
+    retention.maxBytes = (maxBytes > 0) ? (uint64_t)maxBytes : 0;
+
+    sdkMutex.lock();
+    mHistoryRetention[chatid] = retention;
+    if (mClient)
+    {
+        mClient->setHistoryRetention(retention, chatid);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setMaxMessagesInMemory(unsigned int maxMessages)
+{
+    sdkMutex.lock();
+    mMaxMessagesInMemory = maxMessages;
+    if (mClient)
+    {
+        mClient->setMaxResidentMessages(maxMessages);
+    }
+    sdkMutex.unlock();
+}
+
 int MegaChatApiImpl::getInitState()
 {
     int initState;
@@ -1539,9 +1691,9 @@ karere::ChatRoom *MegaChatApiImpl::findChatRoomByUser(MegaChatHandle userhandle)
     return chatroom;
 }
 
-chatd::Message *MegaChatApiImpl::findMessage(MegaChatHandle chatid, MegaChatHandle msgid)
+std::unique_ptr<chatd::Message> MegaChatApiImpl::findMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
-    Message *msg = NULL;
+    std::unique_ptr<Message> msg;
 
     sdkMutex.lock();
 
@@ -1549,10 +1701,10 @@ chatd::Message *MegaChatApiImpl::findMessage(MegaChatHandle chatid, MegaChatHand
     if (chatroom)
     {
         Chat &chat = chatroom->chat();
-        Idx index = chat.msgIndexFromId(msgid);
+        Idx index = chat.msgIndexFromIdOrDb(msgid);
         if (index != CHATD_IDX_INVALID)
         {
-            msg = chat.findOrNull(index);
+            msg = chat.findOrLoad(index);
         }
     }
 
@@ -1586,8 +1738,14 @@ void MegaChatApiImpl::setCatchException(bool enable)
 
 bool MegaChatApiImpl::hasUrl(const char *text)
 {
-    std::string url;
-    return chatd::Message::hasUrl(text, url);
+    if (!text)
+    {
+        return false;
+    }
+
+    const char* urlStart;
+    size_t urlLen;
+    return karere::UrlScanner::findUrl(text, strlen(text), urlStart, urlLen);
 }
 
 bool MegaChatApiImpl::openNodeHistory(MegaChatHandle chatid, MegaChatNodeHistoryListener *listener)
@@ -1840,7 +1998,7 @@ void MegaChatApiImpl::fireOnChatCallUpdate(MegaChatCallPrivate *call)
     call->removeChanges();
 }
 
-void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, int width, int height, char *buffer)
+void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatVideoFrameBuffer *frame)
 {
     std::map<MegaChatHandle, MegaChatPeerVideoListener_map>::iterator it = videoListeners.find(chatid);
     if (it != videoListeners.end())
@@ -1848,11 +2006,12 @@ void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle
         MegaChatPeerVideoListener_map::iterator peerVideoIterator = it->second.find(peerid);
         if (peerVideoIterator != it->second.end())
         {
+            MegaChatVideoFramePrivate videoFrame(frame);
             for( MegaChatVideoListener_set::iterator videoListenerIterator = peerVideoIterator->second.begin();
                  videoListenerIterator != peerVideoIterator->second.end();
                  videoListenerIterator++)
             {
-                (*videoListenerIterator)->onChatVideoData(chatApi, chatid, width, height, buffer, width * height * 4);
+                (*videoListenerIterator)->onChatVideoFrame(chatApi, chatid, &videoFrame);
             }
         }
     }
@@ -2058,6 +2217,17 @@ void MegaChatApiImpl::requestLastGreen(MegaChatHandle userid, MegaChatRequestLis
     waiter->notify();
 }
 
+void MegaChatApiImpl::searchMessages(MegaChatHandle chatid, const char *query, int limit, MegaChatSearchListener *searchListener, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SEARCH_MESSAGES, listener);
+    request->setChatHandle(chatid);
+    request->setText(query);
+    request->setNumber(limit > 0 ? limit : 0);
+    request->setSearchListener(searchListener);
+    requestQueue.push(request);
+    waiter->notify();
+}
+
 MegaChatPresenceConfig *MegaChatApiImpl::getPresenceConfig()
 {
     MegaChatPresenceConfigPrivate *config = NULL;
@@ -2725,10 +2895,10 @@ MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHand
     if (chatroom)
     {
         Chat &chat = chatroom->chat();
-        Idx index = chat.msgIndexFromId(msgid);
+        Idx index = chat.msgIndexFromIdOrDb(msgid);
         if (index != CHATD_IDX_INVALID)     // only confirmed messages have index
         {
-            Message *msg = chat.findOrNull(index);
+            std::unique_ptr<Message> msg = chat.findOrLoad(index);
             if (msg)
             {
                 megaMsg = new MegaChatMessagePrivate(*msg, chat.getMsgStatus(*msg, index), index);
@@ -2906,8 +3076,8 @@ MegaChatMessage *MegaChatApiImpl::forwardContact(MegaChatHandle sourceChatid, Me
     if (chatroomSource && chatroomTarget)
     {
         chatd::Chat &chat = chatroomSource->chat();
-        Idx idx =  chat.msgIndexFromId(msgid);
-        chatd::Message *msg = chatroomSource->chat().findOrNull(idx);
+        Idx idx =  chat.msgIndexFromIdOrDb(msgid);
+        std::unique_ptr<chatd::Message> msg = chat.findOrLoad(idx);
         if (msg && msg->type == chatd::Message::kMsgContact)
         {
             std::string contactMsg;
@@ -3009,11 +3179,12 @@ MegaChatMessage *MegaChatApiImpl::editMessage(MegaChatHandle chatid, MegaChatHan
     if (chatroom)
     {
         Chat &chat = chatroom->chat();
-        Message *originalMsg = findMessage(chatid, msgid);
+        std::unique_ptr<Message> confirmedMsg = findMessage(chatid, msgid);
+        Message *originalMsg = confirmedMsg.get();
         Idx index;
         if (originalMsg)
         {
-            index = chat.msgIndexFromId(msgid);
+            index = chat.msgIndexFromIdOrDb(msgid);
         }
         else   // message may not have an index yet (not confirmed)
         {
@@ -3069,7 +3240,7 @@ MegaChatMessage *MegaChatApiImpl::removeRichLink(MegaChatHandle chatid, MegaChat
     if (chatroom)
     {
         Chat &chat = chatroom->chat();
-        Message *originalMsg = findMessage(chatid, msgid);
+        std::unique_ptr<Message> originalMsg = findMessage(chatid, msgid);
         if (!originalMsg || originalMsg->containMetaSubtype() != Message::ContainsMetaSubType::kRichLink)
         {
             sdkMutex.unlock();
@@ -3093,7 +3264,7 @@ MegaChatMessage *MegaChatApiImpl::removeRichLink(MegaChatHandle chatid, MegaChat
         const Message *editedMsg = chatroom->chat().removeRichLink(*originalMsg, content);
         if (editedMsg)
         {
-            Idx index = chat.msgIndexFromId(msgid);
+            Idx index = chat.msgIndexFromIdOrDb(msgid);
             megaMsg = new MegaChatMessagePrivate(*editedMsg, Message::kSending, index);
         }
 
@@ -3997,108 +4168,15 @@ void MegaChatApiImpl::onPresenceLastGreenUpdated(Id userid, uint16_t lastGreen)
     fireOnChatPresenceLastGreenUpdated(userid, lastGreen);
 }
 
-ChatRequestQueue::ChatRequestQueue()
-{
-    mutex.init(false);
-}
-
-void ChatRequestQueue::push(MegaChatRequestPrivate *request)
-{
-    mutex.lock();
-    requests.push_back(request);
-    mutex.unlock();
-}
-
-void ChatRequestQueue::push_front(MegaChatRequestPrivate *request)
-{
-    mutex.lock();
-    requests.push_front(request);
-    mutex.unlock();
-}
-
-MegaChatRequestPrivate *ChatRequestQueue::pop()
-{
-    mutex.lock();
-    if(requests.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    MegaChatRequestPrivate *request = requests.front();
-    requests.pop_front();
-    mutex.unlock();
-    return request;
-}
-
 void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
 {
-    mutex.lock();
-
-    deque<MegaChatRequestPrivate *>::iterator it = requests.begin();
-    while(it != requests.end())
+    forEach([listener](MegaChatRequestPrivate *request)
     {
-        MegaChatRequestPrivate *request = (*it);
-        if(request->getListener()==listener)
+        if (request->getListener() == listener)
+        {
             request->setListener(NULL);
-        it++;
-    }
-
-    mutex.unlock();
-}
-
-EventQueue::EventQueue()
-{
-    mutex.init(false);
-}
-
-void EventQueue::push(void *transfer)
-{
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
-}
-
-void EventQueue::push_front(void *event)
-{
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
-}
-
-void* EventQueue::pop()
-{
-    mutex.lock();
-    if(events.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
-    return event;
-}
-
-bool EventQueue::isEmpty()
-{
-    bool ret;
-
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
-
-    return ret;
-}
-
-size_t EventQueue::size()
-{
-    size_t ret;
-
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
-
-    return ret;
+        }
+    });
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -4118,6 +4196,7 @@ MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener
     this->mMessage = NULL;
     this->mMegaNodeList = NULL;
     this->mMegaHandleList = NULL;
+    this->mSearchListener = NULL;
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(MegaChatRequestPrivate &request)
@@ -4142,6 +4221,7 @@ MegaChatRequestPrivate::MegaChatRequestPrivate(MegaChatRequestPrivate &request)
     this->setMegaChatMessage(request.getMegaChatMessage());
     this->setMegaNodeList(request.getMegaNodeList());
     this->setMegaHandleList(request.getMegaHandleList());
+    this->setSearchListener(request.getSearchListener());
     if (mMegaHandleList)
     {
         for (unsigned int i = 0; i < mMegaHandleList->size(); i++)
@@ -4208,6 +4288,7 @@ const char *MegaChatRequestPrivate::getRequestString() const
         case TYPE_PUSH_RECEIVED: return "PUSH_RECEIVED";
         case TYPE_SET_LAST_GREEN_VISIBLE: return "SET_LAST_GREEN_VISIBLE";
         case TYPE_LAST_GREEN: return "TYPE_LAST_GREEN";
+        case TYPE_SEARCH_MESSAGES: return "SEARCH_MESSAGES";
     }
     return "UNKNOWN";
 }
@@ -4406,6 +4487,16 @@ void MegaChatRequestPrivate::setParamType(int paramType)
     this->mParamType = paramType;
 }
 
+MegaChatSearchListener *MegaChatRequestPrivate::getSearchListener() const
+{
+    return mSearchListener;
+}
+
+void MegaChatRequestPrivate::setSearchListener(MegaChatSearchListener *searchListener)
+{
+    this->mSearchListener = searchListener;
+}
+
 #ifndef KARERE_DISABLE_WEBRTC
 
 MegaChatSessionPrivate::MegaChatSessionPrivate(const rtcModule::ISession &session)
@@ -5029,7 +5120,131 @@ void MegaChatCallPrivate::setCaller(Id caller)
     this->callerId = caller;
 }
 
+MegaChatVideoFrameBuffer::MegaChatVideoFrameBuffer(int width, int height)
+    : mRefs(0)
+{
+    this->width = width;
+    this->height = height;
+    buffer = new ::mega::byte[size()];
+}
+
+MegaChatVideoFrameBuffer::~MegaChatVideoFrameBuffer()
+{
+    delete [] buffer;
+}
+
+void MegaChatVideoFrameBuffer::unref()
+{
+    if (mRefs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    // the buffer may hold the last reference to the pool, keep it alive until recycle() returns
+    std::shared_ptr<MegaChatVideoFramePool> pool(std::move(mPool));
+    pool->recycle(this);
+}
+
+MegaChatVideoFramePool::~MegaChatVideoFramePool()
+{
+    for (auto& it: mFree)
+    {
+        for (MegaChatVideoFrameBuffer *frame: it.second)
+        {
+            delete frame;
+        }
+    }
+}
+
+MegaChatVideoFrameBuffer *MegaChatVideoFramePool::get(int width, int height)
+{
+    MegaChatVideoFrameBuffer *frame = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mFree.find(std::make_pair(width, height));
+        if (it != mFree.end() && !it->second.empty())
+        {
+            frame = it->second.back();
+            it->second.pop_back();
+            mFreeCount--;
+        }
+    }
+    if (!frame)
+    {
+        frame = new MegaChatVideoFrameBuffer(width, height);
+    }
+    frame->mRefs.store(1, std::memory_order_relaxed);
+    frame->mPool = shared_from_this();
+    return frame;
+}
+
+void MegaChatVideoFramePool::recycle(MegaChatVideoFrameBuffer *frame)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto key = std::make_pair(frame->width, frame->height);
+    if (mFreeCount >= kMaxFree)
+    {
+        // make room by releasing a buffer of another resolution, if any
+        auto it = mFree.begin();
+        while (it != mFree.end() && (it->first == key || it->second.empty()))
+        {
+            it++;
+        }
+        if (it == mFree.end())
+        {
+            delete frame;
+            return;
+        }
+        delete it->second.back();
+        it->second.pop_back();
+        if (it->second.empty())
+        {
+            mFree.erase(it);
+        }
+        mFreeCount--;
+    }
+    mFree[key].push_back(frame);
+    mFreeCount++;
+}
+
+MegaChatVideoFramePrivate::MegaChatVideoFramePrivate(MegaChatVideoFrameBuffer *frame)
+{
+    mFrame = frame;
+    mFrame->ref();
+}
+
+MegaChatVideoFramePrivate::~MegaChatVideoFramePrivate()
+{
+    mFrame->unref();
+}
+
+MegaChatVideoFrame *MegaChatVideoFramePrivate::copy() const
+{
+    return new MegaChatVideoFramePrivate(mFrame);
+}
+
+char *MegaChatVideoFramePrivate::getBuffer() const
+{
+    return (char *)mFrame->buffer;
+}
+
+size_t MegaChatVideoFramePrivate::getSize() const
+{
+    return mFrame->size();
+}
+
+int MegaChatVideoFramePrivate::getWidth() const
+{
+    return mFrame->width;
+}
+
+int MegaChatVideoFramePrivate::getHeight() const
+{
+    return mFrame->height;
+}
+
 MegaChatVideoReceiver::MegaChatVideoReceiver(MegaChatApiImpl *chatApi, rtcModule::ICall *call, MegaChatHandle peerid)
+    : mFramePool(std::make_shared<MegaChatVideoFramePool>())
 {
     this->chatApi = chatApi;
     chatid = call->chat().chatId();
@@ -5042,10 +5257,7 @@ MegaChatVideoReceiver::~MegaChatVideoReceiver()
 
 void* MegaChatVideoReceiver::getImageBuffer(unsigned short width, unsigned short height, void*& userData)
 {
-    MegaChatVideoFrame *frame = new MegaChatVideoFrame;
-    frame->width = width;
-    frame->height = height;
-    frame->buffer = new ::mega::byte[width * height * 4];  // in format ARGB: 4 bytes per pixel
+    MegaChatVideoFrameBuffer *frame = mFramePool->get(width, height);
     userData = frame;
     return frame->buffer;
 }
@@ -5053,11 +5265,10 @@ void* MegaChatVideoReceiver::getImageBuffer(unsigned short width, unsigned short
 void MegaChatVideoReceiver::frameComplete(void *userData)
 {
     chatApi->videoMutex.lock();
-    MegaChatVideoFrame *frame = (MegaChatVideoFrame *)userData;
-    chatApi->fireOnChatVideoData(chatid, peerid, frame->width, frame->height, (char *)frame->buffer);
+    MegaChatVideoFrameBuffer *frame = (MegaChatVideoFrameBuffer *)userData;
+    chatApi->fireOnChatVideoData(chatid, peerid, frame);
     chatApi->videoMutex.unlock();
-    delete [] frame->buffer;
-    delete frame;
+    frame->unref();     // the buffer goes back to the pool, unless the app keeps a copy of the frame
 }
 
 void MegaChatVideoReceiver::onVideoAttach()
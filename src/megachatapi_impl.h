@@ -41,8 +41,13 @@
 #include <sdkApi.h>
 #include <karereCommon.h>
 #include <logger.h>
+#include <base/mpscQueue.h>
+#include <base/timerWheel.h>
 #include <rapidjson/document.h>
 #include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "net/libwebsocketsIO.h"
 #include "waiter/libuvWaiter.h"
 
@@ -98,6 +103,9 @@ public:
     void setMegaHandleListByChat(MegaChatHandle chatid, mega::MegaHandleList *handlelist);
     void setParamType(int paramType);
 
+    MegaChatSearchListener *getSearchListener() const;
+    void setSearchListener(MegaChatSearchListener *searchListener);
+
 protected:
     int type;
     int tag;
@@ -116,6 +124,7 @@ protected:
     mega::MegaHandleList *mMegaHandleList;
     std::map<MegaChatHandle, mega::MegaHandleList*> mMegaHandleListMap;
     int mParamType;
+    MegaChatSearchListener *mSearchListener;
 };
 
 class MegaChatPresenceConfigPrivate : public MegaChatPresenceConfig
@@ -263,12 +272,65 @@ protected:
     bool mIsCaller;
 };
 
-class MegaChatVideoFrame
+class MegaChatVideoFramePool;
+
+/** A decoded frame, whose buffer is taken from the MegaChatVideoFramePool of the receiver
+ * and given back to it when the last reference is released */
+class MegaChatVideoFrameBuffer
 {
 public:
     unsigned char *buffer;
     int width;
     int height;
+
+    MegaChatVideoFrameBuffer(int width, int height);
+    ~MegaChatVideoFrameBuffer();
+    size_t size() const { return (size_t)width * height * 4; }  // in format ARGB: 4 bytes per pixel
+    void ref() { mRefs.fetch_add(1, std::memory_order_relaxed); }
+    void unref();
+
+protected:
+    friend class MegaChatVideoFramePool;
+    std::atomic<int> mRefs;
+    std::shared_ptr<MegaChatVideoFramePool> mPool;  // only while the buffer is in use
+};
+
+/** @brief Pool of the frame buffers of a MegaChatVideoReceiver.
+ *
+ * The free buffers are kept by resolution, so that a stream reuses the same couple of
+ * buffers instead of allocating one per frame. At most \c kMaxFree buffers are kept, and
+ * when the resolution changes, the buffers of the previous ones are released first.
+ * Frames retained by the application keep the pool alive, and can be released by any thread.
+ */
+class MegaChatVideoFramePool : public std::enable_shared_from_this<MegaChatVideoFramePool>
+{
+public:
+    enum { kMaxFree = 4 };
+    ~MegaChatVideoFramePool();
+    /** Returns a buffer with a single reference */
+    MegaChatVideoFrameBuffer *get(int width, int height);
+
+protected:
+    friend class MegaChatVideoFrameBuffer;
+    std::mutex mMutex;
+    std::map<std::pair<int, int>, std::vector<MegaChatVideoFrameBuffer *>> mFree;
+    size_t mFreeCount = 0;
+    void recycle(MegaChatVideoFrameBuffer *frame);
+};
+
+class MegaChatVideoFramePrivate : public MegaChatVideoFrame
+{
+public:
+    MegaChatVideoFramePrivate(MegaChatVideoFrameBuffer *frame);
+    virtual ~MegaChatVideoFramePrivate();
+    virtual MegaChatVideoFrame *copy() const;
+    virtual char *getBuffer() const;
+    virtual size_t getSize() const;
+    virtual int getWidth() const;
+    virtual int getHeight() const;
+
+private:
+    MegaChatVideoFrameBuffer *mFrame;
 };
 
 class MegaChatVideoReceiver : public rtcModule::IVideoRenderer
@@ -294,6 +356,7 @@ protected:
     rtcModule::ICall *call;
     MegaChatHandle chatid;
     MegaChatHandle peerid;
+    std::shared_ptr<MegaChatVideoFramePool> mFramePool;
 };
 
 #endif
@@ -818,34 +881,16 @@ private:
 };
 
 //Thread safe request queue
-class ChatRequestQueue
+// Requests are pushed by app threads, and popped by the thread of MegaChatApiImpl
+class ChatRequestQueue: public karere::MpscQueue<MegaChatRequestPrivate *>
 {
-    protected:
-        std::deque<MegaChatRequestPrivate *> requests;
-        mega::MegaMutex mutex;
-
     public:
-        ChatRequestQueue();
-        void push(MegaChatRequestPrivate *request);
-        void push_front(MegaChatRequestPrivate *request);
-        MegaChatRequestPrivate * pop();
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
-class EventQueue
+//Thread safe event queue: events are posted from any thread, and processed by the thread of MegaChatApiImpl
+class EventQueue: public karere::MpscQueue<void *>
 {
-protected:
-    std::deque<void *> events;
-    mega::MegaMutex mutex;
-
-public:
-    EventQueue();
-    void push(void* event);
-    void push_front(void *event);
-    void* pop();
-    bool isEmpty();
-    size_t size();
 };
 
 class MegaChatApiImpl :
@@ -860,6 +905,7 @@ public:
     mega::MegaMutex sdkMutex;
     mega::MegaMutex videoMutex;
     mega::Waiter *waiter;
+    karere::TimerWheel *timerWheel;
 private:
     MegaChatApi *chatApi;
     mega::MegaApi *megaApi;
@@ -867,6 +913,17 @@ private:
     karere::Client *mClient;
     bool terminating;
 
+    // local cache journal settings, applied to the karere client upon init()
+    bool mDbWalMode = false;
+    int mDbSynchronous = MegaChatApi::DB_SYNC_NORMAL;
+    bool mDbAsyncWrites = false;
+
+    // limits of the history kept in cache (MEGACHAT_INVALID_HANDLE for the default), applied upon init()
+    std::map<MegaChatHandle, chatd::HistoryRetention> mHistoryRetention;
+
+    // max number of messages kept in RAM for each chat (0: no limit), applied upon init()
+    unsigned int mMaxMessagesInMemory = 0;
+
     mega::MegaThread thread;
     int threadExit;
     static void *threadEntryPoint(void *param);
@@ -912,8 +969,13 @@ public:
     static void setLoggerClass(MegaChatLogger *megaLogger);
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
+    static void setLogAsync(bool enable, bool dropWhenFull, bool flushOnCrash);
 
     int init(const char *sid);
+    void setDatabaseWalMode(bool enable, int synchronous);
+    void setDatabaseAsyncWrites(bool enable);
+    void setHistoryRetention(MegaChatHandle chatid, unsigned int maxMessages, unsigned int maxAge, long long maxBytes);
+    void setMaxMessagesInMemory(unsigned int maxMessages);
     int getInitState();
 
     MegaChatRoomHandler* getChatRoomHandler(MegaChatHandle chatid);
@@ -921,7 +983,7 @@ public:
 
     karere::ChatRoom *findChatRoom(MegaChatHandle chatid);
     karere::ChatRoom *findChatRoomByUser(MegaChatHandle userhandle);
-    chatd::Message *findMessage(MegaChatHandle chatid, MegaChatHandle msgid);
+    std::unique_ptr<chatd::Message> findMessage(MegaChatHandle chatid, MegaChatHandle msgid);
     chatd::Message *findMessageNotConfirmed(MegaChatHandle chatid, MegaChatHandle msgxid);
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -936,6 +998,7 @@ public:
     void addNodeHistoryListener(MegaChatHandle chatid, MegaChatNodeHistoryListener *listener);
     void removeNodeHistoryListener(MegaChatHandle chatid, MegaChatNodeHistoryListener *listener);
     int loadAttachments(MegaChatHandle chatid, int count);
+    void searchMessages(MegaChatHandle chatid, const char *query, int limit, MegaChatSearchListener *searchListener, MegaChatRequestListener *listener = NULL);
 
     // ============= Listeners ================
 
@@ -966,7 +1029,7 @@ public:
     void fireOnChatCallUpdate(MegaChatCallPrivate *call);
 
     // MegaChatVideoListener callbacks
-    void fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, int width, int height, char*buffer);
+    void fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatVideoFrameBuffer *frame);
 #endif
 
     // MegaChatListener callbacks (specific ones)
@@ -1760,6 +1760,8 @@ bool Call::rejoin(karere::Id userid, uint32_t clientid)
 
 void Call::sendInCallCommand()
 {
+    // call signalling is urgent for chatd::Connection, so it is not held in the
+    // output frame and a failure to write it is reported here
     if (!mChat.sendCommand(Command(OP_INCALL) + mChat.chatId() + uint64_t(0) + uint32_t(0)))
     {
         asyncDestroy(TermCode::kErrNetSignalling, true);
@@ -129,4 +129,15 @@ static inline std::string aesCTRDecrypt(const std::string& ciphertext,
     return text;
 }
 
+/** Decrypts \c len bytes of \c in to \c out. CTR doesn't pad, so the cleartext has the same size */
+static inline void aesCTRDecryptTo(const char* in, char* out, size_t len,
+                            const StaticBuffer& derivedkey, const StaticBuffer& iv)
+{
+    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption decryptor;
+    decryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
+    decryptor.ProcessData((unsigned char*)out, (const unsigned char*)in, len);
+}
+
 }
@@ -30,6 +30,7 @@
 #include <mega.h>
 #include <megaapi.h>
 #include <db.h>
+#include <workerPool.h>
 #ifndef _MSC_VER
 #include <codecvt>   // deprecated
 #endif
@@ -117,7 +118,7 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
         return;
     }
     Id chatid = mProtoHandler.chatid;
-    STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
+    STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", ID_LOGARG(outMsg.id()));
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
     deriveNonceSecret(nonce, derivedNonce);
@@ -125,9 +126,30 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
+
+    if (!isParsedFrom(outMsg))
+        throw std::runtime_error("symmetricDecrypt: the buffer of the message changed after being parsed");
+
+    // the payload is decrypted to a scratch buffer, reused by each thread, and the ciphertext in the
+    // message is only replaced once the cleartext has been parsed, so a failed decryption can be retried
+    static thread_local Buffer cleartext;
+    cleartext.clear();
+    cleartext.reserve(payload.dataSize());
+    aesCTRDecryptTo(payload.buf(), cleartext.buf(), payload.dataSize(), key, derivedNonce);
+    cleartext.setDataSize(payload.dataSize());
+    uint64_t backRefId = outMsg.backRefId;
+    try
+    {
+        parsePayload(cleartext, outMsg);
+    }
+    catch (...)
+    {
+        outMsg.backRefId = backRefId;
+        outMsg.backRefs.clear();
+        throw;
+    }
+    payload.clear();    // it doesn't point to ciphertext anymore
+    signedContent.clear();
     outMsg.setEncrypted(Message::kNotEncrypted);
 }
 
@@ -237,7 +259,7 @@ void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const st
 }
 
 ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+: mProtoHandler(protoHandler), mSrcBuf(binaryMessage.buf()), mSrcSize(binaryMessage.dataSize())
 {
     if(binaryMessage.empty())
     {
@@ -420,7 +442,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
         recordNames.resize(recordNames.size()-2);
         Id chatid = protoHandler.chatid;
         STRONGVELOPE_LOG_DEBUG("msg %s: read %s",
-            binaryMessage.id().toString().c_str(), recordNames.c_str());
+            ID_LOGARG(binaryMessage.id()), recordNames.c_str());
     }
 }
 
@@ -513,14 +535,13 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519,
     const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,
-    karere::UserAttrCache& userAttrCache, SqliteDb &db, Id aChatId, void *ctx)
+    karere::UserAttrCache& userAttrCache, PairwiseKeyCache& pairwiseKeys,
+    SqliteDb &db, Id aChatId, void *ctx)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa),
- mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
+ mUserAttrCache(userAttrCache), mDb(db), mPairwiseKeys(pairwiseKeys), chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
-    loadUnconfirmedKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
     {
@@ -534,6 +555,16 @@ unsigned int ProtocolHandler::getCacheVersion() const
     return mCacheVersion;
 }
 
+void ProtocolHandler::loadKeys()
+{
+    if (mKeysLoaded)
+        return;
+
+    mKeysLoaded = true;
+    loadKeysFromDb();
+    loadUnconfirmedKeysFromDb();
+}
+
 void ProtocolHandler::loadKeysFromDb()
 {
     SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
@@ -656,25 +687,246 @@ void ProtocolHandler::msgEncryptWithKey(const Message& src, MsgCommand& dest,
     dest.updateMsgSize();
 }
 
+struct PairwiseKeyCache::Entry
+{
+    PairwiseKeyCache& cache;
+    karere::Id userid;
+    EcKey pubKey;                   // Cu25519 key of the peer that the key was derived from
+    std::shared_ptr<SendKey> key;
+    bool verified = false;          // pubKey was checked against the UserAttrCache
+    UserAttrCache::Handle monitor;  // notifies changes of the Cu25519 key of the peer
+    Entry(PairwiseKeyCache& aCache, karere::Id aUserid): cache(aCache), userid(aUserid) {}
+    bool derivedFrom(const StaticBuffer& aPubKey) const
+    {
+        return key && pubKey.dataSize() == aPubKey.dataSize()
+            && !memcmp(pubKey.buf(), aPubKey.buf(), aPubKey.dataSize());
+    }
+};
+
+PairwiseKeyCache::PairwiseKeyCache(const StaticBuffer& myPrivCu25519,
+    karere::UserAttrCache& userAttrCache, SqliteDb& db)
+: mMyPrivCu25519(myPrivCu25519), mUserAttrCache(userAttrCache), mDb(db)
+{
+    deriveSharedKey(mMyPrivCu25519, mWrapKey, "strongvelope pairwise key cache");
+}
+
+PairwiseKeyCache::~PairwiseKeyCache()
+{
+    for (auto& item: mEntries)
+    {
+        mUserAttrCache.removeCb(item.second->monitor);
+    }
+}
+
+void PairwiseKeyCache::loadFromDb()
+{
+    mLoaded = true;
+    SqliteStmt stmt(mDb, "select userid, pubkey, key from pairwise_keys");
+    while (stmt.step())
+    {
+        Id userid(stmt.uint64Col(0));
+        std::unique_ptr<Entry> entry(new Entry(*this, userid));
+        SendKey wrapped;
+        try
+        {
+            stmt.blobCol(1, entry->pubKey);
+            stmt.blobCol(2, wrapped);
+        }
+        catch(std::exception& e)
+        {
+            KARERE_LOG_WARNING(krLogChannel_strongvelope, "Discarding cached pairwise key of user %s: %s", userid.toString().c_str(), e.what());
+            continue;
+        }
+        if (wrapped.dataSize() != SVCRYPTO_KEY_SIZE)
+            continue;
+
+        entry->key = std::make_shared<SendKey>();
+        aesECBDecrypt(wrapped, mWrapKey, *entry->key);
+        mEntries.emplace(userid, std::move(entry));
+    }
+    KARERE_LOG_DEBUG(krLogChannel_strongvelope, "Loaded %zu pairwise keys from database", mEntries.size());
+}
+
+promise::Promise<std::shared_ptr<SendKey>> PairwiseKeyCache::get(karere::Id userid)
+{
+    if (!mLoaded)
+        loadFromDb();
+
+    auto it = mEntries.find(userid);
+    if (it != mEntries.end() && it->second->verified && it->second->key)
+    {
+        return it->second->key;
+    }
+
+    auto wptr = weakHandle();
+    return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
+    .then([wptr, this, userid](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
+    {
+        wptr.throwIfDeleted();
+        if (pubKey->empty())
+            return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
+        if (pubKey->dataSize() != crypto_scalarmult_BYTES)
+            return promise::Error("Invalid Cu25519 chat key for user "+userid.toString());
+
+        return update(userid, *pubKey);
+    });
+}
+
+promise::Promise<std::shared_ptr<PairwiseKeyCache::KeyMap>>
+PairwiseKeyCache::getMany(const karere::SetOfIds& users)
+{
+    if (!mLoaded)
+        loadFromDb();
+
+    struct Batch
+    {
+        std::shared_ptr<KeyMap> keys = std::make_shared<KeyMap>();
+        std::vector<std::pair<karere::Id, std::shared_ptr<EcKey>>> pubKeys;  // of the users whose key isn't verified
+    };
+    auto batch = std::make_shared<Batch>();
+
+    // all the missing public keys are requested before waiting for any of them
+    std::vector<promise::Promise<void>> fetches;
+    for (auto& userid: users)
+    {
+        auto it = mEntries.find(userid);
+        if (it != mEntries.end() && it->second->verified && it->second->key)
+        {
+            batch->keys->emplace(userid, it->second->key);
+            continue;
+        }
+
+        auto pms = mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
+        .then([batch, userid](Buffer* pubKey)
+        {
+            if (pubKey->dataSize() == crypto_scalarmult_BYTES)
+                batch->pubKeys.emplace_back(userid, std::make_shared<EcKey>(*pubKey));
+        })
+        .fail([](const promise::Error&)
+        {
+            // the user is left out of the result, the caller will fall back to RSA
+        });
+        if (!pms.done())
+            fetches.push_back(pms);
+    }
+
+    auto wptr = weakHandle();
+    return promise::when(fetches)
+    .then([wptr, this, batch]()
+    {
+        wptr.throwIfDeleted();
+        auto& pubKeys = batch->pubKeys;
+        std::vector<std::shared_ptr<SendKey>> derived(pubKeys.size());
+        for (size_t i = 0; i < pubKeys.size(); i++)
+        {
+            // i.e. the key was loaded from db, and only needed to be verified
+            auto it = mEntries.find(pubKeys[i].first);
+            if (it != mEntries.end() && it->second->derivedFrom(*pubKeys[i].second))
+                derived[i] = it->second->key;
+        }
+
+        // the curve25519 multiplication is the expensive part, and it doesn't touch the cache
+        karere::WorkerPool::instance().parallelFor(pubKeys.size(), [this, &pubKeys, &derived](size_t i)
+        {
+            if (derived[i])
+                return;
+            derived[i] = std::make_shared<SendKey>();
+            deriveKey(*pubKeys[i].second, *derived[i]);
+        });
+
+        for (size_t i = 0; i < pubKeys.size(); i++)
+        {
+            batch->keys->emplace(pubKeys[i].first, update(pubKeys[i].first, *pubKeys[i].second, derived[i]));
+        }
+        return batch->keys;
+    });
+}
+
+void PairwiseKeyCache::deriveKey(const StaticBuffer& pubKey, SendKey& output) const
+{
+    Key<crypto_scalarmult_BYTES> sharedSecret;
+    sharedSecret.setDataSize(crypto_scalarmult_BYTES);
+    auto ignore = crypto_scalarmult(sharedSecret.ubuf(), mMyPrivCu25519.ubuf(), pubKey.ubuf());
+    (void)ignore;
+    deriveSharedKey(sharedSecret, output);
+}
+
+/** Returns the key derived from \c pubKey, deriving it (unless \c key is already the result)
+ * only if the cached one was derived from a different key. Starts monitoring changes of the
+ * Cu25519 key */
+std::shared_ptr<SendKey> PairwiseKeyCache::update(karere::Id userid, const StaticBuffer& pubKey,
+    std::shared_ptr<SendKey> key)
+{
+    auto& entry = mEntries[userid];
+    if (!entry)
+    {
+        entry.reset(new Entry(*this, userid));
+    }
+
+    if (!entry->derivedFrom(pubKey))
+    {
+        if (!key)
+        {
+            key = std::make_shared<SendKey>();
+            deriveKey(pubKey, *key);
+        }
+        entry->key = key;
+        entry->pubKey.assign(pubKey.buf(), pubKey.dataSize());
+
+        SendKey wrapped;
+        aesECBEncrypt(*entry->key, mWrapKey, wrapped);
+        mDb.query("insert or replace into pairwise_keys(userid, pubkey, key) values(?,?,?)",
+            userid, entry->pubKey, wrapped);
+    }
+    entry->verified = true;
+
+    if (!entry->monitor.isValid())
+    {
+        // called immediately with the current key, which is the same we have
+        entry->monitor = mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY,
+            entry.get(), &PairwiseKeyCache::onPubKeyChanged);
+    }
+    return entry->key;
+}
+
+void PairwiseKeyCache::onPubKeyChanged(Buffer* pubKey, void* userp)
+{
+    auto entry = static_cast<Entry*>(userp);
+    if (!entry->key)
+        return;
+
+    if (pubKey && entry->derivedFrom(*pubKey))
+        return;
+
+    KARERE_LOG_WARNING(krLogChannel_strongvelope, "Cu25519 key of user %s has changed, discarding its pairwise key", entry->userid.toString().c_str());
+    entry->cache.invalidate(entry->userid);
+}
+
+void PairwiseKeyCache::invalidate(karere::Id userid)
+{
+    auto it = mEntries.find(userid);
+    if (it != mEntries.end())
+    {
+        it->second->key.reset();
+        it->second->verified = false;
+    }
+    mDb.query("delete from pairwise_keys where userid = ?", userid);
+}
+
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padString)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
+    if (padString == SVCRYPTO_PAIRWISE_KEY)
     {
-        return it->second;
+        return mPairwiseKeys.get(userid);
     }
+
+    // keys with other paddings are not cached
     auto wptr = weakHandle();
     return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
     .then([wptr, this, userid, padString](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
     {
         wptr.throwIfDeleted();
-        // We may have had 2 almost parallel requests, and the second may
-        // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
-
         if (pubKey->empty())
             return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
         Key<crypto_scalarmult_BYTES> sharedSecret;
@@ -683,7 +935,6 @@ ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padSt
         (void)ignore;
         auto result = std::make_shared<SendKey>();
         deriveSharedKey(sharedSecret, *result, padString);
-        mSymmKeyCache.emplace(userid, result);
         return result;
     });
 }
@@ -708,7 +959,7 @@ ProtocolHandler::encryptKeyTo(const std::shared_ptr<SendKey>& sendKey, karere::I
     .fail([wptr, this, toUser, sendKey](const promise::Error& err)
     {
         wptr.throwIfDeleted();
-        STRONGVELOPE_LOG_DEBUG("Can't use EC encryption for user %s (error '%s'), falling back to RSA", toUser.toString().c_str(), err.what());
+        STRONGVELOPE_LOG_DEBUG("Can't use EC encryption for user %s (error '%s'), falling back to RSA", ID_LOGARG(toUser), err.what());
         return rsaEncryptTo(std::static_pointer_cast<StaticBuffer>(sendKey), toUser);
     })
     .fail([toUser, wptr, this](const promise::Error& err)
@@ -807,7 +1058,7 @@ ProtocolHandler::decryptKey(std::shared_ptr<Buffer>& key, Id sender, Id receiver
     }
     else    // legacy RSA encryption
     {
-        STRONGVELOPE_LOG_DEBUG("Decrypting key from user %s using RSA", sender.toString().c_str());
+        STRONGVELOPE_LOG_DEBUG("Decrypting key from user %s using RSA", ID_LOGARG(sender));
         Buffer buf; //TODO: Maybe refine this
         rsaDecrypt(*key, buf);
         if (buf.dataSize() != AES::BLOCKSIZE)
@@ -838,6 +1089,7 @@ void ProtocolHandler::rsaDecrypt(const StaticBuffer& data, Buffer& output)
 promise::Promise<std::pair<MsgCommand*, KeyCommand*>>
 ProtocolHandler::msgEncrypt(Message* msg, const SetOfIds &recipients, MsgCommand* msgCmd)
 {
+    loadKeys();
     // if keyid has not been assigned yet...
     if (msg->keyid == CHATD_KEYID_INVALID)
     {
@@ -1000,6 +1252,7 @@ promise::Promise<Message*> ProtocolHandler::handleManagementMessage(
 //is decrypted.
 Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
 {
+    loadKeys();
     unsigned int cacheVersion = mCacheVersion;
     try
     {
@@ -1077,19 +1330,35 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
                 return promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
             }
 
-            if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
+            // the views to the payload and signature are not valid anymore if the buffer of the
+            // message changed while waiting for the keys
+            std::shared_ptr<ParsedMessage> parsed = parsedMsg;
+            try
             {
-                return promise::Error("Signature invalid for message "+
-                                      message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
-            }
+                if (!parsed->isParsedFrom(*message))
+                {
+                    parsed = std::make_shared<ParsedMessage>(*message, *this);
+                }
+
+                if (!parsed->verifySignature(ctx->edKey, *ctx->sendKey))
+                {
+                    return promise::Error("Signature invalid for message "+
+                                          message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
+                }
+
+                if (isLegacy)
+                {
+                    return legacyMsgDecrypt(parsed, message, *ctx->sendKey);
+                }
 
-            if (isLegacy)
+                // Decrypt message payload.
+                parsed->symmetricDecrypt(*ctx->sendKey, *message);
+            }
+            catch(std::runtime_error& e)
             {
-                return legacyMsgDecrypt(parsedMsg, message, *ctx->sendKey);
+                // the message is still encrypted, it can be decrypted again
+                return promise::Error(e.what(), EINVAL, SVCRYPTO_EMALFORMED);
             }
-
-            // Decrypt message payload.
-            parsedMsg->symmetricDecrypt(*ctx->sendKey, *message);
             return message;
         });
     }
@@ -1100,9 +1369,81 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+size_t ProtocolHandler::msgDecryptBatch(const std::vector<Message*>& msgs)
+{
+    loadKeys();
+    struct Job
+    {
+        Message* message;
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        std::shared_ptr<SendKey> sendKey;
+        EcKey edKey;
+    };
+    std::vector<Job> jobs;
+    jobs.reserve(msgs.size());
+
+    // same checks than msgDecrypt(), but only the messages whose keys are already available
+    // can be decrypted here. Management and legacy messages are left for msgDecrypt() too
+    for (auto message: msgs)
+    {
+        if (message->empty() || message->keyid == 0 || message->userid == karere::Id::COMMANDER())
+            break;
+
+        auto kit = mKeys.find(UserKeyId(message->userid, message->keyid));
+        if (kit == mKeys.end() || !kit->second.key)
+            break;
+
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        try
+        {
+            parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+        }
+        catch(std::runtime_error&)
+        {
+            break;  // msgDecrypt() will report it
+        }
+        if (parsedMsg->protocolVersion <= 1)
+            break;
+
+        auto edPms = mUserAttrCache.getAttr(parsedMsg->sender, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+        if (!edPms.succeeded() || !edPms.value() || edPms.value()->dataSize() != 32)
+            break;
+
+        message->type = parsedMsg->type;
+        jobs.emplace_back();
+        Job& job = jobs.back();
+        job.message = message;
+        job.parsedMsg = parsedMsg;
+        job.sendKey = kit->second.key;
+        job.edKey.assign(edPms.value()->buf(), edPms.value()->dataSize());
+    }
+
+    // verification of signatures and AES-CTR decryption don't touch any shared state
+    karere::WorkerPool::instance().parallelFor(jobs.size(), [&jobs](size_t i)
+    {
+        Job& job = jobs[i];
+        Message& message = *job.message;
+        try
+        {
+            if (!job.parsedMsg->verifySignature(job.edKey, *job.sendKey))
+            {
+                message.setEncrypted(Message::kEncryptedSignature);
+                return;
+            }
+            job.parsedMsg->symmetricDecrypt(*job.sendKey, message);
+        }
+        catch(std::exception&)
+        {
+            message.setEncrypted(Message::kEncryptedMalformed);
+        }
+    });
+    return jobs.size();
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
+    loadKeys();
     if (parsedMsg->encryptedKey.empty())
         return promise::Error("legacyExtractKeys: No encrypted keys found in parsed message", EPROTO, SVCRYPTO_ERRTYPE);
 
@@ -1141,6 +1482,7 @@ ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedM
 void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
                                     const char* data, uint16_t dataLen)
 {
+    loadKeys();
     auto encKey = std::make_shared<Buffer>(data, dataLen);
     UserKeyId ukid(sender, keyid);
 
@@ -1161,7 +1503,7 @@ void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
     }
 
     // if it was not being decrypted yet, associate a promise
-    STRONGVELOPE_LOG_DEBUG("onKeyReceived: Created a key entry with promise for key %d of user %s", keyid, sender.toString().c_str());
+    STRONGVELOPE_LOG_DEBUG("onKeyReceived: Created a key entry with promise for key %d of user %s", keyid, ID_LOGARG(sender));
     auto wptr = weakHandle();
     entry.pms.reset(new Promise<std::shared_ptr<SendKey>>);
     pms.then([this, wptr, ukid](const std::shared_ptr<SendKey>& key)
@@ -1187,8 +1529,9 @@ void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
 
 void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key)
 {
+    loadKeys();
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
-    STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.keyid, ukid.user.toString().c_str());
+    STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.keyid, ID_LOGARG(ukid.user));
 
     auto& entry = mKeys[ukid];
     if (entry.key)  // if KeyEntry already had a decrypted key assigned to it...
@@ -1196,7 +1539,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
             throw std::runtime_error("addDecryptedKey: Key with id "+std::to_string(ukid.keyid)+" from user '"+ukid.user.toString()+"' already known but different");
 
-        STRONGVELOPE_LOG_DEBUG("addDecryptedKey: Key %lld from user %s already known and is same", ukid.keyid, ukid.user.toString().c_str());
+        STRONGVELOPE_LOG_DEBUG("addDecryptedKey: Key %lld from user %s already known and is same", ukid.keyid, ID_LOGARG(ukid.user));
     }
     else    // new key was confirmed or received key wast not decrypted yet...
     {
@@ -1223,6 +1566,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
 {
+    loadKeys();
     auto kit = mKeys.find(ukid);
     if (kit == mKeys.end())
     {
@@ -1257,6 +1601,7 @@ ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
 
 void ProtocolHandler::onKeyConfirmed(KeyId localkeyid, KeyId keyid)
 {
+    loadKeys();
     // new keys are always confirmed in the same order than received by chatd
     auto it = mUnconfirmedKeys.begin();
     if (it == mUnconfirmedKeys.end())
@@ -1292,6 +1637,7 @@ void ProtocolHandler::onKeyConfirmed(KeyId localkeyid, KeyId keyid)
 
 void ProtocolHandler::onKeyRejected()
 {
+    loadKeys();
     // new keys are always rejected in the same order than received by chatd
     auto it = mUnconfirmedKeys.begin();
     if (it == mUnconfirmedKeys.end())
@@ -1344,30 +1690,47 @@ KeyId ProtocolHandler::createLocalKeyId()
 promise::Promise<std::pair<KeyCommand*, std::shared_ptr<SendKey>>>
 ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key, const SetOfIds &participants, KeyId localkeyid)
 {
-    auto keyCmd = new KeyCommand(chatid, localkeyid);
-
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
     SetOfIds users = participants;
-    std::vector<Promise<void>> promises;
-    promises.reserve(users.size());
+    auto wptr = weakHandle();
+    auto keysPms = mForceRsa
+        ? promise::Promise<std::shared_ptr<PairwiseKeyCache::KeyMap>>(std::make_shared<PairwiseKeyCache::KeyMap>())
+        : mPairwiseKeys.getMany(users);
 
-    for (auto& user: users)
+    return keysPms.then([wptr, this, key, users, localkeyid](const std::shared_ptr<PairwiseKeyCache::KeyMap>& symKeys)
     {
-        auto pms = encryptKeyTo(key, user)
-        .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+        wptr.throwIfDeleted();
+        auto keyCmd = new KeyCommand(chatid, localkeyid, 17 + users.size() * (10 + AES::BLOCKSIZE));
+
+        // users without a Cu25519 key go through the slow path (RSA)
+        std::vector<Promise<void>> promises;
+        SendKey encryptedKey;
+        for (auto& user: users)
         {
-            assert(encryptedKey && !encryptedKey->empty());
-            keyCmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
-        });
-        promises.push_back(pms);
-    }
+            auto it = symKeys->find(user);
+            if (it != symKeys->end())
+            {
+                aesECBEncrypt(*key, *it->second, encryptedKey);
+                keyCmd->addKey(user, encryptedKey.buf(), encryptedKey.dataSize());
+                continue;
+            }
 
-    // wait for key encrypted to all participants (immediate only if all pubkeys were available)
-    return promise::when(promises)
-    .then([keyCmd, key]()
-    {
-        return std::make_pair(keyCmd, key);
+            auto pms = encryptKeyTo(key, user)
+            .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+            {
+                assert(encryptedKey && !encryptedKey->empty());
+                keyCmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
+            });
+            promises.push_back(pms);
+        }
+
+        // wait for key encrypted to all participants (immediate only if all pubkeys were available)
+        return promise::when(promises)
+        .then([keyCmd, key]()
+        {
+            return std::make_pair(keyCmd, key);
+        });
     });
 }
 
@@ -1473,6 +1836,7 @@ void ProtocolHandler::onUserLeave(Id /*userid*/)
 
 void ProtocolHandler::resetSendKey()
 {
+    loadKeys();
     mCurrentKey.reset();
     mCurrentKeyId = CHATD_KEYID_INVALID;
     mCurrentKeyParticipants = SetOfIds();
@@ -21,7 +21,7 @@
 #include <karereCommon.h>
 #include <base/trackDelete.h>
 
-#define STRONGVELOPE_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_strongvelope, "%s: " fmtString, chatid.toString().c_str(), ##__VA_ARGS__)
+#define STRONGVELOPE_LOG_DEBUG(fmtString,...) KARERE_LOGB_DEBUG(krLogChannel_strongvelope, "%s: " fmtString, ID_LOGARG(chatid), ##__VA_ARGS__)
 #define STRONGVELOPE_LOG_WARNING(fmtString,...) KARERE_LOG_WARNING(krLogChannel_strongvelope, "%s: " fmtString, chatid.toString().c_str(), ##__VA_ARGS__)
 #define STRONGVELOPE_LOG_ERROR(fmtString,...) KARERE_LOG_ERROR(krLogChannel_strongvelope, "%s: " fmtString, chatid.toString().c_str(), ##__VA_ARGS__)
 
@@ -167,8 +167,12 @@ struct ParsedMessage: public karere::DeleteTrackable
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
+    // payload and signedContent point into the buffer of the source message, which must
+    // be kept alive and unmodified until the message has been decrypted. @see isParsedFrom()
+    StaticBuffer payload = StaticBuffer(nullptr, 0);
+    StaticBuffer signedContent = StaticBuffer(nullptr, 0);
+    const char* mSrcBuf;
+    size_t mSrcSize;
     Buffer signature;
     unsigned char type;
     //legacy key stuff
@@ -176,6 +180,9 @@ struct ParsedMessage: public karere::DeleteTrackable
     uint64_t prevKeyId;
     Buffer encryptedKey; //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
+    /** Whether the views to the payload and signed content still point into the buffer of \c msg,
+     * ie. it hasn't been reallocated or resized since it was parsed (i.e. while waiting for keys) */
+    bool isParsedFrom(const chatd::Message& msg) const { return msg.buf() == mSrcBuf && msg.dataSize() == mSrcSize; }
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
@@ -238,6 +245,51 @@ class TlvWriter;
 extern const std::string SVCRYPTO_PAIRWISE_KEY;
 void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
 
+/**
+ * @brief Account-wide cache of the pairwise symmetric keys (pubCu255 * privCu255),
+ * shared by the ProtocolHandler of every chat, so the key of each peer is derived
+ * only once. Keys are persisted in the db, encrypted with a key derived from our
+ * own private Cu25519 key, so they survive restarts as well.
+ *
+ * Each key is stored together with the public Cu25519 key it was derived from.
+ * A key loaded from db is checked against the public key in the UserAttrCache
+ * before its first use, and from then on the cache monitors the attribute and
+ * drops the key as soon as it changes.
+ */
+class PairwiseKeyCache: public karere::DeleteTrackable
+{
+protected:
+    struct Entry;
+    EcKey mMyPrivCu25519;
+    SendKey mWrapKey;   // encrypts the keys persisted in db
+    karere::UserAttrCache& mUserAttrCache;
+    SqliteDb& mDb;
+    std::map<karere::Id, std::unique_ptr<Entry>> mEntries;
+    bool mLoaded = false;
+
+    void loadFromDb();
+    void deriveKey(const StaticBuffer& pubKey, SendKey& output) const;
+    std::shared_ptr<SendKey> update(karere::Id userid, const StaticBuffer& pubKey,
+        std::shared_ptr<SendKey> key = nullptr);
+    static void onPubKeyChanged(Buffer* pubKey, void* userp);
+
+public:
+    typedef std::map<karere::Id, std::shared_ptr<SendKey>> KeyMap;
+
+    PairwiseKeyCache(const StaticBuffer& myPrivCu25519, karere::UserAttrCache& userAttrCache, SqliteDb& db);
+    ~PairwiseKeyCache();
+
+    /** Returns the pairwise key of \c userid, deriving it if not cached yet */
+    promise::Promise<std::shared_ptr<SendKey>> get(karere::Id userid);
+
+    /** Returns the pairwise keys of \c users, deriving the missing ones in parallel.
+     * The users whose public key can't be obtained are left out of the result */
+    promise::Promise<std::shared_ptr<KeyMap>> getMany(const karere::SetOfIds& users);
+
+    /** Forgets the key of \c userid, i.e. because its Cu25519 key has changed */
+    void invalidate(karere::Id userid);
+};
+
 /**
  * @brief The ProtocolHandler class implements ICrypto.
  * @see chatd::ICrypto for more details.
@@ -299,8 +351,8 @@ protected:
     // received and confirmed keys (doesn't include unconfirmed keys)
     std::map<UserKeyId, KeyEntry> mKeys;
 
-    // cache of symmetric keys (pubCu255 * privCu255)
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    // cache of symmetric keys (pubCu255 * privCu255), shared by all chats
+    PairwiseKeyCache& mPairwiseKeys;
 
     // current list of participants (mapped to the `chatd::Client::mUsers`)
     karere::SetOfIds* mParticipants = nullptr;
@@ -308,6 +360,9 @@ protected:
     bool mIsDestroying = false;
     unsigned int mCacheVersion = 0; // updated if history is reloaded
 
+    // keys are loaded from cache upon first use, not for every chat at startup
+    bool mKeysLoaded = false;
+
 public:
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
@@ -316,7 +371,7 @@ public:
     ProtocolHandler(karere::Id ownHandle, const StaticBuffer& PrivCu25519,
         const StaticBuffer& PrivEd25519,
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
-        SqliteDb& db, karere::Id aChatId, void *ctx);
+        PairwiseKeyCache& pairwiseKeys, SqliteDb& db, karere::Id aChatId, void *ctx);
 
     promise::Promise<std::shared_ptr<SendKey>> //must be public to access from ParsedMessage
         decryptKey(std::shared_ptr<Buffer>& key, karere::Id sender, karere::Id receiver);
@@ -333,6 +388,10 @@ protected:
      */
     void loadUnconfirmedKeysFromDb();
 
+    /** Loads the confirmed and unconfirmed keys from cache, if not done yet. It must be
+     * called before any access to \c mKeys, \c mUnconfirmedKeys or the current key */
+    void loadKeys();
+
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid, bool legacy=false);
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
     /**
@@ -394,6 +453,7 @@ public:
     promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
     msgEncrypt(chatd::Message *message, const karere::SetOfIds &recipients, chatd::MsgCommand* msgCmd);
     virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message);
+    virtual size_t msgDecryptBatch(const std::vector<chatd::Message*>& msgs);
     virtual void onKeyReceived(chatd::KeyId keyid, karere::Id sender,
         karere::Id receiver, const char* data, uint16_t dataLen);
     virtual void onKeyConfirmed(chatd::KeyId localkeyid, chatd::KeyId keyid);